@@ -0,0 +1,147 @@
+//
+// Created on 18/10/2026.
+//
+
+/* The frame size of a JPEG roughly scales with 1 / (quality + 1) for the
+ * same scene, so length * (quality + 1) is a measure of the scene
+ * complexity that doesn't depend on the quality setting. The controller
+ * smooths that complexity over the recent frames and divides it by the
+ * per frame budget to find the quality for the next frame.
+ */
+
+#include <string.h>
+
+#include "esp-frame-rate.h"
+
+// Quality may get worse quickly when frames overshoot, but only improves one step per frame
+#define QUALITY_STEP_UP 4
+#define QUALITY_STEP_DOWN 1
+
+// A complexity jump of this factor replaces the average instead of being smoothed in
+#define COMPLEXITY_JUMP 2
+
+static int clamp_quality(const esp_frame_rate_t *rate, int quality) {
+    if (quality < rate->min_quality) {
+        return rate->min_quality;
+    }
+    if (quality > rate->max_quality) {
+        return rate->max_quality;
+    }
+    return quality;
+}
+
+/* Quality is the quality of the sensor now, the buffers already in flight
+ * were taken with it. Buffers is the fb_count of the camera.
+ */
+void esp_frame_rate_init(esp_frame_rate_t *rate, uint32_t target_bps, int min_quality, int max_quality, int quality, size_t buffers) {
+    memset(rate, 0, sizeof(esp_frame_rate_t));
+    rate->target_bps = target_bps;
+    rate->min_quality = min_quality;
+    rate->max_quality = max_quality;
+    rate->quality = clamp_quality(rate, quality);
+
+    rate->buffers = buffers < 1 ? 1 : buffers > ESP_FRAME_RATE_MAX_BUFFERS ? ESP_FRAME_RATE_MAX_BUFFERS : buffers;
+    for (size_t i = 0; i < rate->buffers; i++) {
+        rate->capture_quality[i] = quality;
+    }
+
+    rate->stats.target_bps = target_bps;
+    rate->stats.quality = rate->quality;
+}
+
+void esp_frame_rate_set_min_quality(esp_frame_rate_t *rate, int min_quality) {
+    rate->min_quality = min_quality < rate->max_quality ? min_quality : rate->max_quality;
+    rate->quality = clamp_quality(rate, rate->quality);
+}
+
+void esp_frame_rate_reset(esp_frame_rate_t *rate) {
+    // The scene complexity doesn't carry over to another frame size, the captures in flight still have their quality
+    rate->complexity = 0;
+    rate->window_count = 0;
+    rate->window_index = 0;
+    rate->last_timestamp = 0;
+}
+
+static void rate_window_add(esp_frame_rate_t *rate, size_t length, int64_t timestamp) {
+    rate->lengths[rate->window_index] = length;
+    rate->timestamps[rate->window_index] = timestamp;
+    rate->window_index = (rate->window_index + 1) % ESP_FRAME_RATE_WINDOW;
+    if (rate->window_count < ESP_FRAME_RATE_WINDOW) {
+        rate->window_count++;
+    }
+
+    if (rate->window_count < 2) {
+        return;
+    }
+
+    // The oldest frame only marks the start of the window
+    size_t oldest = (rate->window_index + ESP_FRAME_RATE_WINDOW - rate->window_count) % ESP_FRAME_RATE_WINDOW;
+    uint64_t bytes = 0;
+    for (size_t i = 1; i < rate->window_count; i++) {
+        bytes += rate->lengths[(oldest + i) % ESP_FRAME_RATE_WINDOW];
+    }
+
+    int64_t span = timestamp - rate->timestamps[oldest];
+    if (span > 0) {
+        rate->stats.actual_bps = bytes * 8 * 1000000 / span;
+    }
+}
+
+// Quality the next frame from the camera was taken with
+int esp_frame_rate_capture_quality(const esp_frame_rate_t *rate) {
+    return rate->capture_quality[rate->capture_index];
+}
+
+static void rate_capture_next(esp_frame_rate_t *rate) {
+    // The buffer of this frame is captured again with the quality handed out now
+    rate->capture_quality[rate->capture_index] = rate->quality;
+    rate->capture_index = (rate->capture_index + 1) % rate->buffers;
+}
+
+/* Takes the next frame from the camera and returns the quality to set on
+ * the sensor, the caller sets it before the buffer goes back.
+ */
+int esp_frame_rate_update(esp_frame_rate_t *rate, size_t length, int64_t timestamp) {
+    int quality = esp_frame_rate_capture_quality(rate);
+    rate->stats.frames++;
+    rate_window_add(rate, length, timestamp);
+
+    if (rate->last_timestamp) {
+        int64_t interval = timestamp - rate->last_timestamp;
+        rate->interval_us = rate->interval_us ? (rate->interval_us * 3 + interval) / 4 : interval;
+    }
+    rate->last_timestamp = timestamp;
+
+    uint32_t complexity = length * (quality + 1);
+    if (!rate->complexity || complexity > rate->complexity * COMPLEXITY_JUMP) {
+        rate->complexity = complexity;
+    } else {
+        rate->complexity = (rate->complexity * 3 + complexity) / 4;
+    }
+
+    if (!rate->interval_us) {
+        // No frame interval yet, so no budget
+        rate_capture_next(rate);
+        return rate->quality;
+    }
+
+    uint32_t budget = (uint64_t) rate->target_bps / 8 * rate->interval_us / 1000000;
+    if (budget == 0) {
+        budget = 1;
+    }
+
+    int wanted = (int) ((rate->complexity + budget - 1) / budget) - 1;
+    if (wanted > rate->quality + QUALITY_STEP_UP) {
+        wanted = rate->quality + QUALITY_STEP_UP;
+    } else if (wanted < rate->quality - QUALITY_STEP_DOWN) {
+        wanted = rate->quality - QUALITY_STEP_DOWN;
+    }
+    rate->quality = clamp_quality(rate, wanted);
+
+    rate->stats.budget_bytes = budget;
+    rate->stats.predicted_bytes = rate->complexity / (rate->quality + 1);
+    rate->stats.quality = rate->quality;
+
+    rate_capture_next(rate);
+    return rate->quality;
+}
@@ -0,0 +1,613 @@
+//
+// Created on 18/10/2026.
+//
+
+/* A single capture task owns the camera. Every frame it captures is
+ * wrapped in a reference counted esp_frame_t and handed to each
+ * subscription that is due, so consumers never call esp_camera_fb_get
+ * themselves and don't block each other.
+ */
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+
+#include <esp_log.h>
+#include <esp_err.h>
+#include <esp_timer.h>
+
+#include "sdkconfig.h"
+#include "esp-frame.h"
+#include "esp-frame-rate.h"
+
+#define TAG "esp-frame"
+
+#define SOURCE_STACKSIZE 4096
+#define SOURCE_PRIORITY 5
+
+#define MAX_SUBSCRIPTIONS 8
+
+#define RATE_LOG_INTERVAL_FRAMES 100
+
+// Frame rate adaptation: halve on overrun, at most once per hold period, add a step every period without one
+#define AIMD_PERIOD_US 1000000
+#define AIMD_INCREASE_FPS_MILLI 500
+
+typedef struct {
+    int active;
+    int64_t interval_us;
+    int64_t next_due;
+
+    // Frame rate adaptation, see esp_frame_set_adaptive
+    int adaptive;
+    uint32_t max_fps_milli;     // From the interval the subscription asked for
+    uint32_t min_fps_milli;
+    uint32_t fps_milli;
+    int overrun;                // Reported since the last delivery
+    int64_t last_change;
+
+    int64_t last_delivery;
+    int64_t average_interval_us;
+    esp_frame_clock_stats_t stats;
+    esp_frame_handler_t handler;
+    void *ctx;
+} esp_frame_subscription_t;
+
+typedef struct {
+    portMUX_TYPE lock;
+    SemaphoreHandle_t available;
+    esp_frame_t *frame;
+} esp_frame_mailbox_t;
+
+static esp_frame_subscription_t subscriptions[MAX_SUBSCRIPTIONS];
+static SemaphoreHandle_t subscriptions_lock;
+
+static TaskHandle_t source_task;
+static esp_timer_handle_t clock_timer;
+static volatile int source_running;
+static uint32_t frame_sequence;
+static volatile uint32_t frame_dimensions; // Width and height of the last frame, 0 before the first capture
+
+static portMUX_TYPE refcount_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static portMUX_TYPE settings_lock = portMUX_INITIALIZER_UNLOCKED;
+static esp_frame_sensor_settings_t pending_settings;
+static int settings_pending;
+
+static esp_frame_rate_t rate_control;   // Owned by the capture task, stats copied under settings_lock
+static esp_frame_rate_stats_t rate_stats;
+
+static int64_t next_capture_due() {
+    int64_t due = -1;
+    for (int i = 0; i < MAX_SUBSCRIPTIONS; i++) {
+        if (subscriptions[i].active && (due < 0 || subscriptions[i].next_due < due)) {
+            due = subscriptions[i].next_due;
+        }
+    }
+    return due;
+}
+
+static void subscription_set_fps(esp_frame_subscription_t *subscription, uint32_t fps_milli, int64_t now) {
+    subscription->fps_milli = fps_milli;
+    subscription->last_change = now;
+
+    int64_t interval_us = 1000000000LL / fps_milli;
+    subscription->next_due += interval_us - subscription->interval_us;
+    subscription->interval_us = interval_us;
+}
+
+static void subscription_clock_update(esp_frame_subscription_t *subscription, int64_t now) {
+    esp_frame_clock_stats_t *stats = &subscription->stats;
+    stats->frames++;
+
+    if (subscription->last_delivery) {
+        int64_t interval = now - subscription->last_delivery;
+        int64_t deviation = interval > subscription->interval_us ? interval - subscription->interval_us : subscription->interval_us - interval;
+
+        subscription->average_interval_us = subscription->average_interval_us ?
+                                            (subscription->average_interval_us * 7 + interval) / 8 : interval;
+        stats->jitter_us = (stats->jitter_us * 15 + deviation) / 16;
+        stats->achieved_fps_milli = 1000000000LL / subscription->average_interval_us;
+    }
+    subscription->last_delivery = now;
+
+    if (subscription->overrun) {
+        stats->overruns++;
+    }
+
+    if (subscription->adaptive) {
+        if (subscription->overrun && now - subscription->last_change >= AIMD_PERIOD_US) {
+            uint32_t fps_milli = subscription->fps_milli / 2;
+            subscription_set_fps(subscription, fps_milli > subscription->min_fps_milli ? fps_milli : subscription->min_fps_milli, now);
+        } else if (!subscription->overrun && now - subscription->last_change >= AIMD_PERIOD_US &&
+                   subscription->fps_milli < subscription->max_fps_milli) {
+            uint32_t fps_milli = subscription->fps_milli + AIMD_INCREASE_FPS_MILLI;
+            subscription_set_fps(subscription, fps_milli < subscription->max_fps_milli ? fps_milli : subscription->max_fps_milli, now);
+        }
+    }
+
+    subscription->overrun = false;
+    stats->interval_us = subscription->interval_us;
+}
+
+static void frame_source_dispatch(esp_frame_t *frame) {
+    int64_t now = esp_timer_get_time();
+
+    xSemaphoreTake(subscriptions_lock, portMAX_DELAY);
+    for (int i = 0; i < MAX_SUBSCRIPTIONS; i++) {
+        esp_frame_subscription_t *subscription = &subscriptions[i];
+        if (!subscription->active || subscription->next_due > now) {
+            continue;
+        }
+
+        // Keep the schedule, unless we are more than one interval behind
+        subscription->next_due += subscription->interval_us;
+        if (subscription->next_due < now) {
+            subscription->next_due = now + subscription->interval_us;
+            subscription->overrun = true;
+        }
+
+        subscription_clock_update(subscription, now);
+
+        subscription->handler(frame, subscription->ctx);
+    }
+    xSemaphoreGive(subscriptions_lock);
+}
+
+static void frame_source_apply_settings() {
+    portENTER_CRITICAL(&settings_lock);
+    int pending = settings_pending;
+    esp_frame_sensor_settings_t settings = pending_settings;
+    settings_pending = false;
+    portEXIT_CRITICAL(&settings_lock);
+
+    if (!pending) {
+        return;
+    }
+
+    sensor_t *sensor = esp_camera_sensor_get();
+    if (!sensor) {
+        return;
+    }
+
+    if (sensor->status.framesize != settings.framesize) {
+        if (sensor->set_framesize(sensor, settings.framesize) != 0) {
+            ESP_LOGW(TAG, "Failed to set frame size %d", settings.framesize);
+        }
+#ifdef CONFIG_ESP_FRAME_CBR
+        esp_frame_rate_reset(&rate_control);
+#endif
+    }
+
+#ifdef CONFIG_ESP_FRAME_CBR
+    // The rate controller owns the quality, the requested quality is the best it may use
+    esp_frame_rate_set_min_quality(&rate_control, settings.quality > CONFIG_ESP_FRAME_CBR_MIN_QUALITY ?
+                                                  settings.quality : CONFIG_ESP_FRAME_CBR_MIN_QUALITY);
+#else
+    if (sensor->status.quality != settings.quality && sensor->set_quality(sensor, settings.quality) != 0) {
+        ESP_LOGW(TAG, "Failed to set quality %d", settings.quality);
+    }
+#endif
+}
+
+#ifdef CONFIG_ESP_FRAME_CBR
+static void frame_source_rate_control(const esp_frame_t *frame) {
+    sensor_t *sensor = esp_camera_sensor_get();
+    if (!sensor) {
+        return;
+    }
+
+    // The camera captures ahead, the controller knows which earlier quality this frame was taken with
+    int quality = esp_frame_rate_update(&rate_control, frame->len, frame->timestamp);
+    if (quality != sensor->status.quality && sensor->set_quality(sensor, quality) != 0) {
+        ESP_LOGW(TAG, "Failed to set quality %d", quality);
+    }
+
+    portENTER_CRITICAL(&settings_lock);
+    rate_stats = rate_control.stats;
+    portEXIT_CRITICAL(&settings_lock);
+
+    if (rate_control.stats.frames % RATE_LOG_INTERVAL_FRAMES == 0) {
+        ESP_LOGI(TAG, "CBR: target %u kbit/s, actual %u kbit/s, budget %u bytes, predicted %u bytes, quality %d",
+                 rate_control.stats.target_bps / 1000, rate_control.stats.actual_bps / 1000,
+                 rate_control.stats.budget_bytes, rate_control.stats.predicted_bytes, quality);
+    }
+}
+#endif
+
+static void frame_clock_callback(void *arg) {
+    if (source_task) {
+        xTaskNotifyGive(source_task);
+    }
+}
+
+static void frame_source_task(void *pvParameters) {
+    while (source_running) {
+        xSemaphoreTake(subscriptions_lock, portMAX_DELAY);
+        int64_t due = next_capture_due();
+        xSemaphoreGive(subscriptions_lock);
+
+        if (due < 0) {
+            // Nobody is interested, wait for a subscription
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+
+        int64_t now = esp_timer_get_time();
+        if (due > now) {
+            // The clock timer wakes us up at the due time, a new subscription wakes us up early
+            esp_timer_stop(clock_timer);
+            if (esp_timer_start_once(clock_timer, due - now) != ESP_OK) {
+                vTaskDelay(1);
+                continue;
+            }
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+
+        frame_source_apply_settings();
+
+        camera_fb_t *fb = esp_camera_fb_get();
+        if (!fb) {
+            ESP_LOGE(TAG, "Camera Capture Failed");
+            vTaskDelay(pdMS_TO_TICKS(100));
+            continue;
+        }
+
+        esp_frame_t *frame = calloc(1, sizeof(esp_frame_t));
+        if (!frame) {
+            ESP_LOGE(TAG, "No memory for frame");
+            esp_camera_fb_return(fb);
+            continue;
+        }
+
+        frame->fb = fb;
+        frame->buf = fb->buf;
+        frame->len = fb->len;
+        frame->width = fb->width;
+        frame->height = fb->height;
+        frame->timestamp = esp_timer_get_time();
+        frame->sequence = frame_sequence++;
+        frame->refcount = 1;
+
+        frame_dimensions = (uint32_t) fb->width << 16 | (fb->height & 0xFFFF);
+
+#ifdef CONFIG_ESP_FRAME_CBR
+        frame_source_rate_control(frame);
+#endif
+
+        frame_source_dispatch(frame);
+
+        esp_frame_unref(frame);
+    }
+
+    source_task = NULL;
+    vTaskDelete(NULL);
+}
+
+esp_err_t esp_frame_source_start() {
+    if (source_task) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (!subscriptions_lock) {
+        subscriptions_lock = xSemaphoreCreateMutex();
+        if (!subscriptions_lock) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+#ifdef CONFIG_ESP_FRAME_CBR
+    sensor_t *sensor = esp_camera_sensor_get();
+    esp_frame_rate_init(&rate_control, CONFIG_ESP_FRAME_CBR_TARGET_KBPS * 1000,
+                        CONFIG_ESP_FRAME_CBR_MIN_QUALITY, CONFIG_ESP_FRAME_CBR_MAX_QUALITY,
+                        sensor ? sensor->status.quality : CONFIG_ESP_FRAME_CBR_MIN_QUALITY, CONFIG_ESP_FRAME_FB_COUNT);
+    rate_stats = rate_control.stats;
+#endif
+
+    if (!clock_timer) {
+        const esp_timer_create_args_t timer_args = {
+                .callback = frame_clock_callback,
+                .name = "frame_clock"
+        };
+        esp_err_t err = esp_timer_create(&timer_args, &clock_timer);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to create frame clock timer");
+            return err;
+        }
+    }
+
+    source_running = true;
+    BaseType_t result = xTaskCreate(frame_source_task, "frame_source", SOURCE_STACKSIZE, NULL, SOURCE_PRIORITY, &source_task);
+    if (result != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create frame source task: %d", result);
+        source_running = false;
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t esp_frame_source_stop() {
+    if (!source_task) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    source_running = false;
+    xTaskNotifyGive(source_task);
+
+    return ESP_OK;
+}
+
+esp_err_t esp_frame_source_get_dimensions(uint16_t *width, uint16_t *height) {
+    if (!width || !height) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    uint32_t dimensions = frame_dimensions;
+    if (!dimensions) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    *width = dimensions >> 16;
+    *height = dimensions & 0xFFFF;
+    return ESP_OK;
+}
+
+esp_err_t esp_frame_source_get_settings(esp_frame_sensor_settings_t *settings) {
+    if (!settings) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    portENTER_CRITICAL(&settings_lock);
+    int pending = settings_pending;
+    *settings = pending_settings;
+    portEXIT_CRITICAL(&settings_lock);
+
+    if (pending) {
+        return ESP_OK;
+    }
+
+    sensor_t *sensor = esp_camera_sensor_get();
+    if (!sensor) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    settings->framesize = sensor->status.framesize;
+    settings->quality = sensor->status.quality;
+    return ESP_OK;
+}
+
+esp_err_t esp_frame_source_apply_settings(const esp_frame_sensor_settings_t *settings) {
+    if (!settings || settings->framesize >= FRAMESIZE_INVALID || settings->quality < 0 || settings->quality > 63) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    portENTER_CRITICAL(&settings_lock);
+    pending_settings = *settings;
+    settings_pending = true;
+    portEXIT_CRITICAL(&settings_lock);
+
+    return ESP_OK;
+}
+
+esp_err_t esp_frame_source_get_rate_stats(esp_frame_rate_stats_t *stats) {
+    if (!stats) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+#ifdef CONFIG_ESP_FRAME_CBR
+    portENTER_CRITICAL(&settings_lock);
+    *stats = rate_stats;
+    portEXIT_CRITICAL(&settings_lock);
+    return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+esp_err_t esp_frame_subscribe(uint32_t interval_ms, esp_frame_handler_t handler, void *ctx, esp_frame_subscription_handle_t *handle) {
+    if (!handler || !handle) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (!subscriptions_lock) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    esp_frame_subscription_t *subscription = NULL;
+
+    xSemaphoreTake(subscriptions_lock, portMAX_DELAY);
+    for (int i = 0; i < MAX_SUBSCRIPTIONS; i++) {
+        if (!subscriptions[i].active) {
+            subscription = &subscriptions[i];
+            subscription->active = true;
+            subscription->interval_us = interval_ms * 1000LL;
+            subscription->next_due = esp_timer_get_time();
+            subscription->max_fps_milli = interval_ms ? 1000000 / interval_ms : 0;
+            subscription->fps_milli = subscription->max_fps_milli;
+            subscription->handler = handler;
+            subscription->ctx = ctx;
+            break;
+        }
+    }
+    xSemaphoreGive(subscriptions_lock);
+
+    if (!subscription) {
+        ESP_LOGW(TAG, "No free subscriptions");
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (source_task) {
+        xTaskNotifyGive(source_task);
+    }
+
+    *handle = subscription;
+    return ESP_OK;
+}
+
+esp_err_t esp_frame_unsubscribe(esp_frame_subscription_handle_t handle) {
+    if (!handle) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_frame_subscription_t *subscription = handle;
+
+    // Taking the lock also waits for a dispatch in progress
+    xSemaphoreTake(subscriptions_lock, portMAX_DELAY);
+    memset(subscription, 0, sizeof(esp_frame_subscription_t));
+    xSemaphoreGive(subscriptions_lock);
+
+    return ESP_OK;
+}
+
+esp_err_t esp_frame_set_interval(esp_frame_subscription_handle_t handle, uint32_t interval_ms) {
+    if (!handle) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_frame_subscription_t *subscription = handle;
+
+    xSemaphoreTake(subscriptions_lock, portMAX_DELAY);
+    subscription->next_due += interval_ms * 1000LL - subscription->interval_us;
+    subscription->interval_us = interval_ms * 1000LL;
+    subscription->max_fps_milli = interval_ms ? 1000000 / interval_ms : 0;
+    subscription->fps_milli = subscription->max_fps_milli;
+    xSemaphoreGive(subscriptions_lock);
+
+    return ESP_OK;
+}
+
+esp_err_t esp_frame_set_adaptive(esp_frame_subscription_handle_t handle, uint32_t max_interval_ms) {
+    if (!handle || max_interval_ms == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_frame_subscription_t *subscription = handle;
+
+    xSemaphoreTake(subscriptions_lock, portMAX_DELAY);
+    if (subscription->interval_us == 0 || max_interval_ms * 1000LL < subscription->interval_us) {
+        xSemaphoreGive(subscriptions_lock);
+        return ESP_ERR_INVALID_ARG;
+    }
+    subscription->min_fps_milli = 1000000 / max_interval_ms;
+    subscription->last_change = esp_timer_get_time();
+    subscription->adaptive = true;
+    xSemaphoreGive(subscriptions_lock);
+
+    return ESP_OK;
+}
+
+esp_err_t esp_frame_report_overrun(esp_frame_subscription_handle_t handle) {
+    if (!handle) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_frame_subscription_t *subscription = handle;
+
+    // Picked up with the next delivery
+    subscription->overrun = true;
+
+    return ESP_OK;
+}
+
+esp_err_t esp_frame_get_clock_stats(esp_frame_subscription_handle_t handle, esp_frame_clock_stats_t *stats) {
+    if (!handle || !stats) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_frame_subscription_t *subscription = handle;
+
+    xSemaphoreTake(subscriptions_lock, portMAX_DELAY);
+    *stats = subscription->stats;
+    xSemaphoreGive(subscriptions_lock);
+
+    return ESP_OK;
+}
+
+esp_frame_t *esp_frame_ref(esp_frame_t *frame) {
+    assert(frame != NULL);
+
+    portENTER_CRITICAL(&refcount_lock);
+    frame->refcount++;
+    portEXIT_CRITICAL(&refcount_lock);
+
+    return frame;
+}
+
+void esp_frame_unref(esp_frame_t *frame) {
+    if (!frame) {
+        return;
+    }
+
+    portENTER_CRITICAL(&refcount_lock);
+    assert(frame->refcount > 0);
+    uint32_t refcount = --frame->refcount;
+    portEXIT_CRITICAL(&refcount_lock);
+
+    if (refcount == 0) {
+        //return the frame buffer back to the driver for reuse
+        esp_camera_fb_return(frame->fb);
+        free(frame);
+    }
+}
+
+esp_err_t esp_frame_mailbox_create(esp_frame_mailbox_handle_t *handle) {
+    if (!handle) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    esp_frame_mailbox_t *mailbox = calloc(1, sizeof(esp_frame_mailbox_t));
+    if (!mailbox) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    mailbox->available = xSemaphoreCreateBinary();
+    if (!mailbox->available) {
+        free(mailbox);
+        return ESP_ERR_NO_MEM;
+    }
+
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+    mailbox->lock = lock;
+
+    *handle = mailbox;
+    return ESP_OK;
+}
+
+esp_err_t esp_frame_mailbox_delete(esp_frame_mailbox_handle_t handle) {
+    if (!handle) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_frame_mailbox_t *mailbox = handle;
+
+    esp_frame_unref(mailbox->frame);
+    vSemaphoreDelete(mailbox->available);
+    free(mailbox);
+
+    return ESP_OK;
+}
+
+void esp_frame_mailbox_handler(esp_frame_t *frame, void *ctx) {
+    esp_frame_mailbox_t *mailbox = ctx;
+    esp_frame_ref(frame);
+
+    portENTER_CRITICAL(&mailbox->lock);
+    esp_frame_t *previous = mailbox->frame;
+    mailbox->frame = frame;
+    portEXIT_CRITICAL(&mailbox->lock);
+
+    // Latest frame wins, the consumer never saw the previous one
+    esp_frame_unref(previous);
+    xSemaphoreGive(mailbox->available);
+}
+
+esp_frame_t *esp_frame_mailbox_take(esp_frame_mailbox_handle_t handle, TickType_t timeout) {
+    esp_frame_mailbox_t *mailbox = handle;
+
+    if (xSemaphoreTake(mailbox->available, timeout) != pdTRUE) {
+        return NULL;
+    }
+
+    portENTER_CRITICAL(&mailbox->lock);
+    esp_frame_t *frame = mailbox->frame;
+    mailbox->frame = NULL;
+    portEXIT_CRITICAL(&mailbox->lock);
+
+    return frame;
+}
@@ -0,0 +1,63 @@
+//
+// Created on 18/10/2026.
+//
+
+#ifndef ESPCAM_ESP_FRAME_RATE_H
+#define ESPCAM_ESP_FRAME_RATE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define ESP_FRAME_RATE_WINDOW 16
+#define ESP_FRAME_RATE_MAX_BUFFERS 4
+
+typedef struct {
+    uint32_t target_bps;        // Bits per second the controller aims for
+    uint32_t actual_bps;        // Measured over the frames in the window
+    uint32_t budget_bytes;      // Size the next frame should have
+    uint32_t predicted_bytes;   // Predicted size of the next frame at the chosen quality
+    int quality;                // Quality for the next frame
+    uint32_t frames;
+} esp_frame_rate_stats_t;
+
+/* Constant bitrate controller. Predicts the size of the next frame from the
+ * recent frames, normalized by the quality they were taken with, and picks
+ * the quality that makes the next frame fit the budget for one frame
+ * interval. It has no dependencies on the camera, a recorded trace of frame
+ * sizes and timestamps can be replayed through esp_frame_rate_update.
+ *
+ * With more than one frame buffer the camera captures ahead, a frame comes
+ * back a number of frames after the quality it was taken with was set. The
+ * controller remembers the quality it handed out for every buffer.
+ */
+typedef struct {
+    uint32_t target_bps;
+    int min_quality;            // Best quality allowed, lower numbers mean larger frames
+    int max_quality;
+    int quality;
+
+    // Quality of the captures in flight, the next frame was taken with the one at capture_index
+    int capture_quality[ESP_FRAME_RATE_MAX_BUFFERS];
+    size_t buffers;
+    size_t capture_index;
+
+    uint32_t complexity;        // Smoothed frame size times quality
+    int64_t interval_us;        // Smoothed capture interval
+    int64_t last_timestamp;
+
+    // Sliding window to measure the actual bitrate
+    uint32_t lengths[ESP_FRAME_RATE_WINDOW];
+    int64_t timestamps[ESP_FRAME_RATE_WINDOW];
+    size_t window_index;
+    size_t window_count;
+
+    esp_frame_rate_stats_t stats;
+} esp_frame_rate_t;
+
+void esp_frame_rate_init(esp_frame_rate_t *rate, uint32_t target_bps, int min_quality, int max_quality, int quality, size_t buffers);
+void esp_frame_rate_set_min_quality(esp_frame_rate_t *rate, int min_quality);
+void esp_frame_rate_reset(esp_frame_rate_t *rate);
+int esp_frame_rate_capture_quality(const esp_frame_rate_t *rate);
+int esp_frame_rate_update(esp_frame_rate_t *rate, size_t length, int64_t timestamp);
+
+#endif //ESPCAM_ESP_FRAME_RATE_H
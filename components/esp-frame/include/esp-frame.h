@@ -0,0 +1,92 @@
+//
+// Created on 18/10/2026.
+//
+
+#ifndef ESPCAM_ESP_FRAME_H
+#define ESPCAM_ESP_FRAME_H
+
+#include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+
+#include "esp_camera.h"
+#include "esp-frame-rate.h"
+
+/* A camera frame shared between all subscribers. The frame buffer goes back
+ * to the camera driver when the last reference is released.
+ */
+typedef struct {
+    uint8_t *buf;
+    size_t len;
+    size_t width;
+    size_t height;
+    int64_t timestamp;  // esp_timer time of the capture in us
+    uint32_t sequence;
+
+    // Private, use esp_frame_ref / esp_frame_unref
+    uint32_t refcount;
+    camera_fb_t *fb;
+} esp_frame_t;
+
+/* Called from the capture task for every frame delivered to a subscription.
+ * The handler must not block, take a reference to keep the frame around.
+ */
+typedef void (*esp_frame_handler_t)(esp_frame_t *frame, void *ctx);
+
+/* Sensor settings that may change while streaming. Changes are applied by
+ * the capture task between two captures. The frame buffers are sized for
+ * the frame size in camera_config, never go above it. With
+ * CONFIG_ESP_FRAME_CBR the rate controller picks the quality for every
+ * frame and the quality here is the best quality it may pick.
+ */
+typedef struct {
+    framesize_t framesize;
+    int quality;        // 0-63, lower means better quality and larger frames
+} esp_frame_sensor_settings_t;
+
+/* Delivery statistics of a subscription, the frame clock fires on an
+ * esp_timer so the interval is not rounded to the tick rate.
+ */
+typedef struct {
+    uint32_t interval_us;           // Interval the clock runs at now
+    uint32_t achieved_fps_milli;    // Smoothed over the delivered frames, in 1/1000 fps
+    uint32_t jitter_us;             // Smoothed deviation of the delivery interval from interval_us
+    uint32_t overruns;              // Deliveries late by more than an interval or reported overrun
+    uint32_t frames;
+} esp_frame_clock_stats_t;
+
+typedef void* esp_frame_subscription_handle_t;
+typedef void* esp_frame_mailbox_handle_t;
+
+esp_err_t esp_frame_source_start();
+esp_err_t esp_frame_source_stop();
+esp_err_t esp_frame_source_get_dimensions(uint16_t *width, uint16_t *height);
+esp_err_t esp_frame_source_get_settings(esp_frame_sensor_settings_t *settings);
+esp_err_t esp_frame_source_apply_settings(const esp_frame_sensor_settings_t *settings);
+esp_err_t esp_frame_source_get_rate_stats(esp_frame_rate_stats_t *stats);
+
+esp_err_t esp_frame_subscribe(uint32_t interval_ms, esp_frame_handler_t handler, void *ctx, esp_frame_subscription_handle_t *handle);
+esp_err_t esp_frame_unsubscribe(esp_frame_subscription_handle_t handle);
+esp_err_t esp_frame_set_interval(esp_frame_subscription_handle_t handle, uint32_t interval_ms);
+
+/* Adapts the frame rate of a subscription between the subscribed interval
+ * and max_interval_ms. The rate is halved when the subscriber reports an
+ * overrun or the delivery falls an interval behind, and goes up by half a
+ * frame per second every second without overruns.
+ */
+esp_err_t esp_frame_set_adaptive(esp_frame_subscription_handle_t handle, uint32_t max_interval_ms);
+esp_err_t esp_frame_report_overrun(esp_frame_subscription_handle_t handle);
+esp_err_t esp_frame_get_clock_stats(esp_frame_subscription_handle_t handle, esp_frame_clock_stats_t *stats);
+
+esp_frame_t *esp_frame_ref(esp_frame_t *frame);
+void esp_frame_unref(esp_frame_t *frame);
+
+/* A mailbox holding only the latest frame, a frame that is not taken
+ * before the next one arrives is released. Pass esp_frame_mailbox_handler
+ * with the mailbox as ctx to esp_frame_subscribe.
+ */
+esp_err_t esp_frame_mailbox_create(esp_frame_mailbox_handle_t *handle);
+esp_err_t esp_frame_mailbox_delete(esp_frame_mailbox_handle_t handle);
+void esp_frame_mailbox_handler(esp_frame_t *frame, void *ctx);
+esp_frame_t *esp_frame_mailbox_take(esp_frame_mailbox_handle_t handle, TickType_t timeout);
+
+#endif //ESPCAM_ESP_FRAME_H
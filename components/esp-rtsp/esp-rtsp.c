@@ -3,6 +3,7 @@
 //
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
+#include <freertos/semphr.h>
 
 #include <esp_log.h>
 #include <esp_err.h>
@@ -14,12 +15,23 @@
 #define TAG "rtsp-server"
 
 static void rtsp_server_task(void *pvParameters) {
-    rtsp_server_main();
+    esp_rtsp_server_t *server = pvParameters;
+
+    rtsp_server_main(&server->config);
+
+    // The server is freed once this is given, don't touch it after
+    xSemaphoreGive(server->stopped);
     vTaskDelete(NULL);
 }
 
-esp_err_t esp_rtsp_server_start(esp_rtsp_server_handle_t *handle) {
-    if (!handle) {
+esp_err_t esp_rtsp_server_start(esp_rtsp_server_handle_t *handle, const esp_rtsp_server_config_t *config) {
+    if (!handle || !config) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (config->port == 0 || config->max_clients == 0 || config->backlog == 0) {
+        ESP_LOGE(TAG, "Invalid server config: port %u, %u clients, backlog %u",
+                 config->port, config->max_clients, config->backlog);
         return ESP_ERR_INVALID_ARG;
     }
 
@@ -28,9 +40,19 @@ esp_err_t esp_rtsp_server_start(esp_rtsp_server_handle_t *handle) {
         return ESP_ERR_NO_MEM;
     }
 
-    BaseType_t result = xTaskCreate(rtsp_server_task, "rtsp_tcp_server", SERVER_STACKSIZE, NULL, SERVER_PRIORITY, &server->server_taskhandle);
+    server->stopped = xSemaphoreCreateBinary();
+    if (!server->stopped) {
+        free(server);
+        return ESP_ERR_NO_MEM;
+    }
+
+    // The task reads the config from the server, the caller's copy can go
+    server->config = *config;
+
+    BaseType_t result = xTaskCreate(rtsp_server_task, "rtsp_tcp_server", config->stack_size, server, config->task_priority, &server->server_taskhandle);
     if (result != pdPASS) {
         ESP_LOGE(TAG, "Failed to create rtsp server task: %d", result);
+        vSemaphoreDelete(server->stopped);
         free(server);
         return ESP_FAIL;
     }
@@ -49,11 +71,17 @@ esp_err_t esp_rtsp_server_stop(esp_rtsp_server_handle_t handle) {
     esp_rtsp_server_t *server = (esp_rtsp_server_t *)handle;
 
     if (server->running) {
-        vTaskDelete(server->server_taskhandle);
+        // Deleting the task could catch it in the middle of a send, let it wind down instead
+        rtsp_server_stop();
+        if (xSemaphoreTake(server->stopped, pdMS_TO_TICKS(SERVER_STOP_TIMEOUT_MS)) != pdTRUE) {
+            ESP_LOGE(TAG, "Server task didn't stop");
+            return ESP_ERR_TIMEOUT;
+        }
         server->running = false;
     }
 
+    vSemaphoreDelete(server->stopped);
     free(server);
 
     return ESP_OK;
-}
\ No newline at end of file
+}
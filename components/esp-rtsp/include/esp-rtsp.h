@@ -5,9 +5,35 @@
 #ifndef ESPCAM_ESP_RTSP_H
 #define ESPCAM_ESP_RTSP_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+#include <esp_err.h>
+
 typedef void* esp_rtsp_server_handle_t;
 
-esp_err_t esp_rtsp_server_start(esp_rtsp_server_handle_t *handle);
+/* Everything a connection needs is allocated for max_clients when the
+ * server starts, about 7 KB each, size it to the RAM that can be spared.
+ * Playing sessions are limited by the RTP pacer as well, PLAY is refused
+ * once it is full.
+ */
+typedef struct {
+    uint16_t port;
+    uint16_t max_clients;
+    uint16_t backlog;           // Connections the stack holds until the server accepts them
+    size_t stack_size;
+    unsigned task_priority;
+} esp_rtsp_server_config_t;
+
+#define ESP_RTSP_SERVER_DEFAULT_CONFIG() { \
+        .port = 554,                       \
+        .max_clients = 3,                  \
+        .backlog = 2,                      \
+        .stack_size = 16 * 1024,           \
+        .task_priority = 2,                \
+}
+
+esp_err_t esp_rtsp_server_start(esp_rtsp_server_handle_t *handle, const esp_rtsp_server_config_t *config);
 esp_err_t esp_rtsp_server_stop(esp_rtsp_server_handle_t handle);
 
 #endif //ESPCAM_ESP_RTSP_H
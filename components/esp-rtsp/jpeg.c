@@ -8,140 +8,342 @@
  * Original source: https://github.com/bnbe-club/rtsp-video-streamer-diy-14/blob/master/diy-e14/src/CStreamer.cpp
  */
 
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
 #include <esp_log.h>
 #include <esp_err.h>
 
-#include "rtp-udp.h"
+#include "rtp-jpeg.h"
 
 #define TAG "esp-rtsp-jpeg"
 
+#define JPEG_SOF0 0xC0
+#define JPEG_RST0 0xD0
+#define JPEG_RST7 0xD7
+#define JPEG_DHT 0xC4
 #define JPEG_SOI 0xD8
 #define JPEG_EOI 0xD9
 #define JPEG_SOS 0xDA
 #define JPEG_DQT 0xDB
+#define JPEG_DRI 0xDD
 
-static int find_jpeg_marker(char *buffer, size_t len, uint8_t marker, char **marker_start);
-static int block_length(const char *blockptr, size_t len);
+// Padding after EOI is searched backwards up to this many bytes
+#define EOI_TAIL_SEARCH 256
 
-esp_err_t esp_rtsp_jpeg_decode(char *buffer, size_t length, esp_rtsp_jpeg_data_t *rtsp_jpeg_data) {
-    assert(rtsp_jpeg_data != NULL);
+// Header segments before SOS that fit in the layout cache, frames with more are indexed every time
+#define LAYOUT_MAX_SEGMENTS 16
 
-    if (length < 4) {
-        ESP_LOGE(TAG, "Invalid length: %d", length);
+/* Offsets of the header segments of the last frame. The camera produces the
+ * same header layout for every frame, so the next frame only has to verify
+ * the markers at these offsets instead of parsing all segments again. Every
+ * segment is in the list, a segment that appears or goes away, like DRI
+ * when restart markers are switched on, breaks the chain of lengths.
+ */
+typedef struct {
+    int valid;
+    size_t segment_count;
+    uint32_t segments[LAYOUT_MAX_SEGMENTS];
+    uint8_t markers[LAYOUT_MAX_SEGMENTS];
+    size_t quant_table_0;
+    size_t quant_table_1;
+    size_t huffman_tables;
+    size_t restart_interval;
+    size_t sof;
+    size_t sos;
+    size_t data_start;
+} esp_rtsp_jpeg_layout_t;
+
+static esp_rtsp_jpeg_layout_t layout_cache;
+
+static uint16_t read_u16(const uint8_t *buffer) {
+    return buffer[0] << 8 | buffer[1];
+}
+
+static int has_marker(const uint8_t *buffer, size_t length, size_t offset, uint8_t marker) {
+    return offset + 1 < length && buffer[offset] == 0xFF && buffer[offset + 1] == marker;
+}
+
+static esp_err_t parse_sof0(const uint8_t *segment, size_t segment_length, esp_rtsp_jpeg_data_t *jpeg_data) {
+    // Length, precision, height, width, component count and three components
+    if (segment_length < 2 + 6 + 9) {
+        ESP_LOGE(TAG, "SOF0 segment too short");
         return ESP_FAIL;
     }
 
-    // Check magic
-    if ((uint8_t)buffer[0] != 0xFF && (uint8_t)buffer[1] != JPEG_SOI) {
-        ESP_LOGE(TAG, "Probably not a JPEG");
+    jpeg_data->height = read_u16(segment + 5);
+    jpeg_data->width = read_u16(segment + 7);
+
+    // Sampling factors of the luma component decide between 4:2:2 and 4:2:0
+    uint8_t sampling = segment[11];
+    jpeg_data->subsampling = (sampling & 0x0F) == 2 ? JPEG_SUBSAMPLING_420 : JPEG_SUBSAMPLING_422;
+
+    return ESP_OK;
+}
+
+static esp_err_t parse_dri(const uint8_t *segment, size_t segment_length, esp_rtsp_jpeg_data_t *jpeg_data) {
+    // Length and the restart interval, nothing else
+    if (segment_length != 4) {
+        ESP_LOGE(TAG, "Invalid DRI segment length %d", segment_length);
         return ESP_FAIL;
     }
 
-    char *marker;
-    size_t remaining;
-    if (find_jpeg_marker(buffer, length, JPEG_DQT, &marker) < 0) {
-        ESP_LOGE(TAG, "Failed to find marker 0x%02x", JPEG_DQT);
-        return ESP_FAIL;
+    jpeg_data->restart_interval = read_u16(segment + 4);
+    return ESP_OK;
+}
+
+static esp_err_t parse_dqt(const uint8_t *segment, size_t segment_length, esp_rtsp_jpeg_data_t *jpeg_data) {
+    // A single DQT segment may hold several tables
+    size_t position = 4;
+    while (position + 65 <= segment_length + 2) {
+        uint8_t table_id = segment[position] & 0x0F;
+        size_t table_length = (segment[position] & 0xF0) ? 129 : 65;
+        if (position + table_length > segment_length + 2) {
+            ESP_LOGE(TAG, "DQT segment too short");
+            return ESP_FAIL;
+        }
+
+        if (table_id == 0) {
+            jpeg_data->quant_table_0 = (char *) segment + position;
+        } else if (table_id == 1) {
+            jpeg_data->quant_table_1 = (char *) segment + position;
+        }
+
+        position += table_length;
     }
-    rtsp_jpeg_data->quant_table_0 = marker;
 
-    remaining = length - (marker-buffer);
-    char *next = marker + block_length(marker, remaining);
-    if (find_jpeg_marker(next, length - (next-buffer), JPEG_DQT, &marker) < 0) {
-        ESP_LOGE(TAG, "Failed to find marker 0x%02x", JPEG_DQT);
+    return ESP_OK;
+}
+
+/* Walks the header segments once and records everything the packetizer
+ * needs. Stops at SOS, the entropy coded data follows.
+ */
+static esp_err_t index_segments(const uint8_t *buffer, size_t length, esp_rtsp_jpeg_data_t *jpeg_data, esp_rtsp_jpeg_layout_t *layout) {
+    size_t position = 2; // Skip SOI
+
+    while (position + 4 <= length) {
+        if (buffer[position] != 0xFF) {
+            ESP_LOGE(TAG, "Expected marker at %d", position);
+            return ESP_FAIL;
+        }
+
+        uint8_t marker = buffer[position + 1];
+        if (marker == 0xFF) {
+            // Fill byte
+            position++;
+            continue;
+        }
+
+        size_t segment_length = read_u16(buffer + position + 2);
+        if (segment_length < 2 || position + 2 + segment_length > length) {
+            ESP_LOGE(TAG, "Invalid length for marker 0x%02x at %d", marker, position);
+            return ESP_FAIL;
+        }
+
+        if (layout->segment_count < LAYOUT_MAX_SEGMENTS) {
+            layout->segments[layout->segment_count] = position;
+            layout->markers[layout->segment_count] = marker;
+        }
+        layout->segment_count++;
+
+        const uint8_t *segment = buffer + position;
+        switch (marker) {
+            case JPEG_DQT:
+                if (parse_dqt(segment, segment_length, jpeg_data) != ESP_OK) {
+                    return ESP_FAIL;
+                }
+                if (!layout->quant_table_0) {
+                    layout->quant_table_0 = position;
+                } else {
+                    layout->quant_table_1 = position;
+                }
+                break;
+            case JPEG_SOF0:
+                if (parse_sof0(segment, segment_length, jpeg_data) != ESP_OK) {
+                    return ESP_FAIL;
+                }
+                layout->sof = position;
+                break;
+            case JPEG_DHT:
+                if (!jpeg_data->huffman_tables) {
+                    jpeg_data->huffman_tables = (char *) segment;
+                    layout->huffman_tables = position;
+                }
+                break;
+            case JPEG_DRI:
+                if (parse_dri(segment, segment_length, jpeg_data) != ESP_OK) {
+                    return ESP_FAIL;
+                }
+                layout->restart_interval = position;
+                break;
+            case JPEG_SOS:
+                layout->sos = position;
+                layout->data_start = position + 2 + segment_length;
+                jpeg_data->jpeg_data_start = (char *) buffer + layout->data_start;
+                return ESP_OK;
+            default:
+                // APPn, COM and friends, not needed for RTP
+                break;
+        }
+
+        position += 2 + segment_length;
+    }
+
+    ESP_LOGE(TAG, "No SOS marker found");
+    return ESP_FAIL;
+}
+
+/* Checks the cached layout against this frame. Only the markers and the
+ * segment lengths are verified, the values in SOF0 and DRI are read again
+ * as they may change with the camera settings.
+ */
+static esp_err_t index_from_cache(const uint8_t *buffer, size_t length, esp_rtsp_jpeg_data_t *jpeg_data) {
+    esp_rtsp_jpeg_layout_t *layout = &layout_cache;
+
+    if (!layout->valid || layout->data_start >= length) {
         return ESP_FAIL;
     }
-    rtsp_jpeg_data->quant_table_1 = marker;
 
-    remaining = length - (marker-buffer);
-    next = marker + block_length(marker, remaining);
-    if (find_jpeg_marker(next, length - (next-buffer), JPEG_SOS, &marker) < 0) {
-        ESP_LOGE(TAG, "Failed to find marker 0x%02x", JPEG_SOS);
+    // Each segment has to end where the next one starts, the last one is SOS
+    for (size_t i = 0; i < layout->segment_count; i++) {
+        size_t position = layout->segments[i];
+        size_t next = i + 1 < layout->segment_count ? layout->segments[i + 1] : layout->data_start;
+        if (!has_marker(buffer, length, position, layout->markers[i]) ||
+            position + 2 + read_u16(buffer + position + 2) != next) {
+            return ESP_FAIL;
+        }
+    }
+
+    if (layout->restart_interval &&
+        parse_dri(buffer + layout->restart_interval, read_u16(buffer + layout->restart_interval + 2), jpeg_data) != ESP_OK) {
         return ESP_FAIL;
     }
-    rtsp_jpeg_data->jpeg_data_start = marker + block_length(marker, remaining); // Don't include the SOS header
 
-    remaining = length - (marker-buffer);
-    next = marker + block_length(marker, remaining);
-    if (find_jpeg_marker(next, length - (next-buffer), JPEG_EOI, &marker) < 0) {
-        ESP_LOGE(TAG, "Failed to find marker 0x%02x", JPEG_EOI);
+    if (parse_dqt(buffer + layout->quant_table_0, read_u16(buffer + layout->quant_table_0 + 2), jpeg_data) != ESP_OK) {
         return ESP_FAIL;
     }
-    rtsp_jpeg_data->jpeg_data_length = marker - rtsp_jpeg_data->jpeg_data_start;
 
-//    ESP_LOGD(TAG, "JPEG: Q1 : %d, Q2 : %d, SOS: %d, LEN: %d",
-//             rtsp_jpeg_data->quant_table_0 - buffer,
-//             rtsp_jpeg_data->quant_table_1 - buffer,
-//             rtsp_jpeg_data->jpeg_data_start - buffer,
-//             rtsp_jpeg_data->jpeg_data_length);
+    if (layout->quant_table_1 &&
+        parse_dqt(buffer + layout->quant_table_1, read_u16(buffer + layout->quant_table_1 + 2), jpeg_data) != ESP_OK) {
+        return ESP_FAIL;
+    }
 
-    return ESP_OK;
-}
+    if (parse_sof0(buffer + layout->sof, read_u16(buffer + layout->sof + 2), jpeg_data) != ESP_OK) {
+        return ESP_FAIL;
+    }
 
-static int block_length(const char *blockptr, size_t len) {
-    assert(len > 4);
-    assert((uint8_t)blockptr[0] == 0xff);
+    jpeg_data->huffman_tables = layout->huffman_tables ? (char *) buffer + layout->huffman_tables : NULL;
+    jpeg_data->jpeg_data_start = (char *) buffer + layout->data_start;
 
-    return 2 + (blockptr[2] << 8 | blockptr[3]);
+    return ESP_OK;
 }
 
-static int find_jpeg_marker(char *buffer, size_t len, uint8_t marker, char **marker_start) {
-    long position = 0;
-    while(position < len - 1) {
-        char *current = buffer+position;
+/* In the entropy coded data a 0xFF is always followed by a stuffed 0x00 or
+ * a restart marker, so the first 0xFF followed by a byte in [first, last]
+ * is the marker we look for. Scans a word at a time for words containing a
+ * 0xFF byte.
+ */
+static const uint8_t *find_marker_forward(const uint8_t *start, const uint8_t *end, uint8_t first, uint8_t last) {
+    const uint8_t *current = start;
 
-        uint8_t framing = current[0];
-        uint8_t typecode = current[1];
+    // Byte by byte until the pointer is word aligned
+    while (current + 1 < end && ((uintptr_t) current & 3)) {
+        if (current[0] == 0xFF && current[1] >= first && current[1] <= last) {
+            return current;
+        }
+        current++;
+    }
 
-        if(framing != 0xff) {
-            position += 1;
+    while (current + 4 < end) {
+        uint32_t inverted = ~*(const uint32_t *) current;
+        if (((inverted - 0x01010101) & ~inverted & 0x80808080) == 0) {
+            // No 0xFF byte in this word
+            current += 4;
             continue;
         }
 
-        if(typecode == 0x00 || typecode == 0xFF) {
-            // red herring, skip
-            position += 2;
-            continue;
+        for (int i = 0; i < 4; i++) {
+            if (current[i] == 0xFF && current[i + 1] >= first && current[i + 1] <= last) {
+                return current + i;
+            }
         }
+        current += 4;
+    }
 
-        if(typecode == marker) {
-            *marker_start = current;
-            return 0;
+    while (current + 1 < end) {
+        if (current[0] == 0xFF && current[1] >= first && current[1] <= last) {
+            return current;
         }
+        current++;
+    }
 
-        int skip_len;
-        switch(typecode) {
-            case 0xd8:   // start of image
-            case 0xd9:   // end of image
-                skip_len = 2;
-                break;
+    return NULL;
+}
 
-            case 0xe0:   // app0
-            case 0xdb:   // dqt
-            case 0xc4:   // dht
-            case 0xc0:   // sof0
-            case 0xda:   // sos
-            {
-                /* If we are not interested in these blocks, try to fast forward
-                 * by moving the position up.
-                 */
-                if (len - position >= 2) {
-                    // We need to be sure the length bytes are available in the buffer
-                    skip_len = (current[2] << 8 | current[3]) + 2;
-                } else {
-                    skip_len = 2;
-                }
-                break;
-            }
-            default:
-                skip_len = 2;
-                ESP_LOGE(TAG, "Unexpected jpeg typecode 0x%x\n", typecode);
-                break;
+static const uint8_t *find_eoi(const uint8_t *start, const uint8_t *end) {
+    // The EOI is normally at the very end, possibly followed by a bit of padding
+    const uint8_t *limit = end - start > EOI_TAIL_SEARCH ? end - EOI_TAIL_SEARCH : start;
+    for (const uint8_t *current = end - 2; current >= limit; current--) {
+        if (current[0] == 0xFF && current[1] == JPEG_EOI) {
+            return current;
+        }
+    }
+
+    return find_marker_forward(start, end, JPEG_EOI, JPEG_EOI);
+}
+
+esp_err_t esp_rtsp_jpeg_decode(char *buffer, size_t length, esp_rtsp_jpeg_data_t *rtsp_jpeg_data) {
+    assert(rtsp_jpeg_data != NULL);
+
+    if (length < 4) {
+        ESP_LOGE(TAG, "Invalid length: %d", length);
+        return ESP_FAIL;
+    }
+
+    const uint8_t *data = (const uint8_t *) buffer;
+
+    // Check magic
+    if (data[0] != 0xFF || data[1] != JPEG_SOI) {
+        ESP_LOGE(TAG, "Probably not a JPEG");
+        return ESP_FAIL;
+    }
+
+    memset(rtsp_jpeg_data, 0, sizeof(esp_rtsp_jpeg_data_t));
+
+    if (index_from_cache(data, length, rtsp_jpeg_data) != ESP_OK) {
+        esp_rtsp_jpeg_layout_t layout = { 0 };
+        memset(rtsp_jpeg_data, 0, sizeof(esp_rtsp_jpeg_data_t));
+
+        if (index_segments(data, length, rtsp_jpeg_data, &layout) != ESP_OK) {
+            layout_cache.valid = 0;
+            return ESP_FAIL;
+        }
+
+        if (!layout.sof) {
+            ESP_LOGE(TAG, "Only baseline JPEG is supported");
+            layout_cache.valid = 0;
+            return ESP_FAIL;
         }
 
-        position += skip_len;
+        layout.valid = layout.quant_table_0 != 0 && layout.segment_count <= LAYOUT_MAX_SEGMENTS;
+        layout_cache = layout;
+        ESP_LOGD(TAG, "JPEG layout: DQT %d/%d, SOF0 %d, DHT %d, DRI %d, SOS %d",
+                 layout.quant_table_0, layout.quant_table_1, layout.sof,
+                 layout.huffman_tables, layout.restart_interval, layout.sos);
     }
 
-    ESP_LOGE(TAG, "Failed to find jpeg marker 0x%x", marker);
-    return -1;
+    const uint8_t *eoi = find_eoi((const uint8_t *) rtsp_jpeg_data->jpeg_data_start, data + length);
+    if (!eoi) {
+        ESP_LOGE(TAG, "Failed to find marker 0x%02x", JPEG_EOI);
+        return ESP_FAIL;
+    }
+    rtsp_jpeg_data->jpeg_data_length = eoi - (const uint8_t *) rtsp_jpeg_data->jpeg_data_start;
+
+    return ESP_OK;
+}
+
+const char *esp_rtsp_jpeg_next_restart(const char *start, const char *end) {
+    const uint8_t *marker = find_marker_forward((const uint8_t *) start, (const uint8_t *) end, JPEG_RST0, JPEG_RST7);
+    return marker ? (const char *) marker + 2 : NULL;
 }
@@ -7,7 +7,10 @@
 
 #include <esp_err.h>
 
-#define URL_MAX_LENGTH 1024
+#include "esp-rtsp.h"
+
+// A request has to fit in the receive buffer of its connection, headers included
+#define RTSP_REQUEST_MAX_SIZE 4096
 
 typedef enum {
     OPTIONS,
@@ -20,11 +23,18 @@ typedef enum {
 
 typedef struct {
     rtsp_request_type_t request_type;
-    char url[URL_MAX_LENGTH + 1];
+    const char *url;        // In the receive buffer, valid while the request is handled
+    size_t url_length;
     int protocol_version;
     int cseq;
     int dst_rtp_port;
     int dst_rtcp_port;
+    int rtcp_mux;           // RTCP-mux in the transport, RTCP on the RTP port (RFC 5761)
+    int interleaved;        // RTP/AVP/TCP, RTP and RTCP on the RTSP connection
+    int rtp_channel;
+    int rtcp_channel;
+    int multicast;          // The server picks the group and ports
+    int blocksize;          // Packet size asked for by the client, 0 when it didn't
 } rtsp_req_t;
 
 typedef void* rtsp_parser_handle_t;
@@ -35,13 +45,18 @@ typedef void* rtsp_parser_handle_t;
 #define PARSER_INVALID_STATE -3
 #define PARSER_INVALID_ARGS -4
 
+int rtsp_parser_pool_create(size_t size);
+void rtsp_parser_pool_destroy();
 int rtsp_parser_init(rtsp_parser_handle_t *handle);
-int parse_request(rtsp_parser_handle_t handle, const char *buffer, size_t len);
+int parse_request(rtsp_parser_handle_t handle, char *buffer, size_t len);
 int parser_is_complete(rtsp_parser_handle_t handle);
 int parser_get_error(rtsp_parser_handle_t handle);
 rtsp_req_t *parser_get_request(rtsp_parser_handle_t handle);
+int parser_reset(rtsp_parser_handle_t handle);
 int parser_free(rtsp_parser_handle_t handle);
+size_t parser_get_size();
 
-esp_err_t rtsp_server_main();
+esp_err_t rtsp_server_main(const esp_rtsp_server_config_t *config);
+void rtsp_server_stop();
 
 #endif //ESPCAM_ESP_RTSP_COMMON_H
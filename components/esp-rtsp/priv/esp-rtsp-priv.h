@@ -5,12 +5,16 @@
 #ifndef ESPCAM_ESP_RTSP_PRIV_H
 #define ESPCAM_ESP_RTSP_PRIV_H
 
-#define SERVER_STACKSIZE (16 * 1024)
-#define SERVER_PRIORITY 2
+#include "esp-rtsp.h"
+
+// The server closes its connections before it stops, one poll interval and then some
+#define SERVER_STOP_TIMEOUT_MS 5000
 
 typedef struct {
     bool running;
     TaskHandle_t server_taskhandle;
+    SemaphoreHandle_t stopped;     // Given by the server task when rtsp_server_main returns
+    esp_rtsp_server_config_t config;
 } esp_rtsp_server_t;
 
 
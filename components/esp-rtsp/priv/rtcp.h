@@ -0,0 +1,21 @@
+//
+// Created on 18/10/2026.
+//
+
+#ifndef ESPCAM_RTCP_H
+#define ESPCAM_RTCP_H
+
+#include <lwip/sockets.h>
+
+#include "rtp-udp.h"
+#include "rtsp-timer.h"
+
+esp_err_t esp_rtcp_start(rtsp_timer_wheel_t *wheel);
+void esp_rtcp_stop();
+esp_err_t esp_rtcp_add_session(esp_rtp_session_handle_t session);
+esp_err_t esp_rtcp_remove_session(esp_rtp_session_handle_t session);
+int esp_rtcp_fill_read_set(fd_set *read_set, int sock_max);
+void esp_rtcp_handle_read_set(const fd_set *read_set);
+esp_err_t esp_rtcp_receive(esp_rtp_session_handle_t session, const uint8_t *buffer, size_t length);
+
+#endif //ESPCAM_RTCP_H
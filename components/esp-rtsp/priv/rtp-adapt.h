@@ -0,0 +1,14 @@
+//
+// Created on 18/10/2026.
+//
+
+#ifndef ESPCAM_RTP_ADAPT_H
+#define ESPCAM_RTP_ADAPT_H
+
+#include "rtp-udp.h"
+
+esp_err_t esp_rtp_adapt_start();
+void esp_rtp_adapt_update(const esp_rtp_session_feedback_t *feedback, size_t count);
+int esp_rtp_adapt_get_level();
+
+#endif //ESPCAM_RTP_ADAPT_H
@@ -0,0 +1,40 @@
+//
+// Created on 18/10/2026.
+//
+
+#ifndef ESPCAM_RTP_FEC_H
+#define ESPCAM_RTP_FEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <lwip/sockets.h>
+
+#include "rtp-jpeg.h"
+
+#define RTP_FEC_HEADER_SIZE 10
+#define RTP_FEC_LEVEL_HEADER_SIZE 4     // Level 0 header with a 16 bit mask
+#define RTP_FEC_MAX_GROUP_SIZE 16
+
+/* XOR accumulator for one RFC 5109 ULPFEC group. Every media packet sent
+ * is folded in, when the group is complete one FEC packet can restore any
+ * single packet of the group.
+ */
+typedef struct {
+    uint8_t group_size;         // Media packets per FEC packet, 0 disables FEC
+    uint8_t count;              // Media packets in the current group
+    uint16_t sn_base;
+    uint16_t mask;
+    uint8_t header_xor[8];      // First 8 bytes of the RTP headers, the sequence number is ignored
+    uint16_t length_xor;
+    uint16_t protection_length; // Longest payload in the group
+    uint8_t payload[MAX_PAYLOAD_SIZE - RTP_HEADER_SIZE];
+} esp_rtp_fec_t;
+
+void esp_rtp_fec_init(esp_rtp_fec_t *fec, uint8_t group_size);
+void esp_rtp_fec_add(esp_rtp_fec_t *fec, const uint8_t *rtp_header, const struct iovec *payload, int iovlen);
+int esp_rtp_fec_complete(const esp_rtp_fec_t *fec, int marker);
+size_t esp_rtp_fec_serialize_header(const esp_rtp_fec_t *fec, uint8_t *buffer, size_t length);
+void esp_rtp_fec_reset(esp_rtp_fec_t *fec);
+
+#endif //ESPCAM_RTP_FEC_H
@@ -0,0 +1,54 @@
+//
+// Created on 18/10/2026.
+//
+
+#ifndef ESPCAM_RTP_HISTORY_H
+#define ESPCAM_RTP_HISTORY_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include "rtp-jpeg.h"
+
+typedef struct {
+    uint32_t packets;           // Packets that can be resent now
+    uint32_t frames;            // Frames kept alive by the history
+    uint32_t bytes;             // JPEG bytes of those frames
+    uint32_t bytes_peak;
+    uint32_t budget_bytes;
+    uint32_t hits;              // Requested packets found in the history
+    uint32_t misses;            // Requested packets that were evicted or never sent
+} esp_rtp_history_stats_t;
+
+typedef struct {
+    uint16_t sequence_number;
+    uint16_t index;
+    esp_rtp_jpeg_frame_t *jpeg_frame;
+} esp_rtp_history_entry_t;
+
+/* Ring of the packets recently sent in a session. Entries reference the
+ * packetized frame instead of copying the packet, so a packet is rebuilt
+ * from the frame when it is resent. Retained frames keep their camera
+ * frame buffer, the ring is bounded by a number of JPEG bytes on top of its
+ * number of entries. The number of frames is bounded for all histories
+ * together by CONFIG_ESP_RTSP_NACK_HISTORY_FRAMES.
+ */
+typedef struct esp_rtp_history {
+    SemaphoreHandle_t lock;
+    esp_rtp_history_entry_t *entries;
+    size_t capacity;
+    size_t head;                // Oldest entry
+    size_t count;
+    uint32_t budget_bytes;
+    struct esp_rtp_history *next;
+
+    esp_rtp_history_stats_t stats;
+} esp_rtp_history_t;
+
+esp_err_t esp_rtp_history_init(esp_rtp_history_t *history, size_t capacity, uint32_t budget_bytes);
+void esp_rtp_history_free(esp_rtp_history_t *history);
+void esp_rtp_history_add(esp_rtp_history_t *history, uint16_t sequence_number, esp_rtp_jpeg_frame_t *jpeg_frame, size_t index);
+esp_rtp_jpeg_frame_t *esp_rtp_history_find(esp_rtp_history_t *history, uint16_t sequence_number, size_t *index);
+void esp_rtp_history_get_stats(esp_rtp_history_t *history, esp_rtp_history_stats_t *stats);
+
+#endif //ESPCAM_RTP_HISTORY_H
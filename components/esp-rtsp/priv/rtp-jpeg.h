@@ -0,0 +1,134 @@
+//
+// Created on 18/10/2026.
+//
+
+#ifndef ESPCAM_RTP_JPEG_H
+#define ESPCAM_RTP_JPEG_H
+
+#include <esp_err.h>
+
+#include "esp-frame.h"
+
+#define RTP_HEADER_SIZE 12
+#define RTP_JPEG_HEADER_SIZE 8
+#define RTP_RESTART_HEADER_SIZE 4
+#define RTP_QUANT_TABLES_SIZE 128
+#define RTP_QUANT_HEADER_SIZE (4 + RTP_QUANT_TABLES_SIZE)
+
+// Q values with tables sent in-band, a Q value keeps its tables until it is reused after 127 table changes
+#define RTP_Q_DYNAMIC_MIN 128
+#define RTP_Q_DYNAMIC_MAX 254
+
+#define MAX_PAYLOAD_SIZE 1472 // This is based on MTU 1500 minus udp headers
+#define MIN_PAYLOAD_SIZE 548  // Every IPv4 host takes 576 byte datagrams
+
+// Room for all JPEG headers with the quant tables and still some scan data
+#define RTP_JPEG_MIN_PACKET_SIZE 256
+
+// The fragment offset is 24 bits on the wire
+#define RTP_JPEG_MAX_FRAME_SIZE 0xFFFFFF
+
+// Width and height are sent in 8 pixel blocks in a single byte, larger frames send 0 and rely on a=x-dimensions
+#define RTP_JPEG_MAX_DIMENSION 2040
+
+typedef struct {
+    uint8_t type_specific;
+    uint32_t fragment_offset;
+    uint8_t type;
+    uint8_t q;
+    uint16_t width;
+    uint16_t height;
+} esp_rtp_jpeg_header_t;
+
+#define JPEG_SUBSAMPLING_422 0  // RFC 2435 type 0
+#define JPEG_SUBSAMPLING_420 1  // RFC 2435 type 1
+
+// Types 64-127 are types 0-63 with restart markers and a restart marker header
+#define RTP_JPEG_TYPE_RESTART 64
+
+typedef struct {
+    char *jpeg_data_start;
+    size_t jpeg_data_length;
+    char *quant_table_0;        // Points at the table id byte followed by 64 bytes
+    char *quant_table_1;
+    char *huffman_tables;       // First DHT segment, NULL when the frame uses the default tables
+    uint16_t restart_interval;  // From DRI, 0 without restart markers
+    uint16_t width;             // From SOF0
+    uint16_t height;
+    uint8_t subsampling;
+} esp_rtsp_jpeg_data_t;
+
+esp_err_t esp_rtsp_jpeg_decode(char *buffer, size_t length, esp_rtsp_jpeg_data_t *rtsp_jpeg_data);
+const char *esp_rtsp_jpeg_next_restart(const char *start, const char *end);
+
+typedef struct {
+    uint8_t mbz;
+    uint8_t precision;
+    uint16_t length;
+} esp_rtp_quant_t;
+
+#define RTP_QUANT_DEFAULT() { \
+    .mbz = 0,                 \
+    .precision = 0,           \
+    .length = 128             \
+}
+
+/* A single RTP/JPEG packet of a packetized frame, produced on demand by
+ * esp_rtp_jpeg_get_packet. The payload is a reference into the frame buffer.
+ */
+typedef struct {
+    uint32_t fragment_offset;
+    uint16_t length;
+    uint8_t marker;
+    uint8_t include_quant;  // Quant header present, the tables themselves are sent once per session
+    uint8_t jpeg_header_length;
+    uint8_t jpeg_header[RTP_JPEG_HEADER_SIZE + RTP_RESTART_HEADER_SIZE];   // Followed by the restart header for types 64-127
+} esp_rtp_jpeg_packet_t;
+
+/* Packet boundaries of a frame with restart markers. Packets start at a
+ * restart interval and hold whole intervals, only an interval larger than
+ * a packet is split.
+ */
+typedef struct {
+    uint32_t fragment_offset;
+    uint16_t length;
+    uint16_t restart_count;     // First and last bits and the number of the first restart interval
+} esp_rtp_jpeg_restart_packet_t;
+
+/* A frame split into RTP/JPEG packets. It is built once per frame and shared
+ * by every session, only the RTP header is serialized per session. It holds a
+ * reference on the camera frame, so the frame buffer stays pinned until the
+ * last packet referencing it has been sent.
+ *
+ * Only the packet layout is stored, the packets themselves are derived from
+ * the index when they are sent. The size of this struct doesn't depend on the
+ * size of the frame, so large frames never need more than their camera buffer.
+ * Frames with restart markers are the exception, their packet boundaries
+ * follow the restart intervals and are kept in restart_packets.
+ */
+typedef struct {
+    uint32_t refcount;
+    esp_frame_t *frame;
+    esp_rtsp_jpeg_data_t jpeg_data;
+    uint32_t timestamp; // 90kHz clock
+    uint8_t q;
+    uint32_t quant_generation;      // Changes with the tables, unlike q it never repeats
+    const uint8_t *quant_table_0;   // In the frame buffer
+    const uint8_t *quant_table_1;
+    esp_rtp_jpeg_header_t header;
+    uint8_t include_quant;
+    uint16_t max_payload_size;  // UDP payload the packets were sized for, headers included
+    size_t first_payload_size;  // The first packet may carry the quant header
+    size_t payload_size;
+    size_t packet_count;
+    size_t wire_size;           // RTP and JPEG headers plus payload of all packets
+    esp_rtp_jpeg_restart_packet_t *restart_packets;    // Only for frames with restart markers
+} esp_rtp_jpeg_frame_t;
+
+esp_err_t esp_rtp_jpeg_packetize(esp_frame_t *frame, size_t max_payload_size, esp_rtp_jpeg_frame_t **jpeg_frame);
+esp_err_t esp_rtp_jpeg_get_packet(const esp_rtp_jpeg_frame_t *jpeg_frame, size_t index, esp_rtp_jpeg_packet_t *packet);
+int esp_rtp_jpeg_serialize_quant_header(int include_tables, uint8_t *buffer, size_t length);
+esp_rtp_jpeg_frame_t *esp_rtp_jpeg_frame_ref(esp_rtp_jpeg_frame_t *jpeg_frame);
+void esp_rtp_jpeg_frame_unref(esp_rtp_jpeg_frame_t *jpeg_frame);
+
+#endif //ESPCAM_RTP_JPEG_H
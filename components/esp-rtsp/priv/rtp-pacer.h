@@ -0,0 +1,29 @@
+//
+// Created on 18/10/2026.
+//
+
+#ifndef ESPCAM_RTP_PACER_H
+#define ESPCAM_RTP_PACER_H
+
+#include "rtp-udp.h"
+
+typedef struct {
+    uint32_t frames_paced;          // Frames started, every started frame is queued completely
+    uint32_t packets_queued;
+    uint32_t queue_full;            // Times the pacer found the send queue full
+    uint32_t queue_high_watermark;
+    uint32_t packets_dropped;       // Packets that could not be queued or sent
+    uint32_t send_retries;          // lwIP was out of buffers, retried on the next tick
+    uint32_t resends_queued;        // Retransmissions asked for by NACKs
+    uint32_t resends_dropped;       // Retransmissions that found the queue full or could not be sent
+} esp_rtp_pacer_stats_t;
+
+esp_err_t esp_rtp_pacer_start();
+esp_err_t esp_rtp_pacer_add_session(esp_rtp_session_handle_t session);
+esp_err_t esp_rtp_pacer_remove_session(esp_rtp_session_handle_t session);
+int esp_rtp_pacer_session_count();
+esp_err_t esp_rtp_pacer_offer_frame(esp_frame_t *frame, uint32_t interval_ms, int *overrun);
+esp_err_t esp_rtp_pacer_resend(esp_rtp_session_handle_t session, esp_rtp_jpeg_frame_t *jpeg_frame, size_t index, uint16_t sequence_number);
+esp_err_t esp_rtp_pacer_get_stats(esp_rtp_pacer_stats_t *stats);
+
+#endif //ESPCAM_RTP_PACER_H
@@ -5,8 +5,44 @@
 #ifndef ESPCAM_RTP_UDP_H
 #define ESPCAM_RTP_UDP_H
 
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include "rtp-jpeg.h"
+#include "rtp-fec.h"
+#include "rtp-history.h"
+
+typedef struct {
+    uint32_t frames_sent;
+    uint32_t frames_dropped;    // Replaced by a newer frame before the first packet went out
+    uint32_t frames_aborted;    // Packets could not be sent, the rest of the frame was skipped
+    uint32_t frames_skipped;    // Interleaved only, the connection was backed up when the frame started
+    uint32_t packets_sent;
+    uint32_t fec_packets_sent;
+    uint32_t nacks_received;    // Packets reported missing by the client
+    uint32_t packets_resent;
+    uint32_t octets_sent;       // RTP payload bytes of media and FEC packets, as reported in sender reports
+    uint64_t bytes_copied;      // Header bytes built for this session
+    uint64_t bytes_referenced;  // Shared headers and JPEG bytes sent straight from the frame
+    uint32_t frame_packets;     // Packets in the last frame sent
+    uint32_t frame_bytes;       // Size of the last frame sent, RTP and JPEG headers included
+} esp_rtp_session_stats_t;
+
+// Reception quality as reported by the client in RTCP receiver reports
+typedef struct {
+    uint32_t reports;           // Report blocks received for our SSRC
+    uint8_t fraction_lost;      // Since the previous report, in 1/256
+    int32_t cumulative_lost;
+    uint32_t highest_sequence;  // Extended highest sequence number received
+    uint32_t jitter;            // Interarrival jitter in 90kHz timestamp units
+    uint32_t rtt_ms;            // Round trip time, 0 until a report refers to one of our sender reports
+    int64_t last_report;        // esp_timer time the last report arrived
+} esp_rtp_session_feedback_t;
+
 typedef struct {
     int initialized;
+    int closing;
+    uint32_t refcount;
 
     uint16_t rtp_socket;
     uint16_t rtcp_socket;
@@ -18,8 +54,46 @@ typedef struct {
     uint16_t dst_rtp_port;
     uint16_t dst_rtcp_port;
 
-    uint32_t timestamp;
+    uint16_t max_payload_size;  // Largest UDP payload, smaller for paths that would fragment
+
+    int multicast;              // Shared by every multicast viewer, dst_addr is the group
+    int shared_sockets;         // Sends from the server wide socket pair, never closes it
+    int rtcp_mux;               // RTCP on the RTP port (RFC 5761)
+
+    // RTP and RTCP interleaved on the RTSP connection (RFC 2326 section 10.12)
+    int interleaved;
+    int tcp_socket;
+    uint8_t rtp_channel;
+    uint8_t rtcp_channel;
+    SemaphoreHandle_t write_lock;   // Shared with the RTSP responses on the connection
+    uint8_t *tail;                  // Unwritten end of a packet that only partly fit in the send buffer
+    size_t tail_length;
+    int response_pending;           // An RTSP response is partly written, packets wait for the rest
+
+    uint32_t timestamp;         // Random offset added to the frame timestamp
     uint32_t sequence_number;
+    uint32_t ssrc;
+
+    uint32_t quant_generation_sent; // Generation of the quantization tables the session received last, 0 for none
+    uint32_t quant_frames;      // Frames since the tables were sent
+
+    // Latest frame waiting to be sent, owned by the pacer once taken
+    portMUX_TYPE lock;
+    esp_rtp_jpeg_frame_t *pending;
+    uint32_t aborted_sequence;
+    int aborted;
+
+    esp_rtp_session_stats_t stats;
+    esp_rtp_session_feedback_t feedback;    // Protected by lock
+
+#ifdef CONFIG_ESP_RTSP_NACK
+    esp_rtp_history_t history;
+#endif
+
+#ifdef CONFIG_ESP_RTSP_FEC
+    uint8_t fec_group_size;     // Requested group size, applied by the sender when the current group is done
+    esp_rtp_fec_t fec;
+#endif
 } esp_rtp_session_t;
 
 typedef void* esp_rtp_session_handle_t;
@@ -32,42 +106,30 @@ typedef struct {
     uint32_t ssrc;
 } esp_rtp_header_t;
 
-typedef struct {
-    uint8_t type_specific;
-    uint16_t fragment_offset;
-    uint8_t type;
-    uint8_t q;
-    uint16_t width;
-    uint16_t height;
-} esp_rtp_jpeg_header_t;
-
-typedef struct {
-    char *jpeg_data_start;
-    size_t jpeg_data_length;
-    char *quant_table_0;
-    char *quant_table_1;
-} esp_rtsp_jpeg_data_t;
-
-esp_err_t esp_rtsp_jpeg_decode(char *buffer, size_t length, esp_rtsp_jpeg_data_t *rtsp_jpeg_data);
-
-typedef struct {
-    uint8_t mbz;
-    uint8_t precision;
-    uint16_t length;
-    char table0[64];
-    char table1[64];
-} esp_rtp_quant_t;
-
-#define RTP_QUANT_DEFAULT() { \
-    .mbz = 0,                 \
-    .precision = 0,           \
-    .length = 128             \
-}
-
-esp_err_t esp_rtp_init(esp_rtp_session_handle_t *rtp_session, int dst_rtp_port, int dst_rtcp_port, char *dst_addr_string);
+esp_err_t esp_rtp_start();
+esp_err_t esp_rtp_socket_set_dscp(int sockfd, int dscp);
+esp_err_t esp_rtp_init(esp_rtp_session_handle_t *rtp_session, int dst_rtp_port, int dst_rtcp_port, int rtcp_mux, char *dst_addr_string);
+esp_err_t esp_rtp_init_multicast(esp_rtp_session_handle_t *rtp_session, const char *group, int port, int ttl);
+esp_err_t esp_rtp_init_interleaved(esp_rtp_session_handle_t *rtp_session, int tcp_socket, int rtp_channel, int rtcp_channel);
 esp_err_t esp_rtp_teardown(esp_rtp_session_handle_t rtp_session);
-esp_err_t esp_rtp_send_jpeg(esp_rtp_session_handle_t rtp_session, uint8_t *frame, size_t frame_length);
+esp_rtp_session_handle_t esp_rtp_session_ref(esp_rtp_session_handle_t rtp_session);
+void esp_rtp_session_unref(esp_rtp_session_handle_t rtp_session);
+int esp_rtp_session_offer_frame(esp_rtp_session_handle_t rtp_session, esp_rtp_jpeg_frame_t *jpeg_frame);
+esp_rtp_jpeg_frame_t *esp_rtp_session_take_frame(esp_rtp_session_handle_t rtp_session);
+int esp_rtp_session_sends_tables(esp_rtp_session_handle_t rtp_session, const esp_rtp_jpeg_frame_t *jpeg_frame);
+void esp_rtp_session_abort_frame(esp_rtp_session_handle_t rtp_session, const esp_rtp_jpeg_frame_t *jpeg_frame);
+esp_err_t esp_rtp_send_jpeg_packet(esp_rtp_session_handle_t rtp_session, esp_rtp_jpeg_frame_t *jpeg_frame, size_t index);
+esp_err_t esp_rtp_resend_jpeg_packet(esp_rtp_session_handle_t rtp_session, const esp_rtp_jpeg_frame_t *jpeg_frame, size_t index, uint16_t sequence_number);
+esp_err_t esp_rtp_send_rtcp(esp_rtp_session_handle_t rtp_session, const uint8_t *buffer, size_t length);
+ssize_t esp_rtp_interleaved_writev(esp_rtp_session_handle_t rtp_session, struct iovec *iov, int iovcnt);
+const uint8_t *esp_rtp_interleaved_stop(esp_rtp_session_handle_t rtp_session, size_t *length);
+esp_err_t esp_rtp_set_max_payload_size(esp_rtp_session_handle_t rtp_session, size_t max_payload_size);
+size_t esp_rtp_get_max_payload_size(esp_rtp_session_handle_t rtp_session);
 int esp_rtp_get_src_rtp_port(esp_rtp_session_handle_t rtp_session);
 int esp_rtp_get_src_rtcp_port(esp_rtp_session_handle_t rtp_session);
+esp_err_t esp_rtp_get_stats(esp_rtp_session_handle_t rtp_session, esp_rtp_session_stats_t *stats);
+esp_err_t esp_rtp_get_feedback(esp_rtp_session_handle_t rtp_session, esp_rtp_session_feedback_t *feedback);
+esp_err_t esp_rtp_get_history_stats(esp_rtp_session_handle_t rtp_session, esp_rtp_history_stats_t *stats);
+esp_err_t esp_rtp_set_fec_group_size(esp_rtp_session_handle_t rtp_session, uint8_t group_size);
 
 #endif //ESPCAM_RTP_UDP_H
@@ -0,0 +1,44 @@
+//
+// Created on 18/10/2026.
+//
+
+#ifndef ESPCAM_RTSP_OUTPUT_H
+#define ESPCAM_RTSP_OUTPUT_H
+
+#include <stdarg.h>
+#include <stddef.h>
+
+#include <esp_err.h>
+#include <lwip/sockets.h>
+
+// Room for the formatted parts of the responses waiting on a connection
+#define RTSP_OUTPUT_BUFFER_SIZE 2048
+#define RTSP_OUTPUT_IOVECS 8
+
+/* The responses waiting to be written to a connection, as a list of iovecs
+ * in wire order. An iovec points either into the buffer, for the parts that
+ * were formatted, or at a constant response that is sent as it is. The
+ * buffer is allocated once and reused, it starts over when the queue is
+ * empty.
+ */
+typedef struct {
+    char *buffer;
+    size_t buffer_length;
+    struct iovec iov[RTSP_OUTPUT_IOVECS];
+    size_t head;                // First iovec not completely written
+    size_t count;
+    int overflow;               // A response didn't fit, the connection can't continue
+} rtsp_output_t;
+
+esp_err_t rtsp_output_init(rtsp_output_t *output);
+void rtsp_output_free(rtsp_output_t *output);
+char *rtsp_output_vformat(rtsp_output_t *output, size_t *length, const char *format, va_list args);
+char *rtsp_output_format(rtsp_output_t *output, size_t *length, const char *format, ...)
+        __attribute__((format(printf, 3, 4)));
+char *rtsp_output_copy(rtsp_output_t *output, const void *data, size_t length);
+esp_err_t rtsp_output_queue(rtsp_output_t *output, const void *data, size_t length);
+int rtsp_output_pending(const rtsp_output_t *output);
+int rtsp_output_peek(rtsp_output_t *output, struct iovec **iov);
+void rtsp_output_consume(rtsp_output_t *output, size_t length);
+
+#endif //ESPCAM_RTSP_OUTPUT_H
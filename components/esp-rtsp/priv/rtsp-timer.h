@@ -0,0 +1,44 @@
+//
+// Created on 18/10/2026.
+//
+
+#ifndef ESPCAM_RTSP_TIMER_H
+#define ESPCAM_RTSP_TIMER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define RTSP_TIMER_TICK_MS 50
+#define RTSP_TIMER_SLOTS 64     // 3.2 seconds per turn, later timers wait for their turn in the slot
+
+typedef void (*rtsp_timer_callback_t)(void *arg);
+
+/* A timer owned by the caller and linked into the wheel while armed, arming
+ * and cancelling never allocate.
+ */
+typedef struct rtsp_timer {
+    struct rtsp_timer *next;
+    int64_t deadline;           // esp_timer time
+    rtsp_timer_callback_t callback;
+    void *arg;
+    int armed;
+    size_t slot;
+} rtsp_timer_t;
+
+/* A hashed timer wheel for the server loop. Timers hash into a slot by the
+ * tick of their deadline, running the wheel only visits the slots of the
+ * ticks that went by. Not thread safe, it belongs to the task that runs it.
+ */
+typedef struct {
+    rtsp_timer_t *slots[RTSP_TIMER_SLOTS];
+    int64_t tick;               // Ticks up to here have been run, later ones are still to come
+    size_t armed;
+} rtsp_timer_wheel_t;
+
+void rtsp_timer_wheel_init(rtsp_timer_wheel_t *wheel, int64_t now);
+void rtsp_timer_init(rtsp_timer_t *timer, rtsp_timer_callback_t callback, void *arg);
+void rtsp_timer_arm(rtsp_timer_wheel_t *wheel, rtsp_timer_t *timer, int64_t deadline);
+void rtsp_timer_cancel(rtsp_timer_wheel_t *wheel, rtsp_timer_t *timer);
+int64_t rtsp_timer_wheel_run(rtsp_timer_wheel_t *wheel, int64_t now);
+
+#endif //ESPCAM_RTSP_TIMER_H
@@ -0,0 +1,449 @@
+//
+// Created on 18/10/2026.
+//
+
+/* RTCP for the RTP sessions (RFC 3550 section 6). Every session sends a
+ * sender report with an SDES CNAME at a fixed interval, and the receiver
+ * reports coming back on the RTCP socket are parsed into the session
+ * feedback: loss, jitter and round trip time. That feedback is passed on
+ * to the quality controller in rtp-adapt.c once a second. Generic NACKs
+ * (RFC 4585) queue the missing packets for a resend from the history.
+ */
+
+#include <string.h>
+#include <sys/time.h>
+
+#include <freertos/FreeRTOS.h>
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <lwip/sockets.h>
+
+#include "sdkconfig.h"
+#include "rtcp.h"
+#include "rtp-adapt.h"
+#include "rtp-pacer.h"
+
+#define TAG "rtcp"
+
+#define MAX_SESSIONS 8
+
+#define RTCP_VERSION 2
+#define RTCP_SR 200
+#define RTCP_RR 201
+#define RTCP_SDES 202
+#define RTCP_RTPFB 205
+#define RTCP_PT_MIN 192    // Payload types RTP must not use (RFC 5761 section 4)
+#define RTCP_PT_MAX 223
+
+#define RTCP_RTPFB_NACK 1
+
+#define RTCP_SDES_CNAME 1
+#define RTCP_CNAME "esp32cam"
+
+#define RTCP_BUFFER_SIZE 512
+
+// The quality controller is fed the session feedback at this rate
+#define RTCP_ADAPT_MS 1000
+
+// Seconds between 1900 (NTP epoch) and 1970 (unix epoch)
+#define NTP_UNIX_OFFSET 2208988800UL
+
+typedef struct {
+    esp_rtp_session_handle_t session;
+    rtsp_timer_t report_timer;
+} esp_rtcp_session_t;
+
+// Only used from the server task, no locking
+static esp_rtcp_session_t rtcp_sessions[MAX_SESSIONS];
+static rtsp_timer_wheel_t *timers;
+static rtsp_timer_t adapt_timer;
+
+static uint64_t ntp_now() {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    uint64_t seconds = (uint64_t) now.tv_sec + NTP_UNIX_OFFSET;
+    uint64_t fraction = ((uint64_t) now.tv_usec << 32) / 1000000;
+    return seconds << 32 | fraction;
+}
+
+static void write_u16(uint8_t *buffer, uint16_t value) {
+    buffer[0] = value >> 8;
+    buffer[1] = value & 0xFF;
+}
+
+static void write_u32(uint8_t *buffer, uint32_t value) {
+    buffer[0] = value >> 24;
+    buffer[1] = (value >> 16) & 0xFF;
+    buffer[2] = (value >> 8) & 0xFF;
+    buffer[3] = value & 0xFF;
+}
+
+static uint32_t read_u32(const uint8_t *buffer) {
+    return (uint32_t) buffer[0] << 24 | buffer[1] << 16 | buffer[2] << 8 | buffer[3];
+}
+
+static int serialize_header(uint8_t *buffer, uint8_t count, uint8_t packet_type, size_t length) {
+    buffer[0] = RTCP_VERSION << 6 | (count & 0x1F);
+    buffer[1] = packet_type;
+    write_u16(&buffer[2], length / 4 - 1); // In 32 bit words minus one
+    return 4;
+}
+
+/* A compound packet with a sender report without report blocks, we don't
+ * receive RTP, followed by the mandatory SDES with our CNAME.
+ */
+static size_t serialize_sender_report(esp_rtp_session_t *session, uint8_t *buffer, size_t length) {
+    size_t cname_length = strlen(RTCP_CNAME);
+    size_t sdes_length = (4 + 4 + 2 + cname_length + 1 + 3) & ~3; // Header, SSRC, item, end of list, padded
+    size_t sr_length = 28;
+
+    if (length < sr_length + sdes_length) {
+        return 0;
+    }
+
+    uint64_t ntp = ntp_now();
+    uint32_t rtp_timestamp = session->timestamp + (uint32_t) (esp_timer_get_time() * 9 / 100);
+
+    uint8_t *sr = buffer;
+    serialize_header(sr, 0, RTCP_SR, sr_length);
+    write_u32(&sr[4], session->ssrc);
+    write_u32(&sr[8], ntp >> 32);
+    write_u32(&sr[12], ntp & 0xFFFFFFFF);
+    write_u32(&sr[16], rtp_timestamp);
+    // FEC packets go out on the same SSRC, they count as sent like the media packets
+    write_u32(&sr[20], session->stats.packets_sent + session->stats.fec_packets_sent);
+    write_u32(&sr[24], session->stats.octets_sent);
+
+    uint8_t *sdes = buffer + sr_length;
+    memset(sdes, 0, sdes_length);
+    serialize_header(sdes, 1, RTCP_SDES, sdes_length);
+    write_u32(&sdes[4], session->ssrc);
+    sdes[8] = RTCP_SDES_CNAME;
+    sdes[9] = cname_length;
+    memcpy(&sdes[10], RTCP_CNAME, cname_length);
+
+    return sr_length + sdes_length;
+}
+
+static void send_sender_report(esp_rtp_session_t *session) {
+    uint8_t buffer[64];
+    size_t length = serialize_sender_report(session, buffer, sizeof(buffer));
+    if (!length) {
+        return;
+    }
+
+    if (esp_rtp_send_rtcp(session, buffer, length) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to send sender report: %d", errno);
+    }
+}
+
+#ifdef CONFIG_ESP_RTSP_FEC
+/* One FEC packet repairs one loss in its group, so the group is sized to
+ * expect about half a lost packet. Without loss the configured size is kept.
+ */
+static void update_fec_ratio(esp_rtp_session_t *session, uint8_t fraction_lost) {
+    if (session->interleaved) {
+        return;
+    }
+
+    int group_size = CONFIG_ESP_RTSP_FEC_GROUP_SIZE;
+    if (fraction_lost) {
+        int wanted = 128 / fraction_lost;
+        if (wanted < group_size) {
+            group_size = wanted < 2 ? 2 : wanted;
+        }
+    }
+
+    if (group_size != session->fec_group_size) {
+        ESP_LOGI(TAG, "Loss %d/256, one FEC packet per %d packets", fraction_lost, group_size);
+        esp_rtp_set_fec_group_size(session, group_size);
+    }
+}
+#endif
+
+static void handle_report_block(esp_rtp_session_t *session, const uint8_t *block) {
+    if (read_u32(&block[0]) != session->ssrc) {
+        return;
+    }
+
+    uint32_t lost = read_u32(&block[4]) & 0xFFFFFF;
+    uint32_t lsr = read_u32(&block[16]);
+    uint32_t dlsr = read_u32(&block[20]);
+
+    // Middle 32 bits of the NTP timestamp, in 1/65536 seconds
+    uint32_t rtt = 0;
+    if (lsr) {
+        uint32_t arrival = (ntp_now() >> 16) & 0xFFFFFFFF;
+        int32_t delta = (int32_t) (arrival - lsr - dlsr);
+        if (delta > 0) {
+            rtt = (uint32_t) ((uint64_t) delta * 1000 / 65536);
+        }
+    }
+
+    portENTER_CRITICAL(&session->lock);
+    esp_rtp_session_feedback_t *feedback = &session->feedback;
+    feedback->reports++;
+    feedback->fraction_lost = block[4];
+    feedback->cumulative_lost = lost & 0x800000 ? (int32_t) (lost | 0xFF000000) : (int32_t) lost;
+    feedback->highest_sequence = read_u32(&block[8]);
+    feedback->jitter = read_u32(&block[12]);
+    if (lsr) {
+        feedback->rtt_ms = rtt;
+    }
+    feedback->last_report = esp_timer_get_time();
+    portEXIT_CRITICAL(&session->lock);
+
+    ESP_LOGD(TAG, "Receiver report: lost %d/256 (%d total), jitter %u, rtt %u ms",
+             block[4], feedback->cumulative_lost, feedback->jitter, feedback->rtt_ms);
+
+#ifdef CONFIG_ESP_RTSP_FEC
+    update_fec_ratio(session, block[4]);
+#endif
+}
+
+#ifdef CONFIG_ESP_RTSP_NACK
+static void resend_packet(esp_rtp_session_t *session, uint16_t sequence_number) {
+    session->stats.nacks_received++;
+
+    size_t index;
+    esp_rtp_jpeg_frame_t *jpeg_frame = esp_rtp_history_find(&session->history, sequence_number, &index);
+    if (!jpeg_frame) {
+        ESP_LOGD(TAG, "Packet %u is no longer in the history", sequence_number);
+        return;
+    }
+
+    esp_rtp_pacer_resend(session, jpeg_frame, index, sequence_number);
+    esp_rtp_jpeg_frame_unref(jpeg_frame);
+}
+
+static void handle_nack(esp_rtp_session_t *session, const uint8_t *packet, size_t length) {
+    if (length < 12 || read_u32(&packet[8]) != session->ssrc) {
+        return;
+    }
+
+    // Every entry names a lost packet and a bitmask of lost packets following it
+    for (size_t position = 12; position + 4 <= length; position += 4) {
+        uint16_t pid = packet[position] << 8 | packet[position + 1];
+        uint16_t blp = packet[position + 2] << 8 | packet[position + 3];
+
+        resend_packet(session, pid);
+        for (int i = 0; i < 16; i++) {
+            if (blp & (1 << i)) {
+                resend_packet(session, pid + i + 1);
+            }
+        }
+    }
+}
+#endif
+
+static void handle_compound_packet(esp_rtp_session_t *session, const uint8_t *buffer, size_t length) {
+    size_t position = 0;
+
+    while (position + 4 <= length) {
+        const uint8_t *packet = buffer + position;
+        size_t packet_length = ((packet[2] << 8 | packet[3]) + 1) * 4;
+
+        if (packet[0] >> 6 != RTCP_VERSION || position + packet_length > length) {
+            ESP_LOGW(TAG, "Invalid RTCP packet");
+            return;
+        }
+
+        uint8_t count = packet[0] & 0x1F;
+        size_t blocks = 0;
+        if (packet[1] == RTCP_RR) {
+            blocks = 8;         // Header and SSRC of the sender
+        } else if (packet[1] == RTCP_SR) {
+            blocks = 8 + 20;    // The client sends RTP as well, skip its sender info
+        }
+
+        if (blocks) {
+            for (int i = 0; i < count && blocks + 24 <= packet_length; i++, blocks += 24) {
+                handle_report_block(session, packet + blocks);
+            }
+        }
+
+#ifdef CONFIG_ESP_RTSP_NACK
+        if (packet[1] == RTCP_RTPFB && count == RTCP_RTPFB_NACK) {
+            handle_nack(session, packet, packet_length);
+        }
+#endif
+
+        position += packet_length;
+    }
+}
+
+/* Unicast sessions share their sockets, a report is handed to every session
+ * on the socket it arrived on and each takes the blocks for its own SSRC.
+ */
+static void receive_reports(int sock) {
+    uint8_t buffer[RTCP_BUFFER_SIZE];
+
+    for (;;) {
+        ssize_t received = recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (received <= 0) {
+            return;
+        }
+
+        // With rtcp-mux anything that isn't RTCP arrived on the RTP socket by mistake (RFC 5761 section 4)
+        if (received < 8 || buffer[1] < RTCP_PT_MIN || buffer[1] > RTCP_PT_MAX) {
+            continue;
+        }
+
+        for (int i = 0; i < MAX_SESSIONS; i++) {
+            esp_rtp_session_t *session = rtcp_sessions[i].session;
+            if (session && !session->interleaved && session->rtcp_socket == sock) {
+                handle_compound_packet(session, buffer, received);
+            }
+        }
+    }
+}
+
+static void rtcp_adapt_update() {
+    esp_rtp_session_feedback_t feedback[MAX_SESSIONS];
+    size_t count = 0;
+
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+        if (rtcp_sessions[i].session && esp_rtp_get_feedback(rtcp_sessions[i].session, &feedback[count]) == ESP_OK) {
+            count++;
+        }
+    }
+
+    esp_rtp_adapt_update(feedback, count);
+}
+
+static void adapt_timer_expired(void *arg) {
+    rtcp_adapt_update();
+    rtsp_timer_arm(timers, &adapt_timer, esp_timer_get_time() + RTCP_ADAPT_MS * 1000LL);
+}
+
+static void report_timer_expired(void *arg) {
+    esp_rtcp_session_t *rtcp_session = arg;
+
+    send_sender_report(rtcp_session->session);
+    rtsp_timer_arm(timers, &rtcp_session->report_timer, esp_timer_get_time() + CONFIG_ESP_RTSP_RTCP_INTERVAL_MS * 1000LL);
+}
+
+/* RTCP runs on the server task, sender reports and the quality controller
+ * from timers on its wheel and receiver reports from its select loop.
+ */
+esp_err_t esp_rtcp_start(rtsp_timer_wheel_t *wheel) {
+    if (!wheel) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (timers) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    timers = wheel;
+    rtsp_timer_init(&adapt_timer, adapt_timer_expired, NULL);
+    rtsp_timer_arm(timers, &adapt_timer, esp_timer_get_time() + RTCP_ADAPT_MS * 1000LL);
+
+    return ESP_OK;
+}
+
+/* Drops every session and disarms the timers, the wheel goes away with the
+ * server loop.
+ */
+void esp_rtcp_stop() {
+    if (!timers) {
+        return;
+    }
+
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+        if (rtcp_sessions[i].session) {
+            esp_rtcp_remove_session(rtcp_sessions[i].session);
+        }
+    }
+
+    rtsp_timer_cancel(timers, &adapt_timer);
+    timers = NULL;
+}
+
+esp_err_t esp_rtcp_add_session(esp_rtp_session_handle_t session) {
+    if (!session) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (!timers) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+        esp_rtcp_session_t *rtcp_session = &rtcp_sessions[i];
+        if (!rtcp_session->session) {
+            rtcp_session->session = esp_rtp_session_ref(session);
+
+            // The first report goes out right away, it gives the client the timestamp mapping
+            rtsp_timer_init(&rtcp_session->report_timer, report_timer_expired, rtcp_session);
+            rtsp_timer_arm(timers, &rtcp_session->report_timer, esp_timer_get_time());
+            return ESP_OK;
+        }
+    }
+
+    return ESP_ERR_NO_MEM;
+}
+
+esp_err_t esp_rtcp_remove_session(esp_rtp_session_handle_t session) {
+    if (!session) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (!timers) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+        esp_rtcp_session_t *rtcp_session = &rtcp_sessions[i];
+        if (rtcp_session->session == session) {
+            rtsp_timer_cancel(timers, &rtcp_session->report_timer);
+            esp_rtp_session_unref(rtcp_session->session);
+            memset(rtcp_session, 0, sizeof(esp_rtcp_session_t));
+            return ESP_OK;
+        }
+    }
+
+    return ESP_ERR_NOT_FOUND;
+}
+
+/* Adds the sockets receiver reports arrive on to the read set of the server
+ * loop, returns the highest socket in the set.
+ */
+int esp_rtcp_fill_read_set(fd_set *read_set, int sock_max) {
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+        esp_rtp_session_t *session = rtcp_sessions[i].session;
+
+        // Interleaved sessions receive their reports on the RTSP connection
+        if (!session || session->interleaved) {
+            continue;
+        }
+
+        FD_SET(session->rtcp_socket, read_set);
+        if (session->rtcp_socket > sock_max) {
+            sock_max = session->rtcp_socket;
+        }
+    }
+
+    return sock_max;
+}
+
+void esp_rtcp_handle_read_set(const fd_set *read_set) {
+    // Shared sockets show up once per session, the first pass drains them
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+        esp_rtp_session_t *session = rtcp_sessions[i].session;
+        if (session && !session->interleaved && FD_ISSET(session->rtcp_socket, read_set)) {
+            receive_reports(session->rtcp_socket);
+        }
+    }
+}
+
+esp_err_t esp_rtcp_receive(esp_rtp_session_handle_t session, const uint8_t *buffer, size_t length) {
+    if (!session || !buffer) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    handle_compound_packet(session, buffer, length);
+    return ESP_OK;
+}
@@ -0,0 +1,239 @@
+//
+// Created on 18/10/2026.
+//
+
+/* Adapts the sensor quality and frame size to the network. The input is
+ * the RTCP feedback of every playing session plus the pressure on the
+ * local send queue. A level is a step down from the settings the camera
+ * was started with: first the JPEG quality is lowered, then the frame size.
+ *
+ * Stepping down needs two bad evaluations in a row, stepping up needs ten
+ * good ones, so the stream doesn't flap between levels.
+ *
+ * All sessions share one sensor. With the worst client policy the stream
+ * follows the client with the worst reception, so every client gets a
+ * usable stream. With the best client policy clients on a bad link are
+ * ignored, they lose frames from their latest-frame slot instead.
+ */
+
+#include <freertos/FreeRTOS.h>
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include "sdkconfig.h"
+#include "esp-frame.h"
+#include "rtp-adapt.h"
+#include "rtp-pacer.h"
+
+#define TAG "rtp-adapt"
+
+#define ADAPT_INTERVAL_MS 1000
+
+// Fraction lost is in 1/256
+#define LOSS_HIGH 13    // 5%
+#define LOSS_LOW 3      // 1%
+
+#define JITTER_HIGH_MS 100
+#define JITTER_LOW_MS 40
+
+#define DOWN_EVALUATIONS 2
+#define UP_EVALUATIONS 10
+
+// A session that hasn't reported for this many sender report intervals is left out
+#define REPORT_STALE_INTERVALS 3
+
+typedef struct {
+    uint8_t framesize_steps;
+    uint8_t quality_offset;
+} esp_rtp_adapt_level_t;
+
+static const esp_rtp_adapt_level_t levels[] = {
+        { .framesize_steps = 0, .quality_offset = 0 },
+        { .framesize_steps = 0, .quality_offset = 8 },
+        { .framesize_steps = 0, .quality_offset = 16 },
+        { .framesize_steps = 1, .quality_offset = 8 },
+        { .framesize_steps = 1, .quality_offset = 16 },
+        { .framesize_steps = 2, .quality_offset = 16 },
+};
+
+#define LEVEL_COUNT (sizeof(levels) / sizeof(levels[0]))
+
+// Frame sizes with a 4:3 or similar aspect ratio the ladder steps through
+static const framesize_t framesizes[] = {
+        FRAMESIZE_QVGA,
+        FRAMESIZE_CIF,
+        FRAMESIZE_VGA,
+        FRAMESIZE_SVGA,
+        FRAMESIZE_XGA,
+        FRAMESIZE_SXGA,
+        FRAMESIZE_UXGA,
+        FRAMESIZE_QXGA,
+};
+
+#define FRAMESIZE_COUNT (sizeof(framesizes) / sizeof(framesizes[0]))
+
+typedef struct {
+    int enabled;
+    esp_frame_sensor_settings_t initial;
+    int framesize_index;    // Index of the initial frame size in framesizes
+    int level;
+    int congested;          // Consecutive bad evaluations
+    int clear;              // Consecutive good evaluations
+    int64_t last_update;
+    uint32_t last_reports;
+    uint32_t last_pressure;
+} esp_rtp_adapt_t;
+
+static esp_rtp_adapt_t adapt;
+
+static void adapt_apply_level(int level) {
+    const esp_rtp_adapt_level_t *step = &levels[level];
+
+    int index = adapt.framesize_index - step->framesize_steps;
+    int quality = adapt.initial.quality + step->quality_offset;
+
+    esp_frame_sensor_settings_t settings = {
+            .framesize = index >= 0 ? framesizes[index] : framesizes[0],
+            .quality = quality <= 63 ? quality : 63,
+    };
+
+    if (esp_frame_source_apply_settings(&settings) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to apply level %d", level);
+        return;
+    }
+
+    ESP_LOGI(TAG, "Level %d -> %d: frame size %d, quality %d", adapt.level, level, settings.framesize, settings.quality);
+    adapt.level = level;
+    adapt.congested = 0;
+    adapt.clear = 0;
+}
+
+static uint32_t adapt_local_pressure() {
+    esp_rtp_pacer_stats_t stats;
+    if (esp_rtp_pacer_get_stats(&stats) != ESP_OK) {
+        return 0;
+    }
+    return stats.queue_full + stats.packets_dropped;
+}
+
+esp_err_t esp_rtp_adapt_start() {
+#ifdef CONFIG_ESP_RTSP_ADAPT
+    esp_err_t err = esp_frame_source_get_settings(&adapt.initial);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "No sensor settings, adaptation disabled");
+        return err;
+    }
+
+    adapt.framesize_index = -1;
+    for (int i = 0; i < FRAMESIZE_COUNT; i++) {
+        if (framesizes[i] == adapt.initial.framesize) {
+            adapt.framesize_index = i;
+            break;
+        }
+    }
+
+    if (adapt.framesize_index < 0) {
+        // Not on the ladder, only the quality can be adapted
+        ESP_LOGW(TAG, "Frame size %d is not adaptable, adapting quality only", adapt.initial.framesize);
+    }
+
+    adapt.last_pressure = adapt_local_pressure();
+    adapt.enabled = true;
+#endif
+    return ESP_OK;
+}
+
+int esp_rtp_adapt_get_level() {
+    return adapt.level;
+}
+
+void esp_rtp_adapt_update(const esp_rtp_session_feedback_t *feedback, size_t count) {
+    if (!adapt.enabled) {
+        return;
+    }
+
+    int64_t now = esp_timer_get_time();
+    if (now - adapt.last_update < ADAPT_INTERVAL_MS * 1000LL) {
+        return;
+    }
+    adapt.last_update = now;
+
+    if (count == 0) {
+        // Nobody is watching, the next client starts at full quality
+        if (adapt.level != 0) {
+            adapt_apply_level(0);
+        }
+        return;
+    }
+
+    uint32_t pressure = adapt_local_pressure();
+    int local_pressure = pressure != adapt.last_pressure;
+    adapt.last_pressure = pressure;
+
+    int64_t stale = now - REPORT_STALE_INTERVALS * CONFIG_ESP_RTSP_RTCP_INTERVAL_MS * 1000LL;
+    uint32_t reports = 0;
+    int sessions = 0;
+    uint8_t loss = 0;
+    uint32_t jitter_ms = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        reports += feedback[i].reports;
+        if (!feedback[i].reports || feedback[i].last_report < stale) {
+            continue;
+        }
+
+        uint8_t session_loss = feedback[i].fraction_lost;
+        uint32_t session_jitter_ms = feedback[i].jitter / 90;
+
+#ifdef CONFIG_ESP_RTSP_ADAPT_POLICY_BEST
+        if (!sessions || session_loss < loss) {
+            loss = session_loss;
+        }
+        if (!sessions || session_jitter_ms < jitter_ms) {
+            jitter_ms = session_jitter_ms;
+        }
+#else
+        if (session_loss > loss) {
+            loss = session_loss;
+        }
+        if (session_jitter_ms > jitter_ms) {
+            jitter_ms = session_jitter_ms;
+        }
+#endif
+        sessions++;
+    }
+
+    // Only evaluate on new information, a receiver report is repeated until the next one arrives
+    int new_reports = reports != adapt.last_reports;
+    adapt.last_reports = reports;
+    if (!new_reports && !local_pressure) {
+        return;
+    }
+
+    int bad = local_pressure || (sessions && (loss > LOSS_HIGH || jitter_ms > JITTER_HIGH_MS));
+    int good = !local_pressure && loss <= LOSS_LOW && jitter_ms < JITTER_LOW_MS;
+
+    ESP_LOGD(TAG, "Evaluation: loss %d/256, jitter %u ms, local pressure %d, level %d",
+             loss, jitter_ms, local_pressure, adapt.level);
+
+    if (bad) {
+        adapt.clear = 0;
+        if (++adapt.congested >= DOWN_EVALUATIONS && adapt.level < LEVEL_COUNT - 1) {
+            int level = adapt.level + 1;
+            // Without a ladder position only the quality only levels are usable
+            if (adapt.framesize_index >= 0 || levels[level].framesize_steps == 0) {
+                adapt_apply_level(level);
+            }
+        }
+    } else if (good) {
+        adapt.congested = 0;
+        if (++adapt.clear >= UP_EVALUATIONS && adapt.level > 0) {
+            adapt_apply_level(adapt.level - 1);
+        }
+    } else {
+        // In between, hold the current level
+        adapt.congested = 0;
+        adapt.clear = 0;
+    }
+}
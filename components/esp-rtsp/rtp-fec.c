@@ -0,0 +1,111 @@
+//
+// Created on 18/10/2026.
+//
+
+/* Forward error correction with RFC 5109 ULPFEC. The FEC packets go out in
+ * the same RTP stream as the video, with their own payload type and the
+ * next sequence number, the way GStreamer's rtpulpfecenc sends them.
+ * Groups end with the last packet of a frame, so a frame never waits for
+ * packets of the next frame to be recovered.
+ */
+
+#include <string.h>
+
+#include "rtp-fec.h"
+
+void esp_rtp_fec_init(esp_rtp_fec_t *fec, uint8_t group_size) {
+    fec->group_size = group_size <= RTP_FEC_MAX_GROUP_SIZE ? group_size : RTP_FEC_MAX_GROUP_SIZE;
+    esp_rtp_fec_reset(fec);
+}
+
+void esp_rtp_fec_reset(esp_rtp_fec_t *fec) {
+    fec->count = 0;
+    fec->mask = 0;
+    fec->length_xor = 0;
+    memset(fec->header_xor, 0, sizeof(fec->header_xor));
+
+    // Only the part used by the last group has to be cleared
+    memset(fec->payload, 0, fec->protection_length);
+    fec->protection_length = 0;
+}
+
+static void xor_bytes(uint8_t *destination, const uint8_t *source, size_t length) {
+    // Word at a time when both sides are aligned the same way
+    if ((((uintptr_t) destination ^ (uintptr_t) source) & 3) == 0) {
+        while (length && ((uintptr_t) destination & 3)) {
+            *destination++ ^= *source++;
+            length--;
+        }
+
+        uint32_t *destination_word = (uint32_t *) destination;
+        const uint32_t *source_word = (const uint32_t *) source;
+        for (; length >= 4; length -= 4) {
+            *destination_word++ ^= *source_word++;
+        }
+        destination = (uint8_t *) destination_word;
+        source = (const uint8_t *) source_word;
+    }
+
+    while (length--) {
+        *destination++ ^= *source++;
+    }
+}
+
+void esp_rtp_fec_add(esp_rtp_fec_t *fec, const uint8_t *rtp_header, const struct iovec *payload, int iovlen) {
+    if (!fec->group_size) {
+        return;
+    }
+
+    uint16_t sequence_number = rtp_header[2] << 8 | rtp_header[3];
+    if (fec->count == 0) {
+        fec->sn_base = sequence_number;
+    }
+
+    fec->mask |= 0x8000 >> (uint16_t) (sequence_number - fec->sn_base);
+    xor_bytes(fec->header_xor, rtp_header, sizeof(fec->header_xor));
+
+    size_t offset = 0;
+    for (int i = 0; i < iovlen; i++) {
+        size_t length = payload[i].iov_len;
+        if (offset + length > sizeof(fec->payload)) {
+            length = sizeof(fec->payload) - offset;
+        }
+        xor_bytes(fec->payload + offset, payload[i].iov_base, length);
+        offset += length;
+    }
+
+    fec->length_xor ^= offset;
+    if (offset > fec->protection_length) {
+        fec->protection_length = offset;
+    }
+    fec->count++;
+}
+
+int esp_rtp_fec_complete(const esp_rtp_fec_t *fec, int marker) {
+    return fec->group_size && fec->count > 0 && (fec->count >= fec->group_size || marker);
+}
+
+/* The FEC header and the level 0 header, the protected payload follows
+ * in fec->payload with protection_length bytes.
+ */
+size_t esp_rtp_fec_serialize_header(const esp_rtp_fec_t *fec, uint8_t *buffer, size_t length) {
+    if (length < RTP_FEC_HEADER_SIZE + RTP_FEC_LEVEL_HEADER_SIZE) {
+        return 0;
+    }
+
+    // E = 0 and L = 0 (16 bit mask), then the recovery fields for P, X, CC, M and PT
+    buffer[0] = fec->header_xor[0] & 0x3F;
+    buffer[1] = fec->header_xor[1];
+    buffer[2] = fec->sn_base >> 8;
+    buffer[3] = fec->sn_base & 0xFF;
+    memcpy(&buffer[4], &fec->header_xor[4], 4);     // Timestamp recovery
+    buffer[8] = fec->length_xor >> 8;
+    buffer[9] = fec->length_xor & 0xFF;
+
+    buffer[10] = fec->protection_length >> 8;
+    buffer[11] = fec->protection_length & 0xFF;
+    buffer[12] = fec->mask >> 8;
+    buffer[13] = fec->mask & 0xFF;
+
+    return RTP_FEC_HEADER_SIZE + RTP_FEC_LEVEL_HEADER_SIZE;
+}
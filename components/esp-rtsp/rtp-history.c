@@ -0,0 +1,271 @@
+//
+// Created on 18/10/2026.
+//
+
+/* Packet history for retransmissions on a NACK (RFC 4585). The sender adds
+ * every packet after it went out, the RTCP task looks packets up when a
+ * client reports them missing. Packets of one frame are always next to
+ * each other in the ring, so the frame accounting only has to look at the
+ * neighbouring entry.
+ *
+ * The camera frames the histories keep are counted over all sessions, a
+ * session that stops sending must not hold on to buffers the capture
+ * needs. When a newer frame takes the place of the oldest one, every
+ * history lets go of that frame right away.
+ */
+
+#include <string.h>
+
+#include <esp_log.h>
+
+#include "sdkconfig.h"
+#include "rtp-history.h"
+
+#define TAG "rtp-history"
+
+#define RETAINED_FRAMES CONFIG_ESP_RTSP_NACK_HISTORY_FRAMES
+
+// Sequence numbers of the camera frames the histories may keep, oldest first
+static portMUX_TYPE retained_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t retained[RETAINED_FRAMES];
+static size_t retained_count;
+
+// Every history, to release a frame everywhere. Sessions are set up from the server task only.
+static SemaphoreHandle_t histories_lock;
+static esp_rtp_history_t *histories;
+
+static size_t frame_bytes(const esp_rtp_jpeg_frame_t *jpeg_frame) {
+    return jpeg_frame->frame->len;
+}
+
+static int is_retained(uint32_t sequence) {
+    int found = false;
+
+    portENTER_CRITICAL(&retained_lock);
+    for (size_t i = 0; i < retained_count; i++) {
+        if (retained[i] == sequence) {
+            found = true;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&retained_lock);
+
+    return found;
+}
+
+/* Makes room for a frame in the retained set. The oldest frame is released
+ * for a newer one, a frame older than all retained frames is refused, a
+ * session that lags behind can't push out the frames of the others.
+ */
+static int retain_frame(uint32_t sequence, int *released) {
+    int retained_now = true;
+    *released = false;
+
+    portENTER_CRITICAL(&retained_lock);
+    for (size_t i = 0; i < retained_count; i++) {
+        if (retained[i] == sequence) {
+            goto CLEAN_UP;
+        }
+    }
+
+    if (retained_count == RETAINED_FRAMES) {
+        if ((int32_t) (sequence - retained[retained_count - 1]) < 0) {
+            retained_now = false;
+            goto CLEAN_UP;
+        }
+        memmove(retained, retained + 1, (retained_count - 1) * sizeof(retained[0]));
+        retained_count--;
+        *released = true;
+    }
+    retained[retained_count++] = sequence;
+
+    CLEAN_UP:
+    portEXIT_CRITICAL(&retained_lock);
+    return retained_now;
+}
+
+esp_err_t esp_rtp_history_init(esp_rtp_history_t *history, size_t capacity, uint32_t budget_bytes) {
+    memset(history, 0, sizeof(esp_rtp_history_t));
+
+    if (!histories_lock) {
+        histories_lock = xSemaphoreCreateMutex();
+        if (!histories_lock) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    history->entries = calloc(capacity, sizeof(esp_rtp_history_entry_t));
+    if (!history->entries) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    history->lock = xSemaphoreCreateMutex();
+    if (!history->lock) {
+        free(history->entries);
+        history->entries = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+
+    history->capacity = capacity;
+    history->budget_bytes = budget_bytes;
+    history->stats.budget_bytes = budget_bytes;
+
+    xSemaphoreTake(histories_lock, portMAX_DELAY);
+    history->next = histories;
+    histories = history;
+    xSemaphoreGive(histories_lock);
+
+    return ESP_OK;
+}
+
+static void history_evict_oldest(esp_rtp_history_t *history) {
+    esp_rtp_history_entry_t *entry = &history->entries[history->head];
+    esp_rtp_jpeg_frame_t *jpeg_frame = entry->jpeg_frame;
+    entry->jpeg_frame = NULL;
+
+    history->head = (history->head + 1) % history->capacity;
+    history->count--;
+    history->stats.packets--;
+
+    // Last packet of its frame, the frame buffer goes back to the camera
+    if (history->count == 0 || history->entries[history->head].jpeg_frame != jpeg_frame) {
+        history->stats.frames--;
+        history->stats.bytes -= frame_bytes(jpeg_frame);
+    }
+
+    esp_rtp_jpeg_frame_unref(jpeg_frame);
+}
+
+// Called with the history lock held
+static void history_drop_released(esp_rtp_history_t *history) {
+    // Frames are added in capture order, released frames are at the head
+    while (history->count && !is_retained(history->entries[history->head].jpeg_frame->frame->sequence)) {
+        history_evict_oldest(history);
+    }
+}
+
+static void release_frames() {
+    xSemaphoreTake(histories_lock, portMAX_DELAY);
+    for (esp_rtp_history_t *history = histories; history; history = history->next) {
+        xSemaphoreTake(history->lock, portMAX_DELAY);
+        history_drop_released(history);
+        xSemaphoreGive(history->lock);
+    }
+    xSemaphoreGive(histories_lock);
+}
+
+void esp_rtp_history_free(esp_rtp_history_t *history) {
+    if (!history->entries) {
+        return;
+    }
+
+    xSemaphoreTake(histories_lock, portMAX_DELAY);
+    for (esp_rtp_history_t **current = &histories; *current; current = &(*current)->next) {
+        if (*current == history) {
+            *current = history->next;
+            break;
+        }
+    }
+    xSemaphoreGive(histories_lock);
+
+    while (history->count) {
+        history_evict_oldest(history);
+    }
+
+    vSemaphoreDelete(history->lock);
+    free(history->entries);
+    history->entries = NULL;
+}
+
+void esp_rtp_history_add(esp_rtp_history_t *history, uint16_t sequence_number, esp_rtp_jpeg_frame_t *jpeg_frame, size_t index) {
+    if (!history->entries) {
+        return;
+    }
+
+    // Before taking the lock, releasing a frame locks every history
+    int released;
+    int retained_now = retain_frame(jpeg_frame->frame->sequence, &released);
+    if (released) {
+        release_frames();
+    }
+    if (!retained_now) {
+        // Other sessions moved on to newer frames, this one can't be repaired
+        return;
+    }
+
+    xSemaphoreTake(history->lock, portMAX_DELAY);
+
+    const esp_rtp_history_entry_t *newest = history->count ?
+            &history->entries[(history->head + history->count - 1) % history->capacity] : NULL;
+
+    if (!newest || newest->jpeg_frame != jpeg_frame) {
+        size_t bytes = frame_bytes(jpeg_frame);
+
+        // Older frames make way for the new one, they are the least useful to a live viewer
+        while (history->count && history->stats.bytes + bytes > history->budget_bytes) {
+            history_evict_oldest(history);
+        }
+
+        if (bytes > history->budget_bytes) {
+            // Doesn't fit at all, this frame can't be repaired
+            ESP_LOGD(TAG, "Frame of %d bytes exceeds the history budget", bytes);
+            goto CLEAN_UP;
+        }
+
+        history->stats.frames++;
+        history->stats.bytes += bytes;
+        if (history->stats.bytes > history->stats.bytes_peak) {
+            history->stats.bytes_peak = history->stats.bytes;
+        }
+    }
+
+    if (history->count == history->capacity) {
+        history_evict_oldest(history);
+    }
+
+    esp_rtp_history_entry_t *entry = &history->entries[(history->head + history->count) % history->capacity];
+    entry->sequence_number = sequence_number;
+    entry->index = index;
+    entry->jpeg_frame = esp_rtp_jpeg_frame_ref(jpeg_frame);
+    history->count++;
+    history->stats.packets++;
+
+    CLEAN_UP:
+    xSemaphoreGive(history->lock);
+}
+
+esp_rtp_jpeg_frame_t *esp_rtp_history_find(esp_rtp_history_t *history, uint16_t sequence_number, size_t *index) {
+    if (!history->entries) {
+        return NULL;
+    }
+
+    esp_rtp_jpeg_frame_t *jpeg_frame = NULL;
+
+    xSemaphoreTake(history->lock, portMAX_DELAY);
+
+    // Recent packets are asked for most, search from the newest entry
+    for (size_t i = history->count; i > 0; i--) {
+        const esp_rtp_history_entry_t *entry = &history->entries[(history->head + i - 1) % history->capacity];
+        if (entry->sequence_number == sequence_number) {
+            jpeg_frame = esp_rtp_jpeg_frame_ref(entry->jpeg_frame);
+            *index = entry->index;
+            break;
+        }
+    }
+
+    if (jpeg_frame) {
+        history->stats.hits++;
+    } else {
+        history->stats.misses++;
+    }
+
+    xSemaphoreGive(history->lock);
+
+    return jpeg_frame;
+}
+
+void esp_rtp_history_get_stats(esp_rtp_history_t *history, esp_rtp_history_stats_t *stats) {
+    xSemaphoreTake(history->lock, portMAX_DELAY);
+    *stats = history->stats;
+    xSemaphoreGive(history->lock);
+}
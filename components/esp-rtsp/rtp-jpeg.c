@@ -0,0 +1,407 @@
+//
+// Created on 18/10/2026.
+//
+
+/* Splits a JPEG frame into RTP/JPEG (RFC 2435) packets. The packet list is
+ * built once per frame and then sent to every session by rtp-udp.c.
+ */
+
+#include <string.h>
+
+#include <freertos/FreeRTOS.h>
+
+#include <esp_log.h>
+#include <lwip/sockets.h>
+
+#include "sdkconfig.h"
+#include "rtp-jpeg.h"
+
+#define TAG "rtp-jpeg"
+
+#define TYPE_0_SPECIFIC_PROGRESSIVE 0
+
+// Restart marker header, F and L mark packets with the first and last part of a restart interval
+#define RESTART_FIRST 0x8000
+#define RESTART_LAST 0x4000
+#define RESTART_COUNT_MASK 0x3FFF
+
+static portMUX_TYPE refcount_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static int serialize_jpeg_header(esp_rtp_jpeg_header_t header, uint8_t *buffer, size_t length) {
+    assert(buffer != NULL);
+    assert(length >= 8);
+
+    buffer[0] = header.type_specific;
+    buffer[1] = (header.fragment_offset >> 16) & 0xFF;
+    buffer[2] = (header.fragment_offset >> 8) & 0xFF;
+    buffer[3] = header.fragment_offset & 0xFF;
+
+    buffer[4] = header.type;
+    buffer[5] = header.q;
+    buffer[6] = header.width <= RTP_JPEG_MAX_DIMENSION ? header.width / 8 : 0;
+    buffer[7] = header.height <= RTP_JPEG_MAX_DIMENSION ? header.height / 8 : 0;
+
+    return 8;
+}
+
+/* Tables K.1 and K.2 from the JPEG spec in natural order, scaled by
+ * the Q factor as described in RFC 2435 Appendix A.
+ */
+static const uint8_t jpeg_luma_quantizer[64] = {
+        16, 11, 10, 16, 24, 40, 51, 61,
+        12, 12, 14, 19, 26, 58, 60, 55,
+        14, 13, 16, 24, 40, 57, 69, 56,
+        14, 17, 22, 29, 51, 87, 80, 62,
+        18, 22, 37, 56, 68, 109, 103, 77,
+        24, 35, 55, 64, 81, 104, 113, 92,
+        49, 64, 78, 87, 103, 121, 120, 101,
+        72, 92, 95, 98, 112, 100, 103, 99
+};
+
+static const uint8_t jpeg_chroma_quantizer[64] = {
+        17, 18, 24, 47, 99, 99, 99, 99,
+        18, 21, 26, 66, 99, 99, 99, 99,
+        24, 26, 56, 99, 99, 99, 99, 99,
+        47, 66, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99
+};
+
+// DQT tables are stored in zigzag order, this maps them to natural order
+static const uint8_t jpeg_zigzag[64] = {
+        0, 1, 8, 16, 9, 2, 3, 10,
+        17, 24, 32, 25, 18, 11, 4, 5,
+        12, 19, 26, 33, 40, 48, 41, 34,
+        27, 20, 13, 6, 7, 14, 21, 28,
+        35, 42, 49, 56, 57, 50, 43, 36,
+        29, 22, 15, 23, 30, 37, 44, 51,
+        58, 59, 52, 45, 38, 31, 39, 46,
+        53, 60, 61, 54, 47, 55, 62, 63
+};
+
+/* Cache of the tables of the last frame. The camera hardly ever changes its
+ * tables, so most frames only need a memcmp to find their Q value. Only used
+ * from the task that packetizes frames.
+ */
+typedef struct {
+    int valid;
+    uint8_t q;
+    uint32_t generation;        // Counts table changes, a dynamic Q value comes round again after 127 of them
+    uint8_t tables[128];
+} esp_rtp_quant_cache_t;
+
+static esp_rtp_quant_cache_t quant_cache;
+static uint8_t next_dynamic_q = RTP_Q_DYNAMIC_MIN;
+
+static uint8_t scale_quantizer(uint8_t quantizer, int scale) {
+    int value = (quantizer * scale + 50) / 100;
+    if (value < 1) {
+        return 1;
+    }
+    return value > 255 ? 255 : value;
+}
+
+static int match_standard_tables(const uint8_t *luma, const uint8_t *chroma) {
+    for (int q = 1; q <= 99; q++) {
+        int scale = q < 50 ? 5000 / q : 200 - q * 2;
+
+        int i;
+        for (i = 0; i < 64; i++) {
+            uint8_t natural = jpeg_zigzag[i];
+            if (luma[i] != scale_quantizer(jpeg_luma_quantizer[natural], scale) ||
+                chroma[i] != scale_quantizer(jpeg_chroma_quantizer[natural], scale)) {
+                break;
+            }
+        }
+
+        if (i == 64) {
+            return q;
+        }
+    }
+
+    return -1;
+}
+
+/* Find the Q value for the tables of this frame. Tables matching the RFC 2435
+ * tables get their Q value and are not sent at all. Other tables get a Q value
+ * in the 128-254 range that stays the same as long as the tables don't change,
+ * so a session only needs to receive them once. The Q values are recycled,
+ * sessions compare the generation to know whether they have the tables.
+ */
+static uint8_t quant_tables_q(const uint8_t *luma, const uint8_t *chroma, uint32_t *generation) {
+    if (quant_cache.valid && memcmp(quant_cache.tables, luma, 64) == 0 && memcmp(quant_cache.tables + 64, chroma, 64) == 0) {
+        *generation = quant_cache.generation;
+        return quant_cache.q;
+    }
+
+    memcpy(quant_cache.tables, luma, 64);
+    memcpy(quant_cache.tables + 64, chroma, 64);
+    quant_cache.valid = true;
+    quant_cache.generation++;
+    *generation = quant_cache.generation;
+
+    int q = match_standard_tables(luma, chroma);
+    if (q > 0) {
+        quant_cache.q = q;
+    } else {
+        quant_cache.q = next_dynamic_q;
+        next_dynamic_q = next_dynamic_q < RTP_Q_DYNAMIC_MAX ? next_dynamic_q + 1 : RTP_Q_DYNAMIC_MIN;
+    }
+
+    ESP_LOGI(TAG, "Quantization tables changed, using Q %d", quant_cache.q);
+    return quant_cache.q;
+}
+
+int esp_rtp_jpeg_serialize_quant_header(int include_tables, uint8_t *buffer, size_t length) {
+    assert(buffer != NULL);
+
+    if (length < 4) {
+        ESP_LOGE(TAG, "No enough space in buffer for quant header");
+        return -1;
+    }
+
+    esp_rtp_quant_t quant = RTP_QUANT_DEFAULT();
+    if (!include_tables) {
+        // The session already has the tables for this Q value
+        quant.length = 0;
+    }
+
+    buffer[0] = quant.mbz;
+    buffer[1] = quant.precision;
+
+    uint16_t *size = (uint16_t *) &buffer[2];
+    *size = PP_HTONS(quant.length);
+
+    return 4;
+}
+
+static int add_restart_packet(esp_rtp_jpeg_frame_t *packetized, size_t *capacity, size_t offset, size_t length, uint16_t restart_count) {
+    if (packetized->packet_count == *capacity) {
+        size_t new_capacity = *capacity * 2;
+        esp_rtp_jpeg_restart_packet_t *packets = realloc(packetized->restart_packets, new_capacity * sizeof(esp_rtp_jpeg_restart_packet_t));
+        if (!packets) {
+            return false;
+        }
+        packetized->restart_packets = packets;
+        *capacity = new_capacity;
+    }
+
+    esp_rtp_jpeg_restart_packet_t *packet = &packetized->restart_packets[packetized->packet_count++];
+    packet->fragment_offset = offset;
+    packet->length = length;
+    packet->restart_count = restart_count;
+    return true;
+}
+
+/* Walks the restart markers once and packs as many whole restart intervals
+ * into each packet as fit. A lost packet then only costs the intervals in
+ * it, the receiver resynchronizes at the next packet.
+ */
+static esp_err_t packetize_restart(esp_rtp_jpeg_frame_t *packetized) {
+    const char *start = packetized->jpeg_data.jpeg_data_start;
+    const char *end = start + packetized->jpeg_data.jpeg_data_length;
+    size_t length = packetized->jpeg_data.jpeg_data_length;
+
+    size_t capacity = length / packetized->payload_size + 4;
+    packetized->restart_packets = malloc(capacity * sizeof(esp_rtp_jpeg_restart_packet_t));
+    if (!packetized->restart_packets) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    size_t offset = 0;
+    size_t interval_start = 0;
+    uint32_t interval = 0;
+    const char *boundary = esp_rtsp_jpeg_next_restart(start, end);
+    size_t interval_end = boundary ? boundary - start : length;
+
+    while (offset < length) {
+        size_t room = packetized->packet_count == 0 ? packetized->first_payload_size : packetized->payload_size;
+        uint16_t first = offset == interval_start ? RESTART_FIRST : 0;
+
+        if (interval_end - offset > room) {
+            // The rest of this interval doesn't fit, split it
+            if (!add_restart_packet(packetized, &capacity, offset, room, first | (interval & RESTART_COUNT_MASK))) {
+                return ESP_ERR_NO_MEM;
+            }
+            offset += room;
+            continue;
+        }
+
+        // The last fragment of a split interval goes alone, other packets get whole intervals
+        size_t packet_start = offset;
+        uint32_t packet_interval = interval;
+        while (offset < length && interval_end - packet_start <= room && (first || offset == packet_start)) {
+            offset = interval_end;
+            interval_start = interval_end;
+            interval++;
+
+            boundary = boundary ? esp_rtsp_jpeg_next_restart(boundary, end) : NULL;
+            interval_end = boundary ? boundary - start : length;
+        }
+
+        if (!add_restart_packet(packetized, &capacity, packet_start, offset - packet_start,
+                                first | RESTART_LAST | (packet_interval & RESTART_COUNT_MASK))) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t esp_rtp_jpeg_packetize(esp_frame_t *frame, size_t max_payload_size, esp_rtp_jpeg_frame_t **jpeg_frame) {
+    if (!frame || !jpeg_frame || max_payload_size < RTP_JPEG_MIN_PACKET_SIZE || max_payload_size > MAX_PAYLOAD_SIZE) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    esp_rtsp_jpeg_data_t jpeg_data;
+
+    if (esp_rtsp_jpeg_decode((char *)frame->buf, frame->len, &jpeg_data) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to parse jpeg data");
+        return ESP_FAIL;
+    }
+
+    if (!jpeg_data.quant_table_0 || !jpeg_data.quant_table_1 ||
+        (jpeg_data.quant_table_0[0] & 0xF0) != 0 || (jpeg_data.quant_table_1[0] & 0xF0) != 0) {
+        ESP_LOGE(TAG, "Only 8-bit quantization tables are supported");
+        return ESP_FAIL;
+    }
+
+    // The tables are sent straight from the frame buffer, after the DQT marker, length and table id
+    const uint8_t *luma = (const uint8_t *) jpeg_data.quant_table_0 + 1;
+    const uint8_t *chroma = (const uint8_t *) jpeg_data.quant_table_1 + 1;
+    uint32_t quant_generation;
+    uint8_t q = quant_tables_q(luma, chroma, &quant_generation);
+    int include_quant = q >= RTP_Q_DYNAMIC_MIN;
+
+    if (jpeg_data.jpeg_data_length > RTP_JPEG_MAX_FRAME_SIZE) {
+        ESP_LOGE(TAG, "Frame too large for a 24 bit fragment offset: %d", jpeg_data.jpeg_data_length);
+        return ESP_FAIL;
+    }
+
+    esp_rtp_jpeg_frame_t *packetized = calloc(1, sizeof(esp_rtp_jpeg_frame_t));
+    if (!packetized) {
+        return ESP_ERR_NO_MEM;
+    }
+
+#ifdef CONFIG_ESP_RTSP_JPEG_RESTART
+    int restart = jpeg_data.restart_interval != 0;
+#else
+    int restart = false;
+#endif
+
+    packetized->refcount = 1;
+    packetized->frame = esp_frame_ref(frame);
+    packetized->jpeg_data = jpeg_data;
+    packetized->timestamp = (uint32_t) (frame->timestamp * 9 / 100); // 90kHz clock
+
+    packetized->q = q;
+    packetized->quant_generation = quant_generation;
+    packetized->quant_table_0 = luma;
+    packetized->quant_table_1 = chroma;
+
+    packetized->header = (esp_rtp_jpeg_header_t) {
+            .height = jpeg_data.height,
+            .width = jpeg_data.width,
+            .q = q,
+            .type = jpeg_data.subsampling + (restart ? RTP_JPEG_TYPE_RESTART : 0),
+            .type_specific = TYPE_0_SPECIFIC_PROGRESSIVE,
+            .fragment_offset = 0,
+    };
+
+    size_t header_size = RTP_HEADER_SIZE + RTP_JPEG_HEADER_SIZE + (restart ? RTP_RESTART_HEADER_SIZE : 0);
+    packetized->include_quant = include_quant;
+    packetized->max_payload_size = max_payload_size;
+    packetized->payload_size = max_payload_size - header_size;
+    packetized->first_payload_size = packetized->payload_size - (include_quant ? RTP_QUANT_HEADER_SIZE : 0);
+
+    size_t length = jpeg_data.jpeg_data_length;
+    if (restart) {
+        esp_err_t err = packetize_restart(packetized);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to split frame at the restart markers");
+            esp_rtp_jpeg_frame_unref(packetized);
+            return err;
+        }
+    } else if (length <= packetized->first_payload_size) {
+        packetized->packet_count = 1;
+    } else {
+        size_t rest = length - packetized->first_payload_size;
+        packetized->packet_count = 1 + (rest + packetized->payload_size - 1) / packetized->payload_size;
+    }
+
+    packetized->wire_size = packetized->packet_count * header_size + length +
+                            (include_quant ? RTP_QUANT_HEADER_SIZE : 0);
+
+    *jpeg_frame = packetized;
+    return ESP_OK;
+}
+
+esp_err_t esp_rtp_jpeg_get_packet(const esp_rtp_jpeg_frame_t *jpeg_frame, size_t index, esp_rtp_jpeg_packet_t *packet) {
+    if (!jpeg_frame || !packet || index >= jpeg_frame->packet_count) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    size_t length = jpeg_frame->jpeg_data.jpeg_data_length;
+
+    if (jpeg_frame->restart_packets) {
+        const esp_rtp_jpeg_restart_packet_t *restart_packet = &jpeg_frame->restart_packets[index];
+        packet->fragment_offset = restart_packet->fragment_offset;
+        packet->length = restart_packet->length;
+        packet->include_quant = index == 0 && jpeg_frame->include_quant;
+    } else if (index == 0) {
+        packet->fragment_offset = 0;
+        packet->include_quant = jpeg_frame->include_quant;
+        packet->length = length < jpeg_frame->first_payload_size ? length : jpeg_frame->first_payload_size;
+    } else {
+        packet->fragment_offset = jpeg_frame->first_payload_size + (index - 1) * jpeg_frame->payload_size;
+        packet->include_quant = false;
+        size_t remaining_bytes = length - packet->fragment_offset;
+        packet->length = remaining_bytes < jpeg_frame->payload_size ? remaining_bytes : jpeg_frame->payload_size;
+    }
+    packet->marker = index == jpeg_frame->packet_count - 1;
+
+    esp_rtp_jpeg_header_t header = jpeg_frame->header;
+    header.fragment_offset = packet->fragment_offset;
+    packet->jpeg_header_length = serialize_jpeg_header(header, packet->jpeg_header, sizeof(packet->jpeg_header));
+
+    if (jpeg_frame->restart_packets) {
+        uint8_t *restart_header = &packet->jpeg_header[packet->jpeg_header_length];
+        uint16_t restart_count = jpeg_frame->restart_packets[index].restart_count;
+        restart_header[0] = jpeg_frame->jpeg_data.restart_interval >> 8;
+        restart_header[1] = jpeg_frame->jpeg_data.restart_interval & 0xFF;
+        restart_header[2] = restart_count >> 8;
+        restart_header[3] = restart_count & 0xFF;
+        packet->jpeg_header_length += RTP_RESTART_HEADER_SIZE;
+    }
+
+    return ESP_OK;
+}
+
+esp_rtp_jpeg_frame_t *esp_rtp_jpeg_frame_ref(esp_rtp_jpeg_frame_t *jpeg_frame) {
+    assert(jpeg_frame != NULL);
+
+    portENTER_CRITICAL(&refcount_lock);
+    jpeg_frame->refcount++;
+    portEXIT_CRITICAL(&refcount_lock);
+
+    return jpeg_frame;
+}
+
+void esp_rtp_jpeg_frame_unref(esp_rtp_jpeg_frame_t *jpeg_frame) {
+    if (!jpeg_frame) {
+        return;
+    }
+
+    portENTER_CRITICAL(&refcount_lock);
+    assert(jpeg_frame->refcount > 0);
+    uint32_t refcount = --jpeg_frame->refcount;
+    portEXIT_CRITICAL(&refcount_lock);
+
+    if (refcount == 0) {
+        esp_frame_unref(jpeg_frame->frame);
+        free(jpeg_frame->restart_packets);
+        free(jpeg_frame);
+    }
+}
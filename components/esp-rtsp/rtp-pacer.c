@@ -0,0 +1,543 @@
+//
+// Created on 18/10/2026.
+//
+
+/* Spreads the packets of a frame over the frame interval with a token
+ * bucket and hands them to a dedicated sender task through a bounded
+ * queue. When lwIP runs out of buffers the sender yields for a tick
+ * instead of spinning.
+ *
+ * Every session has a single slot for the latest frame. The pacer only
+ * takes a new frame for a session once the previous one is fully queued,
+ * so a frame either goes out completely or is replaced before its first
+ * packet.
+ */
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include "sdkconfig.h"
+#include "rtp-pacer.h"
+
+#define TAG "rtp-pacer"
+
+#define SENDER_STACKSIZE 4096
+#define SENDER_PRIORITY 6
+
+#define PACER_STACKSIZE 4096
+#define PACER_PRIORITY 6
+
+#define MAX_SESSIONS 8
+
+#define SEND_RETRIES 5
+#define QUEUE_TIMEOUT_MS 100
+
+#define STATS_INTERVAL_FRAMES 100
+
+// Part of the frame interval used to send a frame, leaving headroom for the next one
+#define PACER_SPREAD_PERCENT 80
+
+typedef struct {
+    esp_rtp_session_handle_t session;
+    esp_rtp_jpeg_frame_t *jpeg_frame;
+    size_t index;
+    int resend;                 // Retransmission of an earlier packet with its own sequence number
+    uint16_t sequence_number;
+} esp_rtp_send_job_t;
+
+typedef struct {
+    uint32_t rate;      // bytes per second
+    uint32_t depth;     // bytes
+    int64_t tokens;
+    int64_t last_refill;
+} esp_rtp_token_bucket_t;
+
+typedef struct {
+    esp_rtp_session_handle_t session;
+    esp_rtp_jpeg_frame_t *current;
+    size_t index;
+} esp_rtp_pacer_session_t;
+
+// Frames sent by a session when its stats were logged, owned by the pacer task
+typedef struct {
+    esp_rtp_session_handle_t session;
+    uint32_t frames;
+} esp_rtp_pacer_logged_t;
+
+static esp_rtp_pacer_session_t pacer_sessions[MAX_SESSIONS];
+static SemaphoreHandle_t pacer_lock;
+static uint32_t frame_interval_ms;
+
+static QueueHandle_t send_queue;
+static TaskHandle_t sender_task;
+static TaskHandle_t pacer_task;
+static esp_rtp_token_bucket_t bucket;
+static esp_rtp_pacer_stats_t pacer_stats;
+
+static void token_bucket_refill(esp_rtp_token_bucket_t *token_bucket) {
+    int64_t now = esp_timer_get_time();
+    token_bucket->tokens += (now - token_bucket->last_refill) * token_bucket->rate / 1000000;
+    if (token_bucket->tokens > token_bucket->depth) {
+        token_bucket->tokens = token_bucket->depth;
+    }
+    token_bucket->last_refill = now;
+}
+
+static void token_bucket_set_rate(esp_rtp_token_bucket_t *token_bucket, uint32_t rate) {
+    token_bucket_refill(token_bucket);
+    token_bucket->rate = rate;
+
+    // We can only wake up once per tick, the bucket has to hold at least a tick worth of tokens
+    uint32_t tick_bytes = rate / 1000 * portTICK_PERIOD_MS;
+    token_bucket->depth = tick_bytes > CONFIG_ESP_RTSP_PACER_BURST_BYTES ? tick_bytes : CONFIG_ESP_RTSP_PACER_BURST_BYTES;
+}
+
+static void token_bucket_consume(esp_rtp_token_bucket_t *token_bucket, size_t size) {
+    token_bucket_refill(token_bucket);
+
+    while (token_bucket->tokens < (int64_t) size) {
+        int64_t wait_us = (size - token_bucket->tokens) * 1000000 / token_bucket->rate;
+        TickType_t ticks = pdMS_TO_TICKS(wait_us / 1000);
+        vTaskDelay(ticks > 0 ? ticks : 1);
+        token_bucket_refill(token_bucket);
+    }
+
+    token_bucket->tokens -= size;
+}
+
+// What the packet takes on the wire for the session, the quant header only carries the tables when the session needs them
+static size_t packet_size(esp_rtp_session_handle_t session, const esp_rtp_jpeg_frame_t *jpeg_frame, size_t index) {
+    esp_rtp_jpeg_packet_t packet;
+    esp_rtp_jpeg_get_packet(jpeg_frame, index, &packet);
+
+    size_t quant_size = 0;
+    if (packet.include_quant) {
+        quant_size = esp_rtp_session_sends_tables(session, jpeg_frame) ? RTP_QUANT_HEADER_SIZE : RTP_QUANT_HEADER_SIZE - RTP_QUANT_TABLES_SIZE;
+    }
+    return RTP_HEADER_SIZE + packet.jpeg_header_length + quant_size + packet.length;
+}
+
+static size_t frame_size(esp_rtp_session_handle_t session, const esp_rtp_jpeg_frame_t *jpeg_frame) {
+    int without_tables = jpeg_frame->include_quant && !esp_rtp_session_sends_tables(session, jpeg_frame);
+    return jpeg_frame->wire_size - (without_tables ? RTP_QUANT_TABLES_SIZE : 0);
+}
+
+static void rtp_sender_task(void *pvParameters) {
+    for (;;) {
+        esp_rtp_send_job_t job;
+        if (xQueueReceive(send_queue, &job, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+
+        if (job.resend) {
+            // A lost retransmission gets asked for again, it never aborts the frame
+            if (esp_rtp_resend_jpeg_packet(job.session, job.jpeg_frame, job.index, job.sequence_number) != ESP_OK) {
+                pacer_stats.resends_dropped++;
+            }
+            esp_rtp_jpeg_frame_unref(job.jpeg_frame);
+            esp_rtp_session_unref(job.session);
+            continue;
+        }
+
+        esp_err_t err;
+        int retries = 0;
+        do {
+            err = esp_rtp_send_jpeg_packet(job.session, job.jpeg_frame, job.index);
+            if (err != ESP_ERR_NO_MEM || retries++ >= SEND_RETRIES) {
+                break;
+            }
+
+            // Give lwIP a tick to clear the transmit buffers
+            pacer_stats.send_retries++;
+            vTaskDelay(1);
+        } while (true);
+
+        if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+            pacer_stats.packets_dropped++;
+            esp_rtp_session_abort_frame(job.session, job.jpeg_frame);
+        }
+
+        esp_rtp_jpeg_frame_unref(job.jpeg_frame);
+        esp_rtp_session_unref(job.session);
+    }
+}
+
+// Called without pacer_lock, logging to the UART is slow
+static void pacer_log_stats(esp_rtp_session_handle_t session, esp_rtp_pacer_logged_t *logged) {
+    esp_rtp_session_stats_t stats;
+    if (esp_rtp_get_stats(session, &stats) != ESP_OK || stats.frames_sent == 0 ||
+        stats.frames_sent % STATS_INTERVAL_FRAMES != 0 || (logged->session == session && stats.frames_sent == logged->frames)) {
+        return;
+    }
+    logged->session = session;
+    logged->frames = stats.frames_sent;
+
+    // Before zero-copy every header and jpeg byte was copied into the packet buffer
+    ESP_LOGI(TAG, "RTP: %u frames sent, %u dropped, %u aborted, %u skipped, %u packets, %llu bytes copied/frame (was %llu), %llu bytes referenced/frame",
+             stats.frames_sent, stats.frames_dropped, stats.frames_aborted, stats.frames_skipped, stats.packets_sent,
+             stats.bytes_copied / stats.frames_sent,
+             (stats.bytes_copied + stats.bytes_referenced) / stats.frames_sent,
+             stats.bytes_referenced / stats.frames_sent);
+
+    ESP_LOGI(TAG, "Packets: %u bytes max, last frame %u packets, %u bytes on the wire",
+             esp_rtp_get_max_payload_size(session), stats.frame_packets, stats.frame_bytes);
+
+    ESP_LOGI(TAG, "Pacer: %u packets queued, queue full %u times (high watermark %u), %u dropped, %u retries",
+             pacer_stats.packets_queued, pacer_stats.queue_full, pacer_stats.queue_high_watermark,
+             pacer_stats.packets_dropped, pacer_stats.send_retries);
+
+    esp_rtp_session_feedback_t feedback;
+    if (esp_rtp_get_feedback(session, &feedback) == ESP_OK && feedback.reports > 0) {
+        ESP_LOGI(TAG, "RTCP: lost %u/256 (%d total), jitter %u, rtt %u ms",
+                 feedback.fraction_lost, feedback.cumulative_lost, feedback.jitter, feedback.rtt_ms);
+    }
+
+    esp_rtp_history_stats_t history;
+    if (esp_rtp_get_history_stats(session, &history) == ESP_OK) {
+        ESP_LOGI(TAG, "NACK: %u packets asked for, %u resent, %u not in history, %u dropped; history %u packets, %u frames, %u/%u bytes (peak %u)",
+                 stats.nacks_received, stats.packets_resent, history.misses, pacer_stats.resends_dropped,
+                 history.packets, history.frames, history.bytes, history.budget_bytes, history.bytes_peak);
+    }
+
+#ifdef CONFIG_ESP_RTSP_FEC
+    ESP_LOGI(TAG, "FEC: %u packets", stats.fec_packets_sent);
+#endif
+}
+
+static void pacer_update_rate(size_t frame_bytes) {
+    // Never pace slower than needed to get the frame out to every session within the interval
+    uint32_t rate = CONFIG_ESP_RTSP_PACER_RATE_KBPS * 1000 / 8;
+    uint64_t spread_us = frame_interval_ms * 10ULL * PACER_SPREAD_PERCENT;
+    if (spread_us > 0 && frame_bytes * 1000000ULL / spread_us > rate) {
+        rate = frame_bytes * 1000000ULL / spread_us;
+    }
+    token_bucket_set_rate(&bucket, rate);
+}
+
+/* Called with pacer_lock held. Hands out the next packet of the session's
+ * frame with references of its own and moves on, so the packet can be
+ * paced and queued after the lock is released.
+ */
+static size_t pacer_take_packet(esp_rtp_pacer_session_t *pacer_session, esp_rtp_send_job_t *job) {
+    size_t size = packet_size(pacer_session->session, pacer_session->current, pacer_session->index);
+
+    job->session = esp_rtp_session_ref(pacer_session->session);
+    job->jpeg_frame = esp_rtp_jpeg_frame_ref(pacer_session->current);
+    job->index = pacer_session->index;
+    job->resend = false;
+
+    if (++pacer_session->index >= pacer_session->current->packet_count) {
+        esp_rtp_jpeg_frame_unref(pacer_session->current);
+        pacer_session->current = NULL;
+    }
+
+    return size;
+}
+
+static void pacer_queue_packet(esp_rtp_send_job_t *job, size_t size) {
+    token_bucket_consume(&bucket, size);
+
+    if (uxQueueSpacesAvailable(send_queue) == 0) {
+        pacer_stats.queue_full++;
+    }
+
+    // Once the first packet is queued the rest of the frame follows, wait for the sender
+    while (xQueueSend(send_queue, job, pdMS_TO_TICKS(QUEUE_TIMEOUT_MS)) != pdTRUE) {
+        pacer_stats.queue_full++;
+    }
+
+    pacer_stats.packets_queued++;
+    UBaseType_t waiting = uxQueueMessagesWaiting(send_queue);
+    if (waiting > pacer_stats.queue_high_watermark) {
+        pacer_stats.queue_high_watermark = waiting;
+    }
+}
+
+/* Takes the next frame for every idle session and queues one packet per
+ * session per round, so all sessions progress evenly. The lock is only held
+ * to pick a packet, waiting for tokens or room in the send queue happens
+ * without it so the server task can add and remove sessions meanwhile.
+ */
+static void rtp_pacer_task(void *pvParameters) {
+    esp_rtp_pacer_logged_t logged[MAX_SESSIONS] = { 0 };
+
+    for (;;) {
+        size_t round_bytes = 0;
+        int active = false;
+        esp_rtp_session_handle_t idle[MAX_SESSIONS] = { 0 };
+
+        xSemaphoreTake(pacer_lock, portMAX_DELAY);
+        for (int i = 0; i < MAX_SESSIONS; i++) {
+            esp_rtp_pacer_session_t *pacer_session = &pacer_sessions[i];
+            if (!pacer_session->session) {
+                continue;
+            }
+
+            if (!pacer_session->current) {
+                idle[i] = esp_rtp_session_ref(pacer_session->session);
+                pacer_session->current = esp_rtp_session_take_frame(pacer_session->session);
+                pacer_session->index = 0;
+                if (pacer_session->current) {
+                    pacer_stats.frames_paced++;
+                    round_bytes += frame_size(pacer_session->session, pacer_session->current);
+                }
+            }
+
+            if (pacer_session->current) {
+                active = true;
+            }
+        }
+
+        if (round_bytes > 0) {
+            pacer_update_rate(round_bytes);
+        }
+        xSemaphoreGive(pacer_lock);
+
+        // Between frames, the sessions hold a reference of their own in case they are removed meanwhile
+        for (int i = 0; i < MAX_SESSIONS; i++) {
+            if (idle[i]) {
+                pacer_log_stats(idle[i], &logged[i]);
+                esp_rtp_session_unref(idle[i]);
+            }
+        }
+
+        for (int i = 0; i < MAX_SESSIONS && active; i++) {
+            esp_rtp_send_job_t job;
+            size_t size = 0;
+
+            // The session may have been removed since the last round
+            xSemaphoreTake(pacer_lock, portMAX_DELAY);
+            if (pacer_sessions[i].current) {
+                size = pacer_take_packet(&pacer_sessions[i], &job);
+            }
+            xSemaphoreGive(pacer_lock);
+
+            if (size > 0) {
+                pacer_queue_packet(&job, size);
+            }
+        }
+
+        if (!active) {
+            // Wait for the next frame
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        }
+    }
+}
+
+esp_err_t esp_rtp_pacer_start() {
+    if (sender_task) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    pacer_lock = xSemaphoreCreateMutex();
+    if (!pacer_lock) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    send_queue = xQueueCreate(CONFIG_ESP_RTSP_SEND_QUEUE_LENGTH, sizeof(esp_rtp_send_job_t));
+    if (!send_queue) {
+        vSemaphoreDelete(pacer_lock);
+        return ESP_ERR_NO_MEM;
+    }
+
+    bucket.last_refill = esp_timer_get_time();
+    token_bucket_set_rate(&bucket, CONFIG_ESP_RTSP_PACER_RATE_KBPS * 1000 / 8);
+    bucket.tokens = bucket.depth;
+
+    BaseType_t result = xTaskCreate(rtp_sender_task, "rtp_sender", SENDER_STACKSIZE, NULL, SENDER_PRIORITY, &sender_task);
+    if (result != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create rtp sender task: %d", result);
+        goto CLEAN_UP;
+    }
+
+    result = xTaskCreate(rtp_pacer_task, "rtp_pacer", PACER_STACKSIZE, NULL, PACER_PRIORITY, &pacer_task);
+    if (result != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create rtp pacer task: %d", result);
+        vTaskDelete(sender_task);
+        sender_task = NULL;
+        goto CLEAN_UP;
+    }
+
+    return ESP_OK;
+
+    CLEAN_UP:
+    vQueueDelete(send_queue);
+    send_queue = NULL;
+    vSemaphoreDelete(pacer_lock);
+    pacer_lock = NULL;
+    return ESP_FAIL;
+}
+
+esp_err_t esp_rtp_pacer_add_session(esp_rtp_session_handle_t session) {
+    if (!session) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (!pacer_task) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    esp_err_t err = ESP_ERR_NO_MEM;
+    xSemaphoreTake(pacer_lock, portMAX_DELAY);
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+        if (!pacer_sessions[i].session) {
+            pacer_sessions[i].session = esp_rtp_session_ref(session);
+            err = ESP_OK;
+            break;
+        }
+    }
+    xSemaphoreGive(pacer_lock);
+
+    return err;
+}
+
+esp_err_t esp_rtp_pacer_remove_session(esp_rtp_session_handle_t session) {
+    if (!session) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (!pacer_task) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+    xSemaphoreTake(pacer_lock, portMAX_DELAY);
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+        esp_rtp_pacer_session_t *pacer_session = &pacer_sessions[i];
+        if (pacer_session->session == session) {
+            esp_rtp_jpeg_frame_unref(pacer_session->current);
+            esp_rtp_session_unref(pacer_session->session);
+            memset(pacer_session, 0, sizeof(esp_rtp_pacer_session_t));
+            err = ESP_OK;
+            break;
+        }
+    }
+    xSemaphoreGive(pacer_lock);
+
+    return err;
+}
+
+int esp_rtp_pacer_session_count() {
+    int count = 0;
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+        if (pacer_sessions[i].session) {
+            count++;
+        }
+    }
+    return count;
+}
+
+/* Packetizes the frame once for every payload size in use and offers each
+ * session the layout sized for it. Sets overrun when a session was still
+ * waiting to start the previous frame, sending takes longer than the interval.
+ */
+esp_err_t esp_rtp_pacer_offer_frame(esp_frame_t *frame, uint32_t interval_ms, int *overrun) {
+    if (!frame) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (!pacer_task) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    size_t sizes[MAX_SESSIONS];
+    size_t size_count = 0;
+
+    xSemaphoreTake(pacer_lock, portMAX_DELAY);
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+        if (!pacer_sessions[i].session) {
+            continue;
+        }
+        size_t size = esp_rtp_get_max_payload_size(pacer_sessions[i].session);
+        int known = false;
+        for (int k = 0; k < size_count && !known; k++) {
+            known = sizes[k] == size;
+        }
+        if (!known) {
+            sizes[size_count++] = size;
+        }
+    }
+    xSemaphoreGive(pacer_lock);
+
+    // Outside the lock, walking the restart markers of a large frame takes a while
+    esp_rtp_jpeg_frame_t *jpeg_frames[MAX_SESSIONS] = { 0 };
+    for (int k = 0; k < size_count; k++) {
+        if (esp_rtp_jpeg_packetize(frame, sizes[k], &jpeg_frames[k]) != ESP_OK) {
+            ESP_LOGW(TAG, "Failed to packetize frame for %d byte packets", sizes[k]);
+        }
+    }
+
+    int replaced = false;
+    xSemaphoreTake(pacer_lock, portMAX_DELAY);
+    frame_interval_ms = interval_ms;
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+        if (!pacer_sessions[i].session) {
+            continue;
+        }
+        // A session added or resized in the meantime gets the next frame
+        size_t size = esp_rtp_get_max_payload_size(pacer_sessions[i].session);
+        for (int k = 0; k < size_count; k++) {
+            if (jpeg_frames[k] && sizes[k] == size && esp_rtp_session_offer_frame(pacer_sessions[i].session, jpeg_frames[k])) {
+                replaced = true;
+            }
+        }
+    }
+    xSemaphoreGive(pacer_lock);
+
+    for (int k = 0; k < size_count; k++) {
+        esp_rtp_jpeg_frame_unref(jpeg_frames[k]);
+    }
+
+    if (overrun) {
+        *overrun = replaced;
+    }
+
+    xTaskNotifyGive(pacer_task);
+    return ESP_OK;
+}
+
+/* Queues a retransmission ahead of the paced packets, the client is
+ * waiting for it to complete a frame. Resends are rare and skip the token
+ * bucket, which belongs to the pacer task.
+ */
+esp_err_t esp_rtp_pacer_resend(esp_rtp_session_handle_t session, esp_rtp_jpeg_frame_t *jpeg_frame, size_t index, uint16_t sequence_number) {
+    if (!session || !jpeg_frame) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (!sender_task) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    esp_rtp_send_job_t job = {
+            .session = esp_rtp_session_ref(session),
+            .jpeg_frame = esp_rtp_jpeg_frame_ref(jpeg_frame),
+            .index = index,
+            .resend = true,
+            .sequence_number = sequence_number
+    };
+
+    if (xQueueSendToFront(send_queue, &job, 0) != pdTRUE) {
+        pacer_stats.resends_dropped++;
+        esp_rtp_jpeg_frame_unref(job.jpeg_frame);
+        esp_rtp_session_unref(job.session);
+        return ESP_ERR_NO_MEM;
+    }
+
+    pacer_stats.resends_queued++;
+    return ESP_OK;
+}
+
+esp_err_t esp_rtp_pacer_get_stats(esp_rtp_pacer_stats_t *stats) {
+    if (!stats) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    *stats = pacer_stats;
+    return ESP_OK;
+}
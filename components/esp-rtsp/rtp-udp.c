@@ -2,6 +2,8 @@
 // Created by Hugo Trippaers on 19/05/2021.
 //
 
+#include <freertos/FreeRTOS.h>
+
 #include <esp_log.h>
 #include <lwip/sockets.h>
 
@@ -9,14 +11,32 @@
 
 #define TAG "rtp-udp"
 
-#define MAX_PAYLOAD_SIZE 1472 // This is based on MTU 1500 minus udp headers
-
 #define RTP_PAYLOAD_JPEG 26
 
-#define TYPE_BASELINE_DCT_SEQUENTIAL 0
-#define TYPE_0_SPECIFIC_PROGRESSIVE 0
+#define QUANT_REFRESH_FRAMES 50
+
+#define INTERLEAVED_HEADER_SIZE 4   // '$', channel and a 16 bit length
+
+static portMUX_TYPE refcount_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static int shared_rtp_socket = -1;
+static int shared_rtcp_socket = -1;
+
+/* Marks everything sent on the socket with a DSCP code point. The Wi-Fi
+ * driver picks the WMM access category from the precedence bits, AF41 and
+ * CS4 both end up in the video queue.
+ */
+esp_err_t esp_rtp_socket_set_dscp(int sockfd, int dscp) {
+    int tos = dscp << 2;    // DSCP is the upper six bits of the old TOS byte
+    if (setsockopt(sockfd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos)) < 0) {
+        ESP_LOGW(TAG, "Unable to set socket IP_TOS: errno %d", errno);
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
 
-static int socket_bind_udp(int port) {
+static int socket_bind_udp(int port, int dscp) {
     int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
 
     if (sockfd < 0) {
@@ -35,7 +55,7 @@ static int socket_bind_udp(int port) {
     int opt = 1;
     if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
         ESP_LOGE(TAG, "Unable to set socket SO_REUSEADDR: errno %d", errno);
-        return -1;
+        goto CLEAN_UP;
     }
 
     int err = bind(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr));
@@ -44,6 +64,9 @@ static int socket_bind_udp(int port) {
         goto CLEAN_UP;
     }
 
+    // Unmarked packets still arrive, just without the priority
+    esp_rtp_socket_set_dscp(sockfd, dscp);
+
     ESP_LOGI(TAG, "Socket bound, port %d", port);
     return sockfd;
 
@@ -74,97 +97,301 @@ static int serialize_header(esp_rtp_header_t header, uint8_t *buffer, size_t len
     return 12;
 }
 
-static int serialize_jpeg_header(esp_rtp_jpeg_header_t header, uint8_t *buffer, size_t length) {
-    assert(buffer != NULL);
-    assert(length >= 8);
+static void session_start(esp_rtp_session_t *session) {
+    session->timestamp = esp_random();
+    session->sequence_number = esp_random() & 0xFFFF;
+    session->ssrc = esp_random();
+    session->refcount = 1;
+    session->max_payload_size = CONFIG_ESP_RTSP_MAX_PAYLOAD_SIZE;
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+    session->lock = lock;
+
+    // TCP doesn't lose packets, the repair mechanisms are only for UDP
+    if (!session->interleaved) {
+#ifdef CONFIG_ESP_RTSP_NACK
+        if (esp_rtp_history_init(&session->history, CONFIG_ESP_RTSP_NACK_HISTORY_PACKETS,
+                                 CONFIG_ESP_RTSP_NACK_HISTORY_KB * 1024) != ESP_OK) {
+            ESP_LOGW(TAG, "No memory for the packet history, lost packets can't be resent");
+        }
+#endif
+#ifdef CONFIG_ESP_RTSP_FEC
+        session->fec_group_size = CONFIG_ESP_RTSP_FEC_GROUP_SIZE;
+        esp_rtp_fec_init(&session->fec, session->fec_group_size);
+#endif
+    }
 
-    // actually 24 bits
-    uint32_t *fragment_offset = (uint32_t *) &buffer[0];
-    *fragment_offset = PP_HTONL(header.fragment_offset);
+    session->initialized = true;
+}
 
-    buffer[0] = header.type;
+/* Writes what is left of a partly written packet without waiting on the
+ * socket. Returns ESP_ERR_NO_MEM while some of it is still left.
+ */
+static esp_err_t interleaved_flush(esp_rtp_session_t *session) {
+    while (session->tail_length) {
+        ssize_t sent = send(session->tcp_socket, session->tail, session->tail_length, MSG_DONTWAIT);
+        if (sent <= 0) {
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOMEM)) {
+                return ESP_ERR_NO_MEM;
+            }
+            // The connection is gone, nothing after this reaches the client anyway
+            session->tail_length = 0;
+            return ESP_FAIL;
+        }
 
-    buffer[4] = header.type_specific;
-    buffer[5] = header.q;
-    buffer[6] = header.width / 8;
-    buffer[7] = header.height / 8;
+        session->tail_length -= sent;
+        memmove(session->tail, session->tail + sent, session->tail_length);
+    }
 
-    return 8;
+    return ESP_OK;
 }
 
-static int serialize_quant_tables(esp_rtp_quant_t quant, uint8_t *buffer, size_t length) {
-    assert(buffer != NULL);
+/* Writes one packet with the interleaved framing, iov[0] is reserved for
+ * the framing header. Never waits on the socket: a packet that doesn't fit
+ * at all is refused, as is any packet while an RTSP response is partly
+ * written. A packet that fits partly is finished from the tail before
+ * anything else goes out, so the framing stays intact.
+ * Called with the write lock held.
+ */
+static esp_err_t interleaved_write(esp_rtp_session_t *session, uint8_t channel, struct iovec *iov, int iovlen) {
+    if (session->response_pending) {
+        return ESP_ERR_NO_MEM;
+    }
 
-    if (length < quant.length + 4) {
-        ESP_LOGE(TAG, "No enough space in buffer for quant tables");
-        return -1;
+    esp_err_t err = interleaved_flush(session);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    size_t size = 0;
+    for (int i = 1; i < iovlen; i++) {
+        size += iov[i].iov_len;
+    }
+
+    uint8_t framing[INTERLEAVED_HEADER_SIZE] = { '$', channel, size >> 8, size & 0xFF };
+    iov[0].iov_base = framing;
+    iov[0].iov_len = sizeof(framing);
+    size += sizeof(framing);
+
+    struct msghdr msg = {
+            .msg_iov = iov,
+            .msg_iovlen = iovlen,
+    };
+
+    ssize_t sent = sendmsg(session->tcp_socket, &msg, MSG_DONTWAIT);
+    if (sent < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOMEM ? ESP_ERR_NO_MEM : ESP_FAIL;
+    }
+
+    // Keep the rest of the packet, the framing header was on the stack
+    size_t skip = sent;
+    for (int i = 0; i < iovlen; i++) {
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        memcpy(session->tail + session->tail_length, (uint8_t *) iov[i].iov_base + skip, iov[i].iov_len - skip);
+        session->tail_length += iov[i].iov_len - skip;
+        skip = 0;
     }
 
-    buffer[0] = quant.mbz;
-    buffer[1] = quant.precision;
+    return ESP_OK;
+}
+
+static esp_err_t interleaved_send(esp_rtp_session_t *session, uint8_t channel, struct iovec *iov, int iovlen) {
+    xSemaphoreTake(session->write_lock, portMAX_DELAY);
+    esp_err_t err = session->closing ? ESP_ERR_INVALID_STATE : interleaved_write(session, channel, iov, iovlen);
+    xSemaphoreGive(session->write_lock);
+
+    return err;
+}
+
+/* Binds the sockets every unicast session sends from. Sessions are told
+ * apart by their destination on the way out and by their SSRC in the
+ * reports coming back, so a session costs no sockets of its own.
+ */
+esp_err_t esp_rtp_start() {
+    if (shared_rtp_socket >= 0) {
+        return ESP_OK;
+    }
 
-    uint16_t *size = (uint16_t *) &buffer[2];
-    *size = PP_HTONS(quant.length);
+    int rtp_sock = socket_bind_udp(CONFIG_ESP_RTSP_RTP_PORT, CONFIG_ESP_RTSP_RTP_DSCP);
+    int rtcp_sock = socket_bind_udp(CONFIG_ESP_RTSP_RTP_PORT + 1, CONFIG_ESP_RTSP_RTCP_DSCP);
+    if (rtp_sock < 0 || rtcp_sock < 0) {
+        ESP_LOGE(TAG, "Unable to prepare UDP sockets for RTP/RTCP on port %d", CONFIG_ESP_RTSP_RTP_PORT);
+        goto CLEAN_UP;
+    }
 
-    memcpy(buffer+4, quant.table0, 64);
-    memcpy(buffer+68, quant.table1, 64);
+    shared_rtp_socket = rtp_sock;
+    shared_rtcp_socket = rtcp_sock;
+    return ESP_OK;
 
-    return quant.length + 4;
+    CLEAN_UP:
+    if (rtp_sock >= 0) {
+        close(rtp_sock);
+    }
+    if (rtcp_sock >= 0) {
+        close(rtcp_sock);
+    }
+    return ESP_FAIL;
 }
 
-esp_err_t esp_rtp_init(esp_rtp_session_handle_t *rtp_session, int dst_rtp_port, int dst_rtcp_port, char *dst_addr_string) {
+esp_err_t esp_rtp_init(esp_rtp_session_handle_t *rtp_session, int dst_rtp_port, int dst_rtcp_port, int rtcp_mux, char *dst_addr_string) {
     esp_rtp_session_t *session = calloc(1, sizeof(esp_rtp_session_t));
     if (!session) {
         return ESP_ERR_NO_MEM;
     }
     memset(session, 0, sizeof(esp_rtp_session_t));
 
+    if (shared_rtp_socket < 0) {
+        ESP_LOGE(TAG, "No UDP sockets for RTP/RTCP, esp_rtp_start not called");
+        free(session);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    session->shared_sockets = true;
+    session->rtp_socket = shared_rtp_socket;
+    session->rtcp_socket = shared_rtcp_socket;
+    session->src_rtp_port = CONFIG_ESP_RTSP_RTP_PORT;
+    session->src_rtcp_port = CONFIG_ESP_RTSP_RTP_PORT + 1;
+
     session->dst_rtp_port = dst_rtp_port;
     session->dst_rtcp_port = dst_rtcp_port;
 
-    // Find two consecutive ports in the range 9001 - 65534
-    for (u_short port = 9001; port < 0xFFFE; port += 2) {
-        int rtp_sock = socket_bind_udp(port);
-        if (rtp_sock < 0) {
-            continue;
-        }
+    // The client asked for rtcp-mux, RTCP goes both ways on the RTP sockets
+    if (rtcp_mux) {
+        session->rtcp_mux = true;
+        session->dst_rtcp_port = dst_rtp_port;
+        session->rtcp_socket = shared_rtp_socket;
+        session->src_rtcp_port = CONFIG_ESP_RTSP_RTP_PORT;
+    }
 
-        int rtcp_sock = socket_bind_udp(port + 1);
-        if (rtcp_sock < 0) {
-            close(rtp_sock);
-            continue;
-        }
+    memcpy(session->dst_addr, dst_addr_string, sizeof(session->dst_addr));
+    session_start(session);
 
-        session->rtp_socket = rtp_sock;
-        session->src_rtp_port = port;
+    *rtp_session = session;
+    return ESP_OK;
+}
 
-        session->rtcp_socket = rtcp_sock;
-        session->src_rtcp_port = port + 1;
-        break;
+static esp_err_t socket_set_multicast(int sockfd, int ttl) {
+    uint8_t multicast_ttl = ttl;
+    if (setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_TTL, &multicast_ttl, sizeof(multicast_ttl)) < 0) {
+        ESP_LOGE(TAG, "Unable to set socket IP_MULTICAST_TTL: errno %d", errno);
+        return ESP_FAIL;
     }
 
-    if (session->rtp_socket <= 0) {
-        ESP_LOGE(TAG, "Unable to prepare UDP sockets for RTP/RTCP");
-        return ESP_FAIL;
+    // Our own reports are of no use to us
+    uint8_t loop = 0;
+    if (setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0) {
+        ESP_LOGW(TAG, "Unable to set socket IP_MULTICAST_LOOP: errno %d", errno);
     }
 
-    memcpy(session->dst_addr, dst_addr_string, sizeof(session->dst_addr));
+    return ESP_OK;
+}
 
-    session->timestamp = esp_random() >> 16;
-    session->sequence_number = 0;
-    session->initialized = true;
+/* A session that sends to a multicast group. Viewers send their receiver
+ * reports to the group as well, so the RTCP socket listens on the group's
+ * RTCP port and joins the group.
+ */
+esp_err_t esp_rtp_init_multicast(esp_rtp_session_handle_t *rtp_session, const char *group, int port, int ttl) {
+    esp_rtp_session_t *session = calloc(1, sizeof(esp_rtp_session_t));
+    if (!session) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    int rtp_sock = -1;
+    int rtcp_sock = -1;
+
+    struct ip_mreq membership = {
+            .imr_multiaddr.s_addr = inet_addr(group),
+            .imr_interface.s_addr = INADDR_ANY
+    };
+
+    if (!IN_MULTICAST(ntohl(membership.imr_multiaddr.s_addr))) {
+        ESP_LOGE(TAG, "Not a multicast address: %s", group);
+        goto CLEAN_UP;
+    }
+
+    // Any source port will do, nothing is received on it
+    rtp_sock = socket_bind_udp(0, CONFIG_ESP_RTSP_RTP_DSCP);
+    rtcp_sock = socket_bind_udp(port + 1, CONFIG_ESP_RTSP_RTCP_DSCP);
+    if (rtp_sock < 0 || rtcp_sock < 0) {
+        ESP_LOGE(TAG, "Unable to prepare UDP sockets for multicast RTP/RTCP");
+        goto CLEAN_UP;
+    }
+
+    if (socket_set_multicast(rtp_sock, ttl) != ESP_OK || socket_set_multicast(rtcp_sock, ttl) != ESP_OK) {
+        goto CLEAN_UP;
+    }
+
+    if (setsockopt(rtcp_sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) < 0) {
+        // Streaming works, but the viewers' reports won't arrive
+        ESP_LOGW(TAG, "Unable to join multicast group %s: errno %d", group, errno);
+    }
+
+    session->multicast = true;
+    session->rtp_socket = rtp_sock;
+    session->rtcp_socket = rtcp_sock;
+    session->src_rtp_port = port;
+    session->src_rtcp_port = port + 1;
+    session->dst_rtp_port = port;
+    session->dst_rtcp_port = port + 1;
+    strncpy(session->dst_addr, group, sizeof(session->dst_addr) - 1);
+    session_start(session);
 
     *rtp_session = session;
     return ESP_OK;
+
+    CLEAN_UP:
+    if (rtp_sock >= 0) {
+        close(rtp_sock);
+    }
+    if (rtcp_sock >= 0) {
+        close(rtcp_sock);
+    }
+    free(session);
+    return ESP_FAIL;
 }
 
-esp_err_t esp_rtp_teardown(esp_rtp_session_handle_t rtp_session) {
-    if (!rtp_session) {
-        return ESP_ERR_INVALID_ARG;
+esp_err_t esp_rtp_init_interleaved(esp_rtp_session_handle_t *rtp_session, int tcp_socket, int rtp_channel, int rtcp_channel) {
+    esp_rtp_session_t *session = calloc(1, sizeof(esp_rtp_session_t));
+    if (!session) {
+        return ESP_ERR_NO_MEM;
     }
-    esp_rtp_session_t *session = rtp_session;
 
-    if (session->initialized) {
+    session->tail = malloc(INTERLEAVED_HEADER_SIZE + MAX_PAYLOAD_SIZE);
+    session->write_lock = xSemaphoreCreateMutex();
+    if (!session->tail || !session->write_lock) {
+        ESP_LOGE(TAG, "No memory for an interleaved session");
+        goto CLEAN_UP;
+    }
+
+    // The RTSP connection carries the video now, the server restores the control marking on teardown
+    esp_rtp_socket_set_dscp(tcp_socket, CONFIG_ESP_RTSP_RTP_DSCP);
+
+    session->interleaved = true;
+    session->tcp_socket = tcp_socket;
+    session->rtp_channel = rtp_channel;
+    session->rtcp_channel = rtcp_channel;
+    session_start(session);
+
+    *rtp_session = session;
+    return ESP_OK;
+
+    CLEAN_UP:
+    if (session->write_lock) {
+        vSemaphoreDelete(session->write_lock);
+    }
+    free(session->tail);
+    free(session);
+    return ESP_ERR_NO_MEM;
+}
+
+static void esp_rtp_session_free(esp_rtp_session_t *session) {
+    if (session->interleaved) {
+        // The socket belongs to the RTSP connection
+        vSemaphoreDelete(session->write_lock);
+        free(session->tail);
+    } else if (session->initialized && !session->shared_sockets) {
         shutdown(session->rtp_socket, 0);
         close (session->rtp_socket);
 
@@ -172,134 +399,508 @@ esp_err_t esp_rtp_teardown(esp_rtp_session_handle_t rtp_session) {
         close(session->rtcp_socket);
     }
 
+    esp_rtp_jpeg_frame_unref(session->pending);
+#ifdef CONFIG_ESP_RTSP_NACK
+    esp_rtp_history_free(&session->history);
+#endif
     free(session);
-
-    return ESP_OK;
 }
 
-esp_err_t esp_rtp_send_jpeg(esp_rtp_session_handle_t rtp_session, uint8_t *frame, size_t frame_length) {
+esp_err_t esp_rtp_teardown(esp_rtp_session_handle_t rtp_session) {
     if (!rtp_session) {
         return ESP_ERR_INVALID_ARG;
     }
     esp_rtp_session_t *session = rtp_session;
 
-    if (!session->initialized) {
-        return ESP_FAIL;
+    // Packets still queued for this session are skipped, the sockets are closed with the last reference
+    if (session->interleaved) {
+        // Never waits on a slow client, a packet esp_rtp_interleaved_stop didn't hand out is dropped
+        xSemaphoreTake(session->write_lock, portMAX_DELAY);
+        interleaved_flush(session);
+        session->tail_length = 0;
+        session->closing = true;
+        xSemaphoreGive(session->write_lock);
+    } else {
+        session->closing = true;
     }
+    esp_rtp_session_unref(session);
 
-    esp_rtsp_jpeg_data_t jpeg_data;
+    return ESP_OK;
+}
 
-    if (esp_rtsp_jpeg_decode((char *)frame, frame_length, &jpeg_data) != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to parse jpeg data");
-        return ESP_FAIL;
+esp_rtp_session_handle_t esp_rtp_session_ref(esp_rtp_session_handle_t rtp_session) {
+    esp_rtp_session_t *session = rtp_session;
+    assert(session != NULL);
+
+    portENTER_CRITICAL(&refcount_lock);
+    session->refcount++;
+    portEXIT_CRITICAL(&refcount_lock);
+
+    return session;
+}
+
+void esp_rtp_session_unref(esp_rtp_session_handle_t rtp_session) {
+    esp_rtp_session_t *session = rtp_session;
+    if (!session) {
+        return;
+    }
+
+    portENTER_CRITICAL(&refcount_lock);
+    assert(session->refcount > 0);
+    uint32_t refcount = --session->refcount;
+    portEXIT_CRITICAL(&refcount_lock);
+
+    if (refcount == 0) {
+        esp_rtp_session_free(session);
+    }
+}
+
+int esp_rtp_session_offer_frame(esp_rtp_session_handle_t rtp_session, esp_rtp_jpeg_frame_t *jpeg_frame) {
+    esp_rtp_session_t *session = rtp_session;
+    assert(session != NULL);
+    esp_rtp_jpeg_frame_ref(jpeg_frame);
+
+    portENTER_CRITICAL(&session->lock);
+    esp_rtp_jpeg_frame_t *previous = session->pending;
+    session->pending = jpeg_frame;
+    if (previous) {
+        session->stats.frames_dropped++;
+    }
+    portEXIT_CRITICAL(&session->lock);
+
+    // Latest frame wins, a slow session skips ahead instead of falling behind
+    esp_rtp_jpeg_frame_unref(previous);
+
+    return previous != NULL;
+}
+
+esp_rtp_jpeg_frame_t *esp_rtp_session_take_frame(esp_rtp_session_handle_t rtp_session) {
+    esp_rtp_session_t *session = rtp_session;
+    assert(session != NULL);
+
+    portENTER_CRITICAL(&session->lock);
+    esp_rtp_jpeg_frame_t *jpeg_frame = session->pending;
+    session->pending = NULL;
+    portEXIT_CRITICAL(&session->lock);
+
+    return jpeg_frame;
+}
+
+void esp_rtp_session_abort_frame(esp_rtp_session_handle_t rtp_session, const esp_rtp_jpeg_frame_t *jpeg_frame) {
+    esp_rtp_session_t *session = rtp_session;
+    assert(session != NULL);
+
+    if (session->aborted && session->aborted_sequence == jpeg_frame->frame->sequence) {
+        return;
     }
 
-    esp_rtp_jpeg_header_t rtp_jpeg_header = {
-            .height = 600,             // TODO get this from camera or image
-            .width = 800,              // TODO get this from camera or image
-            .q = 12,                   // TODO get this from camera or image
-            .type = TYPE_BASELINE_DCT_SEQUENTIAL,
-            .type_specific = TYPE_0_SPECIFIC_PROGRESSIVE,
-            .fragment_offset = 0,
+    session->aborted = true;
+    session->aborted_sequence = jpeg_frame->frame->sequence;
+    session->stats.frames_aborted++;
+}
+
+#ifdef CONFIG_ESP_RTSP_FEC
+/* Sends the FEC packet for the group collected so far. It takes the next
+ * sequence number, so the receiver sees it in line with the media packets.
+ * A FEC packet that can't be sent is dropped, the video doesn't wait for it.
+ */
+static void send_fec_packet(esp_rtp_session_t *session, const struct sockaddr_in *client, uint32_t timestamp) {
+    esp_rtp_fec_t *fec = &session->fec;
+
+    esp_rtp_header_t rtp_header = {
+            .payload_type = CONFIG_ESP_RTSP_FEC_PAYLOAD_TYPE,
+            .ssrc = session->ssrc,
+            .timestamp = timestamp,
+            .sequence_number = session->sequence_number,
+            .marker = false
+    };
+
+    uint8_t header[RTP_HEADER_SIZE];
+    serialize_header(rtp_header, header, sizeof(header));
+
+    uint8_t fec_header[RTP_FEC_HEADER_SIZE + RTP_FEC_LEVEL_HEADER_SIZE];
+    esp_rtp_fec_serialize_header(fec, fec_header, sizeof(fec_header));
+
+    struct iovec iov[3] = {
+            {
+                    .iov_base = header,
+                    .iov_len = sizeof(header)
+            },
+            {
+                    .iov_base = fec_header,
+                    .iov_len = sizeof(fec_header)
+            },
+            {
+                    .iov_base = fec->payload,
+                    .iov_len = fec->protection_length
+            }
     };
 
+    struct msghdr msg = {
+            .msg_name = (void *) client,
+            .msg_namelen = sizeof(*client),
+            .msg_iov = iov,
+            .msg_iovlen = 3,
+    };
+
+    size_t size = sizeof(header) + sizeof(fec_header) + fec->protection_length;
+    ssize_t sent = sendmsg(session->rtp_socket, &msg, 0);
+    if (sent == size) {
+        session->sequence_number++;
+        session->stats.fec_packets_sent++;
+        session->stats.octets_sent += size - sizeof(header);
+        session->stats.bytes_copied += size;
+    } else {
+        ESP_LOGD(TAG, "Failed to send FEC packet: %d", errno);
+    }
+
+    esp_rtp_fec_reset(fec);
+}
+
+static void protect_packet(esp_rtp_session_t *session, const struct sockaddr_in *client,
+                           const uint8_t *header, const struct iovec *payload, int iovlen, int marker) {
+    esp_rtp_fec_t *fec = &session->fec;
+
+    // A new ratio starts with the next group, the receiver needs a consistent mask
+    if (fec->count == 0 && fec->group_size != session->fec_group_size) {
+        esp_rtp_fec_init(fec, session->fec_group_size);
+    }
+
+    esp_rtp_fec_add(fec, header, payload, iovlen);
+    if (esp_rtp_fec_complete(fec, marker)) {
+        uint32_t timestamp = header[4] << 24 | header[5] << 16 | header[6] << 8 | header[7];
+        send_fec_packet(session, client, timestamp);
+    }
+}
+#endif
+
+/* Tables are only sent until the session has them, and refreshed now and
+ * then in case they got lost. Multicast viewers join at any frame, there
+ * every frame carries them.
+ */
+static int session_sends_tables(const esp_rtp_session_t *session, const esp_rtp_jpeg_frame_t *jpeg_frame) {
+    return jpeg_frame->include_quant && (session->multicast || session->quant_generation_sent != jpeg_frame->quant_generation ||
+                                         session->quant_frames >= QUANT_REFRESH_FRAMES);
+}
+
+// Whether the first packet of the frame will carry the quantization tables, for the pacer to charge what goes out
+int esp_rtp_session_sends_tables(esp_rtp_session_handle_t rtp_session, const esp_rtp_jpeg_frame_t *jpeg_frame) {
+    return rtp_session && jpeg_frame && session_sends_tables(rtp_session, jpeg_frame);
+}
+
+/* Sends one packet of the frame with the given sequence number. A resent
+ * packet is self contained, it carries the quantization tables if its
+ * first transmission had room for them, and leaves the session state alone.
+ */
+static esp_err_t send_jpeg_packet(esp_rtp_session_t *session, const esp_rtp_jpeg_frame_t *jpeg_frame, size_t index,
+                                  uint16_t sequence_number, int resend) {
+    esp_rtp_jpeg_packet_t jpeg_packet;
+    esp_rtp_jpeg_get_packet(jpeg_frame, index, &jpeg_packet);
+    const esp_rtp_jpeg_packet_t *packet = &jpeg_packet;
+
     esp_rtp_header_t rtp_header = {
             .payload_type = RTP_PAYLOAD_JPEG,
-            .ssrc = 12348765,         // TODO make this random and unique
-            .timestamp = session->timestamp++, // Increase timestamp per frame
-            .sequence_number = 0,
-            .marker = 0
+            .ssrc = session->ssrc,
+            .timestamp = session->timestamp + jpeg_frame->timestamp,
+            .sequence_number = sequence_number,
+            .marker = packet->marker
     };
 
-    while (rtp_jpeg_header.fragment_offset < jpeg_data.jpeg_data_length) {
-        static uint8_t payload[MAX_PAYLOAD_SIZE];
-        uint8_t *offset = payload;
-        size_t payload_remaining = MAX_PAYLOAD_SIZE;
+    const struct sockaddr_in client = {
+            .sin_family = AF_INET,
+            .sin_addr.s_addr = inet_addr(session->dst_addr),
+            .sin_port = htons(session->dst_rtp_port)
+    };
+
+    /* Only the RTP header is built per session, the JPEG header and quant tables
+     * are shared by all sessions and the jpeg data is referenced in place in the
+     * frame buffer, which stays pinned as long as the packetized frame lives.
+     */
+    uint8_t header[RTP_HEADER_SIZE];
+    serialize_header(rtp_header, header, sizeof(header));
+
+    uint8_t quant_header[4];
+    int include_tables = false;
+
+    // The first entry is left for the framing of interleaved sessions
+    struct iovec iov[7] = {
+            {
+                    .iov_base = NULL,
+                    .iov_len = 0
+            },
+            {
+                    .iov_base = header,
+                    .iov_len = sizeof(header)
+            },
+            {
+                    .iov_base = (void *) packet->jpeg_header,
+                    .iov_len = packet->jpeg_header_length
+            }
+    };
+    int iovlen = 3;
+
+    if (packet->include_quant) {
+        include_tables = resend || session_sends_tables(session, jpeg_frame);
 
-        rtp_header.sequence_number = session->sequence_number++; // Increase sequence per packet
+        esp_rtp_jpeg_serialize_quant_header(include_tables, quant_header, sizeof(quant_header));
+        iov[iovlen].iov_base = quant_header;
+        iov[iovlen].iov_len = sizeof(quant_header);
+        iovlen++;
 
-        int include_quant = jpeg_data.quant_table_0 && jpeg_data.quant_table_1 && rtp_jpeg_header.fragment_offset == 0;
-        if (include_quant) {
-            rtp_jpeg_header.q |= 1 << 7;
-        } else {
-            rtp_jpeg_header.q &= 0b0111111;
+        if (include_tables) {
+            iov[iovlen].iov_base = (void *) jpeg_frame->quant_table_0;
+            iov[iovlen].iov_len = 64;
+            iovlen++;
+
+            iov[iovlen].iov_base = (void *) jpeg_frame->quant_table_1;
+            iov[iovlen].iov_len = 64;
+            iovlen++;
         }
+    }
 
-        int last_packet = (jpeg_data.jpeg_data_length - rtp_jpeg_header.fragment_offset + 20) < payload_remaining;
-        rtp_header.marker = last_packet;
+    iov[iovlen].iov_base = jpeg_frame->jpeg_data.jpeg_data_start + packet->fragment_offset;
+    iov[iovlen].iov_len = packet->length;
+    iovlen++;
 
-//        ESP_LOGD(TAG, "Serializing RTP/AVP packet, offset=%d, quant=%d, last=%d, timestamp=%ud, sequence=%ud",
-//                 rtp_jpeg_header.fragment_offset, include_quant, last_packet,
-//                 session->timestamp, session->sequence_number);
+    size_t size = 0;
+    for (int i = 1; i < iovlen; i++) {
+        size += iov[i].iov_len;
+    }
 
-        int n = serialize_header(rtp_header, offset, payload_remaining);
-        if (n < 0) {
-            return ESP_FAIL;
-        };
-        payload_remaining -= n;
-        offset += n;
+    if (session->interleaved) {
+        esp_err_t err = interleaved_send(session, session->rtp_channel, iov, iovlen);
+        if (err == ESP_ERR_NO_MEM && index == 0 && !resend) {
+            // The connection is backed up, skip the whole frame instead of starting one we can't finish
+            session->aborted = true;
+            session->aborted_sequence = jpeg_frame->frame->sequence;
+            session->stats.frames_skipped++;
+            return ESP_ERR_INVALID_STATE;
+        }
 
-        n = serialize_jpeg_header(rtp_jpeg_header, offset, payload_remaining);
-        if (n < 0) {
-            return ESP_FAIL;
+        if (err != ESP_OK) {
+            return err;
+        }
+    } else {
+        struct msghdr msg = {
+                .msg_name = (void *) &client,
+                .msg_namelen = sizeof(client),
+                .msg_iov = &iov[1],
+                .msg_iovlen = iovlen - 1,
         };
-        payload_remaining -= n;
-        offset += n;
-
-        if (include_quant) {
-            esp_rtp_quant_t quant = RTP_QUANT_DEFAULT();
-            memcpy(quant.table0, jpeg_data.quant_table_0 + 5, 64);
-            memcpy(quant.table1, jpeg_data.quant_table_1 + 5, 64);
-
-            n = serialize_quant_tables(quant, offset, payload_remaining);
-            if (n < 0) {
-                return ESP_FAIL;
-            };
-            payload_remaining -= n;
-            offset += n;
+
+        ssize_t sent = sendmsg(session->rtp_socket, &msg, 0);
+        if (sent < 0 && errno == ENOMEM) {
+            // The buffers in lwIP are full, the caller decides when to try again
+            return ESP_ERR_NO_MEM;
         }
 
-        if (last_packet) {
-            size_t remaining_bytes =  jpeg_data.jpeg_data_length - rtp_jpeg_header.fragment_offset;
-            memcpy(offset, jpeg_data.jpeg_data_start + rtp_jpeg_header.fragment_offset, remaining_bytes);
-            payload_remaining -= remaining_bytes;
-            rtp_jpeg_header.fragment_offset += remaining_bytes;
-        } else {
-            memcpy(offset, jpeg_data.jpeg_data_start + rtp_jpeg_header.fragment_offset, payload_remaining);
-            rtp_jpeg_header.fragment_offset += payload_remaining;
-            payload_remaining = 0;
+        if (sent != size) {
+            ESP_LOGE(TAG, "Failed to sent RTP package: %d", errno);
+            return ESP_FAIL;
         }
+    }
+
+    if (resend) {
+        session->stats.packets_resent++;
+        return ESP_OK;
+    }
+
+    if (packet->include_quant) {
+        session->quant_frames = include_tables ? 0 : session->quant_frames + 1;
+        session->quant_generation_sent = jpeg_frame->quant_generation;
+    }
+
+    session->sequence_number++; // Increase sequence per packet
+    session->stats.packets_sent++;
+    session->stats.octets_sent += size - sizeof(header);
+    session->stats.bytes_copied += sizeof(header) + (packet->include_quant ? sizeof(quant_header) : 0);
+    session->stats.bytes_referenced += size - sizeof(header) - (packet->include_quant ? sizeof(quant_header) : 0);
+    if (packet->marker) {
+        session->stats.frames_sent++;
+        session->stats.frame_packets = jpeg_frame->packet_count;
+        // The wire size counts the tables, they only went out if the counter was just reset
+        session->stats.frame_bytes = jpeg_frame->wire_size -
+                                     (jpeg_frame->include_quant && session->quant_frames ? RTP_QUANT_TABLES_SIZE : 0);
+    }
+
+#ifdef CONFIG_ESP_RTSP_FEC
+    protect_packet(session, &client, header, &iov[2], iovlen - 2, packet->marker);
+#endif
+
+    return ESP_OK;
+}
+
+esp_err_t esp_rtp_send_jpeg_packet(esp_rtp_session_handle_t rtp_session, esp_rtp_jpeg_frame_t *jpeg_frame, size_t index) {
+    if (!rtp_session || !jpeg_frame || index >= jpeg_frame->packet_count) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_rtp_session_t *session = rtp_session;
+
+    if (!session->initialized || session->closing) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (session->aborted && session->aborted_sequence == jpeg_frame->frame->sequence) {
+        // Part of this frame is lost already, don't waste airtime on the rest
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    uint16_t sequence_number = session->sequence_number;
+    esp_err_t err = send_jpeg_packet(session, jpeg_frame, index, sequence_number, false);
+
+#ifdef CONFIG_ESP_RTSP_NACK
+    if (err == ESP_OK) {
+        esp_rtp_history_add(&session->history, sequence_number, jpeg_frame, index);
+    }
+#endif
+
+    return err;
+}
+
+esp_err_t esp_rtp_resend_jpeg_packet(esp_rtp_session_handle_t rtp_session, const esp_rtp_jpeg_frame_t *jpeg_frame, size_t index, uint16_t sequence_number) {
+    if (!rtp_session || !jpeg_frame || index >= jpeg_frame->packet_count) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_rtp_session_t *session = rtp_session;
+
+    if (!session->initialized || session->closing) {
+        return ESP_ERR_INVALID_STATE;
+    }
 
-        const struct sockaddr_in client = {
-                .sin_family = AF_INET,
-                .sin_addr.s_addr = inet_addr(session->dst_addr),
-                .sin_port = htons(session->dst_rtp_port)
+    // Same SSRC and the original sequence number, the receiver slots it in where it was missing
+    return send_jpeg_packet(session, jpeg_frame, index, sequence_number, true);
+}
+
+esp_err_t esp_rtp_send_rtcp(esp_rtp_session_handle_t rtp_session, const uint8_t *buffer, size_t length) {
+    if (!rtp_session || !buffer) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_rtp_session_t *session = rtp_session;
+
+    if (session->interleaved) {
+        struct iovec iov[2] = {
+                {
+                        .iov_base = NULL,
+                        .iov_len = 0
+                },
+                {
+                        .iov_base = (void *) buffer,
+                        .iov_len = length
+                }
         };
+        return interleaved_send(session, session->rtcp_channel, iov, 2);
+    }
 
-        int retries = 5;  // ENOMEM might occur if the buffer in LWIP is full
-        size_t size = MAX_PAYLOAD_SIZE - payload_remaining;
-        do {
-            ssize_t sent = sendto(session->rtp_socket, payload, size, 0,
-                                  (const struct sockaddr *) &client, sizeof(client));
+    const struct sockaddr_in client = {
+            .sin_family = AF_INET,
+            .sin_addr.s_addr = inet_addr(session->dst_addr),
+            .sin_port = htons(session->dst_rtcp_port)
+    };
 
-            if (sent < 0 && errno != ENOMEM) {
-                ESP_LOGE(TAG, "Failed to sent RTP package: %d", errno);
-                return ESP_FAIL;
-            }
-            
-            if (sent == size) {
-                break;
-            }
+    ssize_t sent = sendto(session->rtcp_socket, buffer, length, 0, (const struct sockaddr *) &client, sizeof(client));
+    return sent == length ? ESP_OK : ESP_FAIL;
+}
+
+/* Writes RTSP responses on the connection of an interleaved session without
+ * waiting on the socket. The rest of a packet on the wire goes first, a
+ * response in the middle of a packet would break the framing for the
+ * client. Until the responses are written completely no packets are sent,
+ * the caller writes the rest when the socket has room again. Returns the
+ * number of bytes written, 0 when the socket is full, -1 when the
+ * connection failed.
+ */
+ssize_t esp_rtp_interleaved_writev(esp_rtp_session_handle_t rtp_session, struct iovec *iov, int iovcnt) {
+    esp_rtp_session_t *session = rtp_session;
+    if (!session || !session->interleaved) {
+        return -1;
+    }
+
+    size_t length = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        length += iov[i].iov_len;
+    }
+
+    xSemaphoreTake(session->write_lock, portMAX_DELAY);
+    ssize_t sent = 0;
+    esp_err_t err = interleaved_flush(session);
+    if (err == ESP_OK) {
+        struct msghdr msg = {
+                .msg_iov = iov,
+                .msg_iovlen = iovcnt,
+        };
+        sent = sendmsg(session->tcp_socket, &msg, MSG_DONTWAIT);
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOMEM)) {
+            sent = 0;
+        }
+    } else if (err != ESP_ERR_NO_MEM) {
+        sent = -1;
+    }
+    session->response_pending = sent >= 0 && (size_t) sent < length;
+    xSemaphoreGive(session->write_lock);
+
+    return sent;
+}
+
+/* Stops the packets of an interleaved session on its connection. The rest
+ * of a packet on the wire is written if the socket takes it right away,
+ * otherwise it is returned with its length, and the caller writes it before
+ * anything else or the client loses the framing. It stays valid until the
+ * session is torn down. Returns NULL when nothing is left.
+ */
+const uint8_t *esp_rtp_interleaved_stop(esp_rtp_session_handle_t rtp_session, size_t *length) {
+    esp_rtp_session_t *session = rtp_session;
+    *length = 0;
+    if (!session || !session->interleaved) {
+        return NULL;
+    }
+
+    xSemaphoreTake(session->write_lock, portMAX_DELAY);
+    interleaved_flush(session);
+    session->closing = true;
+    *length = session->tail_length;
+    xSemaphoreGive(session->write_lock);
 
-            // We might need to take some time to clear the transmit buffers
-            esp_rom_delay_us(250);
-            retries--;
-        } while (retries > 0);
+    return *length ? session->tail : NULL;
+}
+
+/* Limits the packets of the session to max_payload_size bytes of UDP
+ * payload, for clients behind tunnels that would otherwise get fragments.
+ * Takes effect from the next frame.
+ */
+esp_err_t esp_rtp_set_max_payload_size(esp_rtp_session_handle_t rtp_session, size_t max_payload_size) {
+    if (!rtp_session) {
+        return ESP_ERR_INVALID_ARG;
     }
+    esp_rtp_session_t *session = rtp_session;
 
+    if (max_payload_size < MIN_PAYLOAD_SIZE) {
+        max_payload_size = MIN_PAYLOAD_SIZE;
+    } else if (max_payload_size > MAX_PAYLOAD_SIZE) {
+        max_payload_size = MAX_PAYLOAD_SIZE;
+    }
+
+    session->max_payload_size = max_payload_size;
     return ESP_OK;
 }
 
+/* The size the frames for this session are packetized for. FEC packets are
+ * larger than the media packets they protect, room for that is kept so they
+ * stay within the limit as well.
+ */
+size_t esp_rtp_get_max_payload_size(esp_rtp_session_handle_t rtp_session) {
+    esp_rtp_session_t *session = rtp_session;
+    assert(session != NULL);
+
+    size_t max_payload_size = session->max_payload_size;
+#ifdef CONFIG_ESP_RTSP_FEC
+    if (!session->interleaved) {
+        max_payload_size -= RTP_FEC_HEADER_SIZE + RTP_FEC_LEVEL_HEADER_SIZE;
+    }
+#endif
+
+    return max_payload_size;
+}
+
 int esp_rtp_get_src_rtp_port(esp_rtp_session_handle_t rtp_session) {
     if (!rtp_session) {
         return -1;
@@ -324,4 +925,59 @@ int esp_rtp_get_src_rtcp_port(esp_rtp_session_handle_t rtp_session) {
     }
 
     return session->src_rtcp_port;
-}
\ No newline at end of file
+}
+
+esp_err_t esp_rtp_get_stats(esp_rtp_session_handle_t rtp_session, esp_rtp_session_stats_t *stats) {
+    if (!rtp_session || !stats) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_rtp_session_t *session = rtp_session;
+
+    *stats = session->stats;
+    return ESP_OK;
+}
+
+esp_err_t esp_rtp_get_feedback(esp_rtp_session_handle_t rtp_session, esp_rtp_session_feedback_t *feedback) {
+    if (!rtp_session || !feedback) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_rtp_session_t *session = rtp_session;
+
+    portENTER_CRITICAL(&session->lock);
+    *feedback = session->feedback;
+    portEXIT_CRITICAL(&session->lock);
+
+    return ESP_OK;
+}
+
+esp_err_t esp_rtp_get_history_stats(esp_rtp_session_handle_t rtp_session, esp_rtp_history_stats_t *stats) {
+    if (!rtp_session || !stats) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+#ifdef CONFIG_ESP_RTSP_NACK
+    esp_rtp_session_t *session = rtp_session;
+    if (!session->history.entries) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    esp_rtp_history_get_stats(&session->history, stats);
+    return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+esp_err_t esp_rtp_set_fec_group_size(esp_rtp_session_handle_t rtp_session, uint8_t group_size) {
+    if (!rtp_session || group_size > RTP_FEC_MAX_GROUP_SIZE) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+#ifdef CONFIG_ESP_RTSP_FEC
+    esp_rtp_session_t *session = rtp_session;
+    session->fec_group_size = group_size;
+    return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
@@ -0,0 +1,135 @@
+//
+// Created on 18/10/2026.
+//
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rtsp-output.h"
+
+esp_err_t rtsp_output_init(rtsp_output_t *output) {
+    char *buffer = output->buffer ? output->buffer : malloc(RTSP_OUTPUT_BUFFER_SIZE);
+    if (!buffer) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    memset(output, 0, sizeof(rtsp_output_t));
+    output->buffer = buffer;
+
+    return ESP_OK;
+}
+
+void rtsp_output_free(rtsp_output_t *output) {
+    free(output->buffer);
+    memset(output, 0, sizeof(rtsp_output_t));
+}
+
+/* Formats into the free part of the buffer without queueing it, so a
+ * response can be assembled from parts in any order. Returns the formatted
+ * text, or NULL when it doesn't fit and the output is marked as overflowed.
+ */
+char *rtsp_output_vformat(rtsp_output_t *output, size_t *length, const char *format, va_list args) {
+    size_t room = RTSP_OUTPUT_BUFFER_SIZE - output->buffer_length;
+    char *data = output->buffer + output->buffer_length;
+
+    int size = vsnprintf(data, room, format, args);
+    if (size < 0 || size >= room) {
+        output->overflow = true;
+        return NULL;
+    }
+
+    output->buffer_length += size;
+    *length = size;
+    return data;
+}
+
+char *rtsp_output_format(rtsp_output_t *output, size_t *length, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    char *data = rtsp_output_vformat(output, length, format, args);
+    va_end(args);
+
+    return data;
+}
+
+/* Copies length bytes into the free part of the buffer without queueing
+ * them, for data that doesn't stay around until it is written. Returns the
+ * copy, or NULL when it doesn't fit and the output is marked as overflowed.
+ */
+char *rtsp_output_copy(rtsp_output_t *output, const void *data, size_t length) {
+    if (length > RTSP_OUTPUT_BUFFER_SIZE - output->buffer_length) {
+        output->overflow = true;
+        return NULL;
+    }
+
+    char *copy = output->buffer + output->buffer_length;
+    memcpy(copy, data, length);
+    output->buffer_length += length;
+
+    return copy;
+}
+
+/* Queues length bytes at data to be written after everything queued before.
+ * The bytes are referenced, not copied: they are either in the buffer or
+ * constant. Data that continues the last iovec extends it.
+ */
+esp_err_t rtsp_output_queue(rtsp_output_t *output, const void *data, size_t length) {
+    if (output->count > output->head) {
+        struct iovec *last = &output->iov[output->count - 1];
+        if ((const char *) last->iov_base + last->iov_len == data) {
+            last->iov_len += length;
+            return ESP_OK;
+        }
+    }
+
+    if (output->count == RTSP_OUTPUT_IOVECS && output->head > 0) {
+        memmove(output->iov, output->iov + output->head, (output->count - output->head) * sizeof(struct iovec));
+        output->count -= output->head;
+        output->head = 0;
+    }
+
+    if (output->count == RTSP_OUTPUT_IOVECS) {
+        output->overflow = true;
+        return ESP_ERR_NO_MEM;
+    }
+
+    output->iov[output->count].iov_base = (void *) data;
+    output->iov[output->count].iov_len = length;
+    output->count++;
+
+    return ESP_OK;
+}
+
+int rtsp_output_pending(const rtsp_output_t *output) {
+    return output->count > output->head;
+}
+
+// The iovecs still to be written, for a single sendmsg
+int rtsp_output_peek(rtsp_output_t *output, struct iovec **iov) {
+    *iov = output->iov + output->head;
+    return output->count - output->head;
+}
+
+// Drops length bytes that were written from the front of the queue
+void rtsp_output_consume(rtsp_output_t *output, size_t length) {
+    while (length > 0 && output->head < output->count) {
+        struct iovec *iov = &output->iov[output->head];
+        if (length < iov->iov_len) {
+            iov->iov_base = (char *) iov->iov_base + length;
+            iov->iov_len -= length;
+            return;
+        }
+
+        length -= iov->iov_len;
+        output->head++;
+    }
+
+    if (output->head == output->count) {
+        output->head = 0;
+        output->count = 0;
+        output->buffer_length = 0;
+    }
+}
@@ -1,6 +1,7 @@
 //
 // Created by Hugo Trippaers on 21/05/2021.
 //
+#include <stdlib.h>
 #include <string.h>
 #include <limits.h>
 
@@ -8,32 +9,31 @@
 
 #include "esp-rtsp-common.h"
 
-#define PARSE_STATE_INIT() { \
-     .parse_complete = false, \
-     .state = RTSP_PARSER_PARSE_METHOD, \
-     .intermediate_len = 0   \
-     }
-
-#define RTSP_PARSER_PARSE_METHOD 0
-#define RTSP_PARSER_PARSE_URL 1
-#define RTSP_PARSER_PARSE_PROTOCOL 2
-#define RTSP_PARSER_OPTIONAL_HEADER 9
-#define RTSP_PARSER_PARSE_HEADER 10
-#define RTSP_PARSER_PARSE_HEADER_VALUE 11
-#define RTSP_PARSER_PARSE_HEADER_WS 12
-
 #define TAG "rtsp-parser"
 
+// Far more than fits in the receive buffer, only keeps the arithmetic in range
+#define MAX_CONTENT_LENGTH 0xFFFF
+
+/* The parser works in place on the connection's receive buffer. It looks
+ * for the blank line that ends the request, resuming where the previous
+ * call stopped, and only then splits the request into lines and tokens by
+ * terminating them in the buffer. Strings in the request, like the url,
+ * point into that buffer.
+ */
 typedef struct {
-    int state;
+    int in_use;
     int parse_complete;
     int error;
-    char intermediate[1024];
-    size_t intermediate_len;
-    rtsp_req_t *request;
+    size_t scanned;     // Bytes searched for the end of the request so far
+    size_t line_start;  // Start of the line being searched
+    size_t header_end;  // Length of the request up to the blank line, 0 until it was found
+    size_t content_length;
+    rtsp_req_t request;
 } rtsp_parser_state_t;
 
-inline int min(int a, int b) { return (a < b) ? a : b; }
+// One parser for every connection, created when the server starts
+static rtsp_parser_state_t *parsers;
+static size_t parser_count;
 
 static bool valid_header_name_char(char c) {
     if (c > 127) return false;
@@ -57,237 +57,341 @@ static int safe_atoi(char *value) {
     return (int)lv;
 }
 
-int rtsp_parser_init(rtsp_parser_handle_t *handle) {
-    rtsp_parser_state_t *state = calloc(1, sizeof(rtsp_parser_state_t));
-    if (!state) {
+int rtsp_parser_pool_create(size_t size) {
+    if (parsers) {
+        return PARSER_INVALID_STATE;
+    }
+
+    parsers = calloc(size, sizeof(rtsp_parser_state_t));
+    if (!parsers) {
         return PARSER_NOMEM;
     }
+    parser_count = size;
+
+    return PARSER_OK;
+}
 
-    memset(state, 0 , sizeof(rtsp_parser_state_t));
+void rtsp_parser_pool_destroy() {
+    free(parsers);
+    parsers = NULL;
+    parser_count = 0;
+}
 
-    rtsp_req_t *request = calloc(1, sizeof(rtsp_req_t));
-    if (!request) {
-        free(state);
-        return PARSER_NOMEM;
+/* Takes a parser from the pool, there is one for every connection so the
+ * control path never allocates.
+ */
+int rtsp_parser_init(rtsp_parser_handle_t *handle) {
+    for (int i = 0; i < parser_count; i++) {
+        rtsp_parser_state_t *state = &parsers[i];
+        if (!state->in_use) {
+            state->in_use = true;
+            parser_reset(state);
+            *handle = state;
+            return PARSER_OK;
+        }
     }
 
-    memset(request, 0 , sizeof(rtsp_req_t));
+    return PARSER_NOMEM;
+}
+
+// Ready for the next request on the same connection, the previous request is gone
+int parser_reset(rtsp_parser_handle_t handle) {
+    rtsp_parser_state_t *state = (rtsp_parser_state_t *)handle;
 
-    state->request = request;
-    *handle = state;
+    state->parse_complete = false;
+    state->error = 0;
+    state->scanned = 0;
+    state->line_start = 0;
+    state->header_end = 0;
+    state->content_length = 0;
+    memset(&state->request, 0, sizeof(rtsp_req_t));
 
     return PARSER_OK;
 }
 
-int parse_request(rtsp_parser_handle_t handle, const char *buffer, const size_t len) {
-    if (!handle) {
+size_t parser_get_size() {
+    return sizeof(rtsp_parser_state_t);
+}
+
+static int parse_transport(rtsp_parser_state_t *state, char *value) {
+    rtsp_req_t *request = &state->request;
+    char *saveptr;
+
+    char *token = strtok_r(value, ";", &saveptr);
+    if (token != NULL && strcmp(token, "RTP/AVP/TCP") == 0) {
+        request->interleaved = true;
+    } else if (token == NULL || (strcmp(token, "RTP/AVP") != 0 && strcmp(token, "RTP/AVP/UDP") != 0)) {
+        ESP_LOGW(TAG, "Unsupported stream transport: %s", token);
+        return 461;
+    }
+
+    token = strtok_r(NULL, ";", &saveptr);
+    if (token != NULL && strcmp(token, "multicast") == 0 && !request->interleaved) {
+        // Destination, ports and ttl are chosen by the server, suggestions are ignored
+        request->multicast = true;
+    } else if (token == NULL || strcmp(token, "unicast") != 0) {
+        ESP_LOGW(TAG, "Unsupported direction transport: %s", token);
+        return 400;
+    }
+
+    token = strtok_r(NULL, ";", &saveptr);
+    if (request->interleaved) {
+        if (token == NULL || strncmp(token, "interleaved=", 12) != 0) {
+            ESP_LOGE(TAG, "Expected interleaved, got : %s", token);
+            return 400;
+        }
+
+        // The channels get a tokenizer of their own, like the client ports
+        char *channelptr;
+        char *channela = strtok_r(token+12, "-", &channelptr);
+        request->rtp_channel = channela ? safe_atoi(channela) : -1;
+
+        // The RTCP channel is optional, it defaults to the next one
+        char *channelb = strtok_r(NULL, "-", &channelptr);
+        request->rtcp_channel = channelb ? safe_atoi(channelb) : request->rtp_channel + 1;
+
+        if (request->rtp_channel < 0 || request->rtp_channel > 255 ||
+            request->rtcp_channel < 0 || request->rtcp_channel > 255) {
+            ESP_LOGW(TAG, "Invalid interleaved values: %s", token);
+            return 400;
+        }
+    } else if (!request->multicast) {
+        if (token == NULL || strncmp(token, "client_port=", 12) != 0) {
+            ESP_LOGE(TAG, "Expected client_port, got : %s", token);
+            return 400;
+        }
+
+        // The ports get a tokenizer of their own, the parameters after them are still to come
+        char *portptr;
+        char *porta = strtok_r(token+12, "-", &portptr);
+        request->dst_rtp_port = porta ? safe_atoi(porta) : -1;
+
+        // The RTCP port is optional, it defaults to the next one
+        char *portb = strtok_r(NULL, "-", &portptr);
+        request->dst_rtcp_port = portb ? safe_atoi(portb) : request->dst_rtp_port + 1;
+
+        if (request->dst_rtp_port < 0 || request->dst_rtcp_port < 0) {
+            ESP_LOGW(TAG, "Invalid client_port values: %s", token);
+            return 400;
+        }
+
+        // Only an explicit RTCP-mux puts RTCP on the RTP port (RFC 7826 section 18.54)
+        while ((token = strtok_r(NULL, ";", &saveptr)) != NULL) {
+            if (strcasecmp(token, "RTCP-mux") == 0) {
+                request->rtcp_mux = true;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int parse_request_line(rtsp_parser_state_t *state, char *line) {
+    rtsp_req_t *request = &state->request;
+
+    char *method = line;
+    char *url = strchr(method, ' ');
+    if (!url) {
+        ESP_LOGE(TAG, "No url in request line: %s", line);
+        return 400;
+    }
+    *url++ = 0x0;
+
+    char *protocol = strchr(url, ' ');
+    if (!protocol) {
+        ESP_LOGE(TAG, "No protocol in request line: %s", url);
+        return 400;
+    }
+    *protocol++ = 0x0;
+
+    for (char *c = method; *c; c++) {
+        if ((*c < 'A' || *c > 'Z') && *c != '_') {
+            ESP_LOGE(TAG, "Invalid character in method: %c", *c);
+            return 400;
+        }
+    }
+
+    if (strcmp(method, "OPTIONS") == 0) {
+        request->request_type = OPTIONS;
+    } else if (strcmp(method, "SETUP") == 0) {
+        request->request_type = SETUP;
+    } else if (strcmp(method, "DESCRIBE") == 0) {
+        request->request_type = DESCRIBE;
+    } else if (strcmp(method, "PLAY") == 0) {
+        request->request_type = PLAY;
+    } else if (strcmp(method, "TEARDOWN") == 0) {
+        request->request_type = TEARDOWN;
+    } else {
+        request->request_type = UNSUPPORTED;
+    }
+    ESP_LOGD(TAG, "Method: %d", request->request_type);
+
+    request->url = url;
+    request->url_length = protocol - url - 1;
+    ESP_LOGD(TAG, "Parsed url: %s", request->url);
+
+    if (strcmp(protocol, "RTSP/1.0") != 0) {
+        ESP_LOGW(TAG, "Only supporting RTSP/1.0 but got: %s", protocol);
+        return 400;
+    }
+
+    return 0;
+}
+
+static int parse_header(rtsp_parser_state_t *state, char *line) {
+    rtsp_req_t *request = &state->request;
+
+    char *header = line;
+    char *value = header;
+    while (*value != ':') {
+        if (!valid_header_name_char(*value)) {
+            ESP_LOGW(TAG, "Invalid characters in header name: %c", *value);
+            return 400;
+        }
+        value++;
+    }
+    *value++ = 0x0;
+
+    while (*value == ' ' || *value == '\t') {
+        value++;
+    }
+
+    ESP_LOGD(TAG, "Header> %s: %s", header, value);
+    if (strcasecmp(header, "cseq") == 0) {
+        char *end;
+        long lv = strtol(value, &end, 10);
+        if (*end != '\0' || lv < INT_MIN || lv > INT_MAX) {
+            ESP_LOGW(TAG, "Invalid numerical value for header %s: %s", header, value);
+            return 400;
+        }
+        request->cseq = (int)lv;
+    } else if (strcasecmp(header, "blocksize") == 0) {
+        // Only a hint, a value we can't use is ignored rather than refused
+        int blocksize = safe_atoi(value);
+        request->blocksize = blocksize > 0 ? blocksize : 0;
+    } else if (strcasecmp(header, "transport") == 0) {
+        return parse_transport(state, value);
+    }
+
+    return 0;
+}
+
+// The value of a Content-Length line, the line isn't terminated yet. Returns -1 when it isn't a length.
+static long parse_content_length(const char *value, const char *end) {
+    while (value < end && (*value == ' ' || *value == '\t')) {
+        value++;
+    }
+
+    long length = -1;
+    for (; value < end && *value >= '0' && *value <= '9'; value++) {
+        length = (length < 0 ? 0 : length * 10) + (*value - '0');
+        if (length > MAX_CONTENT_LENGTH) {
+            return -1;
+        }
+    }
+
+    while (value < end && (*value == ' ' || *value == '\t' || *value == '\r')) {
+        value++;
+    }
+    return value == end ? length : -1;
+}
+
+/* Finds the blank line that ends the headers and the body after it, which
+ * is as long as the Content-Length header says. The length is read while
+ * searching, the headers are only tokenized once the whole request is
+ * there. Returns the length of the request including the body, 0 while it
+ * hasn't arrived. Lines end in CRLF, a bare LF is accepted as well.
+ */
+static size_t find_request_end(rtsp_parser_state_t *state, const char *buffer, size_t len) {
+    for (size_t i = state->scanned; i < len && !state->header_end; i++) {
+        if (buffer[i] != '\n') {
+            continue;
+        }
+
+        const char *line = buffer + state->line_start;
+        size_t line_length = i - state->line_start;
+        if (line_length == 0 || (line_length == 1 && line[0] == '\r')) {
+            state->header_end = i + 1;
+            break;
+        }
+
+        if (line_length > 15 && strncasecmp(line, "content-length:", 15) == 0) {
+            long content_length = parse_content_length(line + 15, buffer + i);
+            if (content_length < 0) {
+                ESP_LOGW(TAG, "Invalid Content-Length: %.*s", (int) line_length, line);
+                state->error = 400;
+                content_length = 0;
+            }
+            state->content_length = content_length;
+        }
+        state->line_start = i + 1;
+    }
+    state->scanned = len;
+
+    if (!state->header_end || len - state->header_end < state->content_length) {
+        return 0;
+    }
+    return state->header_end + state->content_length;
+}
+
+/* Parses the request at the start of buffer, which holds len bytes. Returns
+ * 0 while the request or its body is incomplete, the caller keeps the bytes
+ * and calls again with the same start once more have arrived. Otherwise the
+ * request is complete, or failed with parser_get_error set, and the number
+ * of bytes it took, body included, is returned, anything after them is for
+ * the caller. The headers are tokenized in place, the buffer is modified.
+ */
+int parse_request(rtsp_parser_handle_t handle, char *buffer, const size_t len) {
+    if (!handle || !buffer) {
         ESP_LOGD(TAG, "Error; Invalid handle");
         return PARSER_INVALID_ARGS;
     }
     rtsp_parser_state_t *state = (rtsp_parser_state_t *)handle;
-    rtsp_req_t *request = state->request;
 
     if (state->parse_complete) {
         ESP_LOGD(TAG, "Error; Can't add data to completed request");
         return PARSER_INVALID_STATE;
     }
 
-    int position = 0;
-    int header_marker = 0;
-    int header_value_marker = 0;
-    for (int i = 0; i < len; i++) {
-        char current = buffer[i];
-        state->intermediate[state->intermediate_len + 1] = 0x0; // workaround
-//        ESP_LOGD(TAG, "Parsing '%c' at %d in state %d", current, position, state->state);
-//        ESP_LOGD(TAG, "Intermediate: %s (%d bytes)", state->intermediate, state->intermediate_len);
-
-        if (state->intermediate_len >= 1023) {
-            ESP_LOGE(TAG, "Parse failed, no space in intermediate buffer");
-            return PARSER_NOMEM;
+    size_t end = find_request_end(state, buffer, len);
+    if (!end || state->error) {
+        return end;
+    }
+
+    // The body is left as it is
+    char *headers_end = buffer + state->header_end;
+    char *line = buffer;
+    int first = true;
+    while (line < headers_end) {
+        char *line_end = memchr(line, '\n', headers_end - line);
+        *line_end = 0x0;
+        if (line_end > line && line_end[-1] == '\r') {
+            line_end[-1] = 0x0;
         }
 
-        // Handle CR/LF
-        if (current == '\r' && i < len - 1) {
-            current = buffer[i++];
-            position++;
+        if (*line == 0x0 && !first) {
+            break;
         }
 
-        switch(state->state) {
-            case RTSP_PARSER_PARSE_METHOD:
-                if (current == ' ') {
-                    if (strncmp(state->intermediate, "OPTIONS", min(state->intermediate_len,7)) == 0) {
-                        request->request_type = OPTIONS;
-                    } else if (strncmp(state->intermediate, "SETUP", min(state->intermediate_len,5)) == 0) {
-                        request->request_type = SETUP;
-                    } else if (strncmp(state->intermediate, "DESCRIBE", min(state->intermediate_len,8)) == 0) {
-                        request->request_type = DESCRIBE;
-                    } else if (strncmp(state->intermediate, "PLAY", min(state->intermediate_len,4)) == 0) {
-                        request->request_type = PLAY;
-                    } else if (strncmp(state->intermediate, "TEARDOWN", min(state->intermediate_len,8)) == 0) {
-                        request->request_type = TEARDOWN;
-                    } else {
-                        request->request_type = UNSUPPORTED;
-                    }
-
-                    state->state = RTSP_PARSER_PARSE_URL;
-                    state->intermediate_len = 0;
-                    position++;
-
-                    ESP_LOGD(TAG, "Method: %d", request->request_type);
-                    continue;
-                } else if ((current < 'A' || current > 'Z') && current != '_') {
-                    ESP_LOGE(TAG, "Invalid character in method: %c", current);
-                    state->error = 400;
-                    return i;
-                } else {
-                    state->intermediate[state->intermediate_len] = current;
-                    position++;
-                    state->intermediate_len++;
-                }
-                break;
-            case RTSP_PARSER_PARSE_URL:
-                if (current == ' ') {
-                    strncpy(request->url, state->intermediate, min(state->intermediate_len, URL_MAX_LENGTH));
-                    request->url[min(state->intermediate_len, URL_MAX_LENGTH)] = 0x0;
-                    ESP_LOGD(TAG, "Parsed url: %s", request->url);
-
-                    state->state = RTSP_PARSER_PARSE_PROTOCOL;
-                    state->intermediate_len = 0;
-                    position++;
-
-                    continue;
-                } else if (current == '\r' || current == '\n') {
-                    ESP_LOGE(TAG, "Invalid character in url: %c", current);
-                    state->error = 400;
-                    return i;
-                } else {
-                    state->intermediate[state->intermediate_len] = current;
-                    position++;
-                    state->intermediate_len++;
-                }
-                break;
-            case RTSP_PARSER_PARSE_PROTOCOL:
-                if (current == '\r' || current == '\n') {
-                    if (strncmp(state->intermediate, "RTSP/1.0", min(state->intermediate_len,9)) != 0) {
-                        ESP_LOGW(TAG, "Only supporting RTSP/1.0 but got: %s", state->intermediate);
-                        state->error = 400;
-                    }
-
-                    state->state = RTSP_PARSER_OPTIONAL_HEADER;
-                    state->intermediate_len = 0;
-                    position++;
-                } else {
-                    state->intermediate[state->intermediate_len] = current;
-                    position++;
-                    state->intermediate_len++;
-                }
-                break;
-            case RTSP_PARSER_OPTIONAL_HEADER:
-                if (current == '\r' || current == '\n') {
-                    ESP_LOGD(TAG, "Setting parse_complete");
-                    state->parse_complete = true;
-                    return len;
-                }
-            case RTSP_PARSER_PARSE_HEADER:
-                if (current == ':') {
-                    state->intermediate[state->intermediate_len] = 0x0;
-                    position++;
-                    state->intermediate_len++;
-                    header_marker = 0;
-                    header_value_marker = state->intermediate_len;
-                    state->state = RTSP_PARSER_PARSE_HEADER_WS;
-                } else if (!valid_header_name_char(current)) {
-                    ESP_LOGW(TAG, "Invalid characters in header name: %c", current);
-                    state->error = 400;
-                    return i;
-                } else {
-                    state->intermediate[state->intermediate_len] = current;
-                    position++;
-                    state->intermediate_len++;
-                }
-                break;
-            case RTSP_PARSER_PARSE_HEADER_WS:
-                if (current == ' ') {
-                    state->state = RTSP_PARSER_PARSE_HEADER_VALUE;
-                    continue;
-                }
-                ESP_LOGW(TAG, "Unexpected character in header: %c", current);
-                state->error = 400;
-                return i;
-            case RTSP_PARSER_PARSE_HEADER_VALUE:
-                if (current == '\r' || current == '\n') {
-                    char *header = state->intermediate + header_marker;
-                    char *value = state->intermediate + header_value_marker;
-
-                    ESP_LOGD(TAG, "Header> %s: %s", header, value);
-                    if (strcasecmp(header, "cseq") == 0) {
-                        char *end;
-                        long lv = strtol(value, &end, 10);
-                        if (*end != '\0' || lv < INT_MIN || lv > INT_MAX) {
-                            ESP_LOGW(TAG, "Invalid numerical value for header %s: %s", header, value);
-                            state->error = 400;
-                            return i;
-                        }
-                        request->cseq = (int)lv;
-                    } else if (strcasecmp(header, "transport") == 0) {
-                        char *saveptr;
-
-                        char *token = strtok_r(value, ";", &saveptr);
-                        if (token == NULL || strcmp(token, "RTP/AVP") != 0) {
-                            ESP_LOGW(TAG, "Unsupported stream transport: %s", token);
-                            state->error = 461;
-                            return i;
-                        }
-
-                        token = strtok_r(NULL, ";", &saveptr);
-                        if (token == NULL || strcmp(token, "unicast") != 0) {
-                            ESP_LOGW(TAG, "Unsupported direction transport: %s", token);
-                            state->error = 400;
-                            return i;
-                        }
-
-                        token = strtok_r(NULL, ";", &saveptr);
-                        if (token == NULL || strncmp(token, "client_port=", min(strlen(token), 7)) != 0) {
-                            ESP_LOGE(TAG, "Expected client_port, got : %s", token);
-                            state->error = 400;
-                            return i;
-                        }
-
-                        char *porta = strtok_r(token+12, "-", &saveptr);
-                        request->dst_rtp_port = safe_atoi(porta);
-
-                        char *portb = strtok_r(NULL, "-", &saveptr);
-                        request->dst_rtcp_port = safe_atoi(portb);
-
-                        if (request->dst_rtp_port < 0 || request->dst_rtcp_port < 0) {
-                            ESP_LOGW(TAG, "Invalid client_port values: %s", token);
-                            state->error = 400;
-                            return i;
-                        }
-
-                    }
-                    state->state = RTSP_PARSER_OPTIONAL_HEADER;
-                    state->intermediate_len = 0;
-                    position++;
-                } else {
-                    state->intermediate[state->intermediate_len] = current;
-                    position++;
-                    state->intermediate_len++;
-                }
-                break;
-
-            default:
-                continue;
-        };
+        int error = first ? parse_request_line(state, line) : parse_header(state, line);
+        if (error) {
+            state->error = error;
+            return end;
+        }
+
+        first = false;
+        line = line_end + 1;
     }
-    return len;
-};
+
+    ESP_LOGD(TAG, "Setting parse_complete");
+    state->parse_complete = true;
+    return end;
+}
 
 int parser_free(rtsp_parser_handle_t handle) {
     rtsp_parser_state_t *state = (rtsp_parser_state_t *)handle;
 
-    state->request = NULL; // Freeing request is left to the caller
-    free(state);
+    state->in_use = false;
 
     return 0;
 }
@@ -305,5 +409,5 @@ int parser_is_complete(rtsp_parser_handle_t handle) {
 rtsp_req_t *parser_get_request(rtsp_parser_handle_t handle) {
     rtsp_parser_state_t *state = (rtsp_parser_state_t *)handle;
 
-    return state->request;
+    return &state->request;
 }
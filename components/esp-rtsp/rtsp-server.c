@@ -1,183 +1,517 @@
 //
 // Created by Hugo Trippaers on 17/05/2021.
 //
+#include <stdarg.h>
 #include <sys/param.h>
 #include "esp_log.h"
+#include "esp_timer.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 
 #include "lwip/err.h"
 #include "lwip/sockets.h"
 
 #include "esp-rtsp-common.h"
 #include "rtp-udp.h"
+#include "rtp-pacer.h"
+#include "rtcp.h"
+#include "rtsp-timer.h"
+#include "rtsp-output.h"
+#include "rtp-adapt.h"
 
-#include "esp_camera.h"
+#include "esp-frame.h"
 
 #define TAG "rtsp-server"
 
-#define PORT 554  // IANA default for RTSP
-
 #define KEEPALIVE_IDLE              5
 #define KEEPALIVE_INTERVAL          5
 #define KEEPALIVE_COUNT             3
 
-#define MAX_CLIENTS 3
+#define FRAME_INTERVAL_MS 200        // Highest frame rate
+#define FRAME_MAX_INTERVAL_MS 2000   // Lowest frame rate when sending can't keep up
+#define CLOCK_LOG_INTERVAL_FRAMES 100
+
+// Largest RTCP packet kept from an interleaved frame, anything larger is skipped
+#define INTERLEAVED_PACKET_SIZE 512
+
+#define PLAYER_STACKSIZE 4096
+#define PLAYER_PRIORITY 6
 
-typedef struct {
+// Longest the server loop sleeps without timers, also how long a stop request can take
+#define SERVER_POLL_MS 1000
+
+typedef struct esp_rtsp_server_connection {
     int connection_active;
     int socket;
     char client_addr_string[128];
     rtsp_parser_handle_t parser;
     esp_rtp_session_handle_t rtp_session;
-    TaskHandle_t rtp_player_task;
+    int playing;
+    int interleaved;                // RTP and RTCP are sent on this connection
+    int multicast;                  // rtp_session is the shared multicast session
+
+    // Bytes read and not handled yet, a partial request stays here until the rest arrives
+    char *receive_buffer;
+    size_t receive_length;
+
+    // Responses not written yet, requests wait in the receive buffer until these are out
+    rtsp_output_t output;
+
+    // Interleaved frame from the client, '$', channel and a 16 bit length followed by the packet
+    uint8_t interleaved_header[4];
+    size_t interleaved_header_length;
+    size_t interleaved_received;
+    uint8_t interleaved_packet[INTERLEAVED_PACKET_SIZE];
+
+    struct esp_rtsp_server_connection *next_free;
 } esp_rtsp_server_connection_t;
 
-esp_rtsp_server_connection_t connections[MAX_CLIENTS];
+// The connection table is sized from the config when the server starts, free slots are kept in a list
+static esp_rtsp_server_connection_t *connections;
+static size_t max_connections;
+static esp_rtsp_server_connection_t *free_connections;
+
+// Connections playing, the player task only looks at this count and not at the table
+static volatile int playing_connections;
+
+static TaskHandle_t rtp_player_task;
+
+// The server loop's timers, RTCP schedules its reports here
+static rtsp_timer_wheel_t timers;
+static volatile int stopping;
+
+// One RTP session serves every multicast viewer, only used from the server task
+static esp_rtp_session_handle_t multicast_session;
+static int multicast_connections;   // Connections set up for multicast
+static int multicast_viewers;       // Of those, the ones playing
 
 static int esp_rtsp_handle_error(esp_rtsp_server_connection_t *, int);
 
+// Responses without variable parts, queued as they are
+static const char RESPONSE_BAD_REQUEST[] = "RTSP/1.0 400 Bad Request\r\n\r\n";
+static const char RESPONSE_METHOD_NOT_ALLOWED[] = "RTSP/1.0 405 Method Not Allowed\r\n"
+                                                  "Server: ESP32 Cam Server\r\n"
+                                                  "Allow: OPTIONS, DESCRIBE, SETUP, TEARDOWN, PLAY, PAUSE\r\n"
+                                                  "\r\n";
+static const char RESPONSE_TOO_LARGE[] = "RTSP/1.0 413 Request Entity Too Large\r\n\r\n";
+static const char RESPONSE_INVALID_STATE[] = "RTSP/1.0 455 Method Not Valid in This State\r\n\r\n";
+static const char RESPONSE_UNSUPPORTED_TRANSPORT[] = "RTSP/1.0 461 Unsupported Transport\r\n\r\n";
+static const char RESPONSE_INTERNAL_ERROR[] = "RTSP/1.0 500 Internal Server Error\r\n\r\n";
+
+static const struct {
+    int code;
+    const char *response;
+    size_t length;
+} error_responses[] = {
+        { 400, RESPONSE_BAD_REQUEST, sizeof(RESPONSE_BAD_REQUEST) - 1 },
+        { 405, RESPONSE_METHOD_NOT_ALLOWED, sizeof(RESPONSE_METHOD_NOT_ALLOWED) - 1 },
+        { 413, RESPONSE_TOO_LARGE, sizeof(RESPONSE_TOO_LARGE) - 1 },
+        { 455, RESPONSE_INVALID_STATE, sizeof(RESPONSE_INVALID_STATE) - 1 },
+        { 461, RESPONSE_UNSUPPORTED_TRANSPORT, sizeof(RESPONSE_UNSUPPORTED_TRANSPORT) - 1 },
+        { 500, RESPONSE_INTERNAL_ERROR, sizeof(RESPONSE_INTERNAL_ERROR) - 1 },
+};
+
+/* Queues a response on the connection, it goes out when the server loop
+ * flushes the connection. A response that doesn't fit marks the output as
+ * overflowed, the connection is closed after the request.
+ */
+static void rtsp_server_respond(esp_rtsp_server_connection_t *connection, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    size_t length;
+    char *response = rtsp_output_vformat(&connection->output, &length, format, args);
+    va_end(args);
+
+    if (!response) {
+        ESP_LOGW(TAG, "No room for the response to %s", connection->client_addr_string);
+        return;
+    }
+
+    ESP_LOGI(TAG, "RTSP >: %.*s", length, response);
+    rtsp_output_queue(&connection->output, response, length);
+}
+
+/* Writes as much of the queued responses as the socket takes without
+ * waiting, the rest is written when select finds the socket writable.
+ */
+static esp_err_t rtsp_server_flush(esp_rtsp_server_connection_t *connection) {
+    while (rtsp_output_pending(&connection->output)) {
+        struct iovec *iov;
+        int iovcnt = rtsp_output_peek(&connection->output, &iov);
+
+        ssize_t sent;
+        if (connection->interleaved && connection->rtp_session) {
+            // The sender task writes RTP to the same socket, take turns on packet boundaries
+            sent = esp_rtp_interleaved_writev(connection->rtp_session, iov, iovcnt);
+        } else {
+            struct msghdr msg = {
+                    .msg_iov = iov,
+                    .msg_iovlen = iovcnt,
+            };
+            sent = sendmsg(connection->socket, &msg, MSG_DONTWAIT);
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOMEM)) {
+                sent = 0;
+            }
+        }
+
+        if (sent < 0) {
+            ESP_LOGW(TAG, "Failed to send to %s: errno %d", connection->client_addr_string, errno);
+            return ESP_FAIL;
+        }
+
+        if (sent == 0) {
+            return ESP_OK;
+        }
+
+        rtsp_output_consume(&connection->output, sent);
+    }
+
+    return ESP_OK;
+}
+
 static void handle_options(esp_rtsp_server_connection_t *connection, rtsp_req_t *request) {
-    char buffer[2048];
-    size_t msgsize = snprintf(buffer, 2048,
-                              "RTSP/1.0 200 OK\r\n"
-                              "cSeq: %d\r\n"
-                              "Public: OPTIONS, DESCRIBE, SETUP, TEARDOWN, PLAY, PAUSE\r\n"
-                              "Server: ESP32 Cam Server\r\n"
-                              "\r\n",
-                              request->cseq);
-    size_t sent = send(connection->socket, buffer, msgsize, 0);
-    ESP_LOGI(TAG, "RTSP >: %s", buffer);
-    if (sent != msgsize) {
-        ESP_LOGW(TAG, "Mismatch between msgsize and sent bytes: %d vs %d", msgsize, sent);
+    rtsp_server_respond(connection,
+                        "RTSP/1.0 200 OK\r\n"
+                        "cSeq: %d\r\n"
+                        "Public: OPTIONS, DESCRIBE, SETUP, TEARDOWN, PLAY, PAUSE\r\n"
+                        "Server: ESP32 Cam Server\r\n"
+                        "\r\n",
+                        request->cseq);
+}
+
+static void handle_setup_interleaved(esp_rtsp_server_connection_t *connection, rtsp_req_t *request) {
+    if (request->rtp_channel == request->rtcp_channel) {
+        ESP_LOGW(TAG, "RTP and RTCP on the same interleaved channel %d", request->rtp_channel);
+        esp_rtsp_handle_error(connection, 461);
+        return;
+    }
+
+    if (connection->rtp_session) {
+        // The RTSP connection can carry a single interleaved session
+        ESP_LOGW(TAG, "SETUP of %s with a rtp session already set up", connection->client_addr_string);
+        esp_rtsp_handle_error(connection, 455);
+        return;
     }
+
+    // The transport was acceptable, anything failing now is on our side
+    esp_err_t err = esp_rtp_init_interleaved(&connection->rtp_session, connection->socket, request->rtp_channel, request->rtcp_channel);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to initialize the interleaved rtp connection: %d", err);
+        esp_rtsp_handle_error(connection, 500);
+        return;
+    }
+    connection->interleaved = true;
+
+    rtsp_server_respond(connection,
+                        "RTSP/1.0 200 OK\r\n"
+                        "cSeq: %d\r\n"
+                        "Transport: RTP/AVP/TCP;unicast;interleaved=%d-%d\r\n"
+                        "Session: 12348765\r\n"
+                        "\r\n",
+                        request->cseq,
+                        request->rtp_channel,
+                        request->rtcp_channel);
+}
+
+static void handle_setup_multicast(esp_rtsp_server_connection_t *connection, rtsp_req_t *request) {
+#ifdef CONFIG_ESP_RTSP_MULTICAST
+    if (connection->rtp_session && !connection->multicast) {
+        ESP_LOGW(TAG, "Multicast SETUP of %s with a rtp session already set up", connection->client_addr_string);
+        esp_rtsp_handle_error(connection, 455);
+        return;
+    }
+
+    // Later viewers attach to the running session
+    if (!multicast_session && esp_rtp_init_multicast(&multicast_session, CONFIG_ESP_RTSP_MULTICAST_GROUP,
+                                                     CONFIG_ESP_RTSP_MULTICAST_PORT, CONFIG_ESP_RTSP_MULTICAST_TTL) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to initialize the multicast rtp session");
+        esp_rtsp_handle_error(connection, 461);
+        return;
+    }
+
+    // A repeated SETUP gets the same answer, the connection is counted once
+    if (!connection->multicast) {
+        multicast_connections++;
+        connection->rtp_session = multicast_session;
+        connection->multicast = true;
+    }
+
+    rtsp_server_respond(connection,
+                        "RTSP/1.0 200 OK\r\n"
+                        "cSeq: %d\r\n"
+                        "Transport: RTP/AVP;multicast;destination=%s;port=%d-%d;ttl=%d\r\n"
+                        "Session: 12348765\r\n"
+                        "\r\n",
+                        request->cseq,
+                        CONFIG_ESP_RTSP_MULTICAST_GROUP,
+                        CONFIG_ESP_RTSP_MULTICAST_PORT,
+                        CONFIG_ESP_RTSP_MULTICAST_PORT + 1,
+                        CONFIG_ESP_RTSP_MULTICAST_TTL);
+#else
+    ESP_LOGW(TAG, "Multicast is disabled");
+    esp_rtsp_handle_error(connection, 461);
+#endif
 }
 
 static void handle_setup(esp_rtsp_server_connection_t *connection, rtsp_req_t *request) {
-    int err = esp_rtp_init(&connection->rtp_session, request->dst_rtp_port, request->dst_rtcp_port, connection->client_addr_string);
-    if (err < 0) {
+    if (request->interleaved) {
+        handle_setup_interleaved(connection, request);
+        return;
+    }
+
+    if (request->multicast) {
+        handle_setup_multicast(connection, request);
+        return;
+    }
+
+    if (connection->rtp_session) {
+        ESP_LOGW(TAG, "SETUP of %s with a rtp session already set up", connection->client_addr_string);
+        esp_rtsp_handle_error(connection, 455);
+        return;
+    }
+
+    int err = esp_rtp_init(&connection->rtp_session, request->dst_rtp_port, request->dst_rtcp_port, request->rtcp_mux,
+                           connection->client_addr_string);
+    if (err != ESP_OK) {
         ESP_LOGW(TAG, "Failed to initialize the rtp connection");
+        esp_rtsp_handle_error(connection, 500);
+        return;
     }
 
-    char buffer[2048];
-    size_t msgsize = snprintf(buffer, 2048,
-                              "RTSP/1.0 200 OK\r\n"
-                              "cSeq: %d\r\n"
-                              "Transport: RTP/AVP;unicast;client_port=%d-%d;server_port=%d-%d\r\n"
-                              "Session: 12348765\r\n"
-                              "\r\n",
-                              request->cseq,
-                              request->dst_rtp_port,
-                              request->dst_rtcp_port,
-                              esp_rtp_get_src_rtp_port(connection->rtp_session),
-                              esp_rtp_get_src_rtcp_port(connection->rtp_session));
-    size_t sent = send(connection->socket, buffer, msgsize, 0);
-    ESP_LOGI(TAG, "RTSP >: %s", buffer);
-    if (sent != msgsize) {
-        ESP_LOGW(TAG, "Mismatch between msgsize and sent bytes: %d vs %d", msgsize, sent);
+    if (request->blocksize) {
+        // Blocksize leaves out the RTP header (RFC 2326 section 12.7)
+        esp_rtp_set_max_payload_size(connection->rtp_session, request->blocksize + RTP_HEADER_SIZE);
+    }
+
+    if (request->rtcp_mux) {
+        // RTCP is multiplexed on the RTP ports (RFC 5761)
+        rtsp_server_respond(connection,
+                            "RTSP/1.0 200 OK\r\n"
+                            "cSeq: %d\r\n"
+                            "Transport: RTP/AVP;unicast;client_port=%d;server_port=%d;RTCP-mux\r\n"
+                            "Session: 12348765\r\n"
+                            "\r\n",
+                            request->cseq,
+                            request->dst_rtp_port,
+                            esp_rtp_get_src_rtp_port(connection->rtp_session));
+    } else {
+        rtsp_server_respond(connection,
+                            "RTSP/1.0 200 OK\r\n"
+                            "cSeq: %d\r\n"
+                            "Transport: RTP/AVP;unicast;client_port=%d-%d;server_port=%d-%d\r\n"
+                            "Session: 12348765\r\n"
+                            "\r\n",
+                            request->cseq,
+                            request->dst_rtp_port,
+                            request->dst_rtcp_port,
+                            esp_rtp_get_src_rtp_port(connection->rtp_session),
+                            esp_rtp_get_src_rtcp_port(connection->rtp_session));
     }
 }
 
+/* The SDP is formatted first and the header after it, once the length is
+ * known. Both stay in the output buffer and go out in one write.
+ */
 static void handle_describe(esp_rtsp_server_connection_t *connection, rtsp_req_t *request) {
-    static char sdp[2048];
-    size_t sdp_size = snprintf(sdp, 2048,
-                               "v=0\r\n"
-                               "o=- %d 1 IN IP4 %s\r\n"
-                               "s=\r\n"
-                               "t=0 0\r\n"
-                               "m=video 0 RTP/AVP 26\r\n"
-                               "c=IN IP4 0.0.0.0\r\n",
-                               12348765,
-                               "192.168.168.135");
-
-    static char buffer[2048];
-    size_t msgsize = snprintf(buffer, 2048,
-                              "RTSP/1.0 200 OK\r\n"
-                              "cSeq: %d\r\n"
-                              "Content-Type: application/sdp\r\n"
-                              "Content-Base: %s\r\n"
-                              "Server: ESP32 Cam Server\r\n"
-                              "Content-Length: %d\r\n"
-                              "\r\n",
-                              request->cseq,
-                              request->url,
-                              sdp_size);
-
-    // Send header
-    size_t sent = send(connection->socket, buffer, msgsize, 0);
-    ESP_LOGI(TAG, "RTSP >: %s", buffer);
-    if (sent != msgsize) {
-        ESP_LOGW(TAG, "Mismatch between msgsize and sent bytes: %d vs %d", msgsize, sent);
-    }
-
-    // Send body
-    sent = send(connection->socket, sdp, sdp_size, 0);
-    ESP_LOGI(TAG, "RTSP >: %s", sdp);
-    if (sent != sdp_size) {
-        ESP_LOGW(TAG, "Mismatch between sdp_size and sent bytes: %d vs %d", sdp_size, sent);
+    rtsp_output_t *output = &connection->output;
+    size_t length = 0;
+
+    char *sdp = rtsp_output_format(output, &length,
+                                   "v=0\r\n"
+                                   "o=- %d 1 IN IP4 %s\r\n"
+                                   "s=\r\n"
+                                   "t=0 0\r\n",
+                                   12348765,
+                                   "192.168.168.135");
+    size_t sdp_size = length;
+
+#ifdef CONFIG_ESP_RTSP_FEC
+    // Offer the FEC payload type next to JPEG, clients without ulpfec support ignore it
+    sdp_size += rtsp_output_format(output, &length,
+                                   "m=video 0 RTP/AVP 26 %d\r\n"
+                                   "c=IN IP4 0.0.0.0\r\n"
+                                   "a=rtpmap:26 JPEG/90000\r\n"
+                                   "a=rtpmap:%d ulpfec/90000\r\n",
+                                   CONFIG_ESP_RTSP_FEC_PAYLOAD_TYPE, CONFIG_ESP_RTSP_FEC_PAYLOAD_TYPE) ? length : 0;
+#else
+    sdp_size += rtsp_output_format(output, &length,
+                                   "m=video 0 RTP/AVP 26\r\n"
+                                   "c=IN IP4 0.0.0.0\r\n") ? length : 0;
+#endif
+
+#ifdef CONFIG_ESP_RTSP_NACK
+    sdp_size += rtsp_output_format(output, &length, "a=rtcp-fb:26 nack\r\n") ? length : 0;
+#endif
+
+    // The RTP/JPEG header can't describe frames this large, tell the client out of band
+    uint16_t width, height;
+    if (esp_frame_source_get_dimensions(&width, &height) == ESP_OK &&
+        (width > RTP_JPEG_MAX_DIMENSION || height > RTP_JPEG_MAX_DIMENSION)) {
+        sdp_size += rtsp_output_format(output, &length,
+                                       "a=x-dimensions:%d,%d\r\n", width, height) ? length : 0;
     }
-}
 
-void temporary_player_task(void *pvParameters) {
-    if (!pvParameters) {
-        ESP_LOGE("rtp_server", "Invalid arguments");
-        vTaskDelete(NULL);
+    if (!sdp || output->overflow) {
+        ESP_LOGW(TAG, "No room for the session description for %s", connection->client_addr_string);
         return;
     }
 
-    esp_rtp_session_t *session = pvParameters;
+    rtsp_server_respond(connection,
+                        "RTSP/1.0 200 OK\r\n"
+                        "cSeq: %d\r\n"
+                        "Content-Type: application/sdp\r\n"
+                        "Content-Base: %.*s\r\n"
+                        "Server: ESP32 Cam Server\r\n"
+                        "Content-Length: %d\r\n"
+                        "\r\n",
+                        request->cseq,
+                        (int) request->url_length, request->url,
+                        sdp_size);
+    if (output->overflow) {
+        return;
+    }
 
-    int rate = 200; // delta ms between frames
+    ESP_LOGI(TAG, "RTSP >: %.*s", sdp_size, sdp);
+    rtsp_output_queue(output, sdp, sdp_size);
+}
+
+static void rtp_player_unsubscribe(esp_frame_subscription_handle_t *subscription, esp_frame_mailbox_handle_t mailbox) {
+    if (*subscription) {
+        esp_frame_unsubscribe(*subscription);
+        *subscription = NULL;
+    }
+
+    // Release a frame that arrived after the last session stopped
+    esp_frame_unref(esp_frame_mailbox_take(mailbox, 0));
+}
+
+/* Receives frames from the frame source while there are sessions playing,
+ * packetizes each frame once and fans the packets out to every session.
+ */
+static void rtp_player_task_main(void *pvParameters) {
+    esp_frame_mailbox_handle_t mailbox;
+    ESP_ERROR_CHECK(esp_frame_mailbox_create(&mailbox));
+    esp_frame_subscription_handle_t subscription = NULL;
 
     for (;;) {
-        long timestamp_start = esp_timer_get_time();
-        camera_fb_t *fb = esp_camera_fb_get();
-        if (!fb) {
-            ESP_LOGE(TAG, "Camera Capture Failed");
-            goto done;
+        if (!playing_connections) {
+            rtp_player_unsubscribe(&subscription, mailbox);
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+
+        if (!subscription) {
+            if (esp_frame_subscribe(FRAME_INTERVAL_MS, esp_frame_mailbox_handler, mailbox, &subscription) != ESP_OK) {
+                ESP_LOGE(TAG, "Failed to subscribe to frames");
+                vTaskDelay(pdMS_TO_TICKS(1000));
+                continue;
+            }
+            esp_frame_set_adaptive(subscription, FRAME_MAX_INTERVAL_MS);
+        }
+
+        esp_frame_t *frame = esp_frame_mailbox_take(mailbox, pdMS_TO_TICKS(1000));
+        if (!frame) {
+            continue;
+        }
+
+        esp_frame_clock_stats_t clock_stats;
+        esp_frame_get_clock_stats(subscription, &clock_stats);
+
+        // Each session only keeps the latest frame, the pacer sends it when the session is ready
+        int overrun = false;
+        if (esp_rtp_pacer_offer_frame(frame, clock_stats.interval_us / 1000, &overrun) == ESP_OK && overrun) {
+            // The previous frame didn't get out within the interval, slow down
+            esp_frame_report_overrun(subscription);
         }
 
-        esp_rtp_send_jpeg(session, fb->buf, fb->len);
+        if (clock_stats.frames % CLOCK_LOG_INTERVAL_FRAMES == 0) {
+            ESP_LOGI(TAG, "Frame clock: interval %u us, achieved %u.%03u fps, jitter %u us, %u overruns",
+                     clock_stats.interval_us, clock_stats.achieved_fps_milli / 1000, clock_stats.achieved_fps_milli % 1000,
+                     clock_stats.jitter_us, clock_stats.overruns);
+        }
 
-        //return the frame buffer back to the driver for reuse
-        esp_camera_fb_return(fb);
+        // The packetized frame holds its own reference until the last packet is sent
+        esp_frame_unref(frame);
+    }
+}
 
-        done:
-        {
-            long timestamp_end = esp_timer_get_time();
+static void rtsp_server_connection_stop_playing(esp_rtsp_server_connection_t *connection) {
+    if (connection->playing) {
+        // The multicast session keeps going while anyone is watching
+        if (!connection->multicast || --multicast_viewers == 0) {
+            esp_rtp_pacer_remove_session(connection->rtp_session);
+            esp_rtcp_remove_session(connection->rtp_session);
+        }
+        connection->playing = false;
+        playing_connections--;
+    }
 
-            long delta_ms = (timestamp_end - timestamp_start) / 1000;
-            if (delta_ms >= rate) {
-                rate += 50;
-            } else {
-                vTaskDelay(pdMS_TO_TICKS(rate - delta_ms));
+    if (connection->rtp_session) {
+        if (connection->interleaved) {
+            // Requests are only handled with the output empty, the rest of a packet on the wire goes out first
+            size_t rest_length;
+            const uint8_t *rest = esp_rtp_interleaved_stop(connection->rtp_session, &rest_length);
+            char *copy = rest ? rtsp_output_copy(&connection->output, rest, rest_length) : NULL;
+            if (copy) {
+                rtsp_output_queue(&connection->output, copy, rest_length);
+            } else if (rest) {
+                ESP_LOGW(TAG, "No room for the end of a packet to %s", connection->client_addr_string);
             }
+            esp_rtp_socket_set_dscp(connection->socket, CONFIG_ESP_RTSP_CONTROL_DSCP);
+        }
+
+        if (!connection->multicast) {
+            esp_rtp_teardown(connection->rtp_session);
+        } else if (--multicast_connections == 0) {
+            esp_rtp_teardown(multicast_session);
+            multicast_session = NULL;
         }
+        connection->rtp_session = NULL;
+        connection->interleaved = false;
+        connection->multicast = false;
     }
 }
 
 static void handle_play(esp_rtsp_server_connection_t *connection, rtsp_req_t *request) {
-    BaseType_t result = xTaskCreate(temporary_player_task, "rtp_server", 2024, connection->rtp_session, 6, &connection->rtp_player_task);
-    if (result != pdPASS) {
-        ESP_LOGE(TAG, "Failed to create rtp server task: %d", result);
-        send(connection->socket, "RTSP/1.0 500 Internal Server Error\r\n\r\n", 38, 0);
+    if (!connection->rtp_session) {
+        ESP_LOGW(TAG, "PLAY without a rtp session");
+        esp_rtsp_handle_error(connection, 455);
         return;
     }
 
-    static char buffer[2048];
-    size_t msgsize = snprintf(buffer, 2048,
-                              "RTSP/1.0 200 OK\r\n"
-                              "cSeq: %d\r\n"
-                              "Session: %d\r\n"
-                              "Server: ESP32 Cam Server\r\n"
-                              "Range: npt=0.000-\r\n"
-                              "\r\n",
-                              request->cseq,
-                              12348765);
+    // Only the first multicast viewer starts the shared session
+    if (!connection->playing && (!connection->multicast || multicast_viewers == 0)) {
+        if (esp_rtp_pacer_add_session(connection->rtp_session) != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to add session to the rtp pacer");
+            esp_rtsp_handle_error(connection, 500);
+            return;
+        }
 
-    size_t sent = send(connection->socket, buffer, msgsize, 0);
-    ESP_LOGI(TAG, "RTSP >: %s", buffer);
-    if (sent != msgsize) {
-        ESP_LOGW(TAG, "Mismatch between msgsize and sent bytes: %d vs %d", msgsize, sent);
+        if (esp_rtcp_add_session(connection->rtp_session) != ESP_OK) {
+            // Streaming works without RTCP, the client just doesn't get sender reports
+            ESP_LOGW(TAG, "Failed to add session to rtcp");
+        }
+    }
+
+    if (!connection->playing) {
+        if (connection->multicast) {
+            multicast_viewers++;
+        }
+        connection->playing = true;
+        playing_connections++;
     }
+    xTaskNotifyGive(rtp_player_task);
+
+    rtsp_server_respond(connection,
+                        "RTSP/1.0 200 OK\r\n"
+                        "cSeq: %d\r\n"
+                        "Session: %d\r\n"
+                        "Server: ESP32 Cam Server\r\n"
+                        "Range: npt=0.000-\r\n"
+                        "\r\n",
+                        request->cseq,
+                        12348765);
 }
 
 static void handle_teardown(esp_rtsp_server_connection_t *connection, rtsp_req_t *request) {
@@ -186,29 +520,14 @@ static void handle_teardown(esp_rtsp_server_connection_t *connection, rtsp_req_t
         return;
     }
 
-    if (connection->rtp_player_task) {
-        vTaskDelete(connection->rtp_player_task);
-        connection->rtp_player_task = NULL;
-    }
+    rtsp_server_connection_stop_playing(connection);
 
-    if (connection->rtp_session) {
-        esp_rtp_teardown(connection->rtp_session);
-        connection->rtp_session = NULL;
-    }
-
-    static char buffer[2048];
-    size_t msgsize = snprintf(buffer, 2048,
-                              "RTSP/1.0 200 OK\r\n"
-                              "cSeq: %d\r\n"
-                              "Server: ESP32 Cam Server\r\n"
-                              "\r\n",
-                              request->cseq);
-
-    size_t sent = send(connection->socket, buffer, msgsize, 0);
-    ESP_LOGI(TAG, "RTSP >: %s", buffer);
-    if (sent != msgsize) {
-        ESP_LOGW(TAG, "Mismatch between msgsize and sent bytes: %d vs %d", msgsize, sent);
-    }
+    rtsp_server_respond(connection,
+                        "RTSP/1.0 200 OK\r\n"
+                        "cSeq: %d\r\n"
+                        "Server: ESP32 Cam Server\r\n"
+                        "\r\n",
+                        request->cseq);
 }
 
 static int rtsp_server_connection_close(esp_rtsp_server_connection_t *connection) {
@@ -217,40 +536,36 @@ static int rtsp_server_connection_close(esp_rtsp_server_connection_t *connection
         return 0;
     }
 
-    if (connection->parser) {
-        rtsp_req_t *request = parser_get_request(connection->parser);
-        parser_free(connection->parser);
-        if (request) {
-            free(request);
-        }
-    }
-
-    if (connection->rtp_player_task) {
-        vTaskDelete(connection->rtp_player_task);
-    }
-
-    if (connection->rtp_session) {
-        esp_rtp_teardown(connection->rtp_session);
-    }
+    rtsp_server_connection_stop_playing(connection);
 
     connection->connection_active = false;
     shutdown(connection->socket, 0);
     close(connection->socket);
 
+    // The buffers and the parser belong to the slot, they are kept for the next connection
+    char *receive_buffer = connection->receive_buffer;
+    char *output_buffer = connection->output.buffer;
+    rtsp_parser_handle_t parser = connection->parser;
     memset(connection, 0, sizeof(esp_rtsp_server_connection_t));
+    connection->receive_buffer = receive_buffer;
+    connection->output.buffer = output_buffer;
+    connection->parser = parser;
+    parser_reset(parser);
+
+    connection->next_free = free_connections;
+    free_connections = connection;
 
     return 0;
 }
 
-static int esp_rtsp_server_read_block(esp_rtsp_server_connection_t *connection) {
-    char buffer[1024];
+static int esp_rtsp_server_read_block(esp_rtsp_server_connection_t *connection, char *buffer, size_t length) {
     if (!connection->connection_active) {
         return -1;
     }
 
     int sock = connection->socket;
 
-    int n = read(sock, buffer, 1023);
+    int n = read(sock, buffer, length);
     if (n < 0) {
         if (errno == EWOULDBLOCK || errno == EAGAIN) {
             ESP_LOGW(TAG, "Receive timeout");
@@ -265,17 +580,45 @@ static int esp_rtsp_server_read_block(esp_rtsp_server_connection_t *connection)
         return n;
     }
 
-    buffer[n] = 0x0;
+    ESP_LOGI(TAG, "RTSP < (%d bytes): %.*s", n, n, buffer);
 
-    ESP_LOGI(TAG, "RTSP < (%d bytes): %s", n, buffer);
+    return n;
+}
 
-    if (parse_request(connection->parser, buffer, n) < 0) {
-        ESP_LOGE(TAG, "Error parsing request");
-        return -1;
+/* Collects an interleaved frame from the client between requests. RTCP on
+ * the session's channel goes to the RTCP handler, anything else is skipped.
+ * Returns the number of bytes used from the buffer.
+ */
+static size_t esp_rtsp_server_read_interleaved(esp_rtsp_server_connection_t *connection, const char *buffer, size_t length) {
+    size_t position = 0;
+    while (connection->interleaved_header_length < sizeof(connection->interleaved_header) && position < length) {
+        connection->interleaved_header[connection->interleaved_header_length++] = buffer[position++];
+        connection->interleaved_received = 0;
+    }
+
+    if (connection->interleaved_header_length < sizeof(connection->interleaved_header)) {
+        return position;
     }
 
+    size_t packet_length = connection->interleaved_header[2] << 8 | connection->interleaved_header[3];
+    size_t chunk = MIN(length - position, packet_length - connection->interleaved_received);
+    if (connection->interleaved_received < sizeof(connection->interleaved_packet)) {
+        memcpy(connection->interleaved_packet + connection->interleaved_received, buffer + position,
+               MIN(chunk, sizeof(connection->interleaved_packet) - connection->interleaved_received));
+    }
+    connection->interleaved_received += chunk;
+    position += chunk;
+
+    if (connection->interleaved_received == packet_length) {
+        esp_rtp_session_t *session = connection->rtp_session;
+        if (session && connection->interleaved && connection->interleaved_header[1] == session->rtcp_channel &&
+            packet_length <= sizeof(connection->interleaved_packet)) {
+            esp_rtcp_receive(session, connection->interleaved_packet, packet_length);
+        }
+        connection->interleaved_header_length = 0;
+    }
 
-    return n;
+    return position;
 }
 
 static int esp_rtsp_handle_request(esp_rtsp_server_connection_t *connection, rtsp_req_t *request) {
@@ -308,34 +651,101 @@ static int esp_rtsp_handle_request(esp_rtsp_server_connection_t *connection, rts
 
 static int esp_rtsp_handle_error(esp_rtsp_server_connection_t *connection, int error) {
     if (!connection->connection_active) {
-    return -1;
+        return -1;
     }
 
-    int sock = connection->socket;
-
-    if (error == 461) {
-        ESP_LOGI(TAG, "RTSP >: %s", "RTSP/1.0 461 Unsupported Transport\r\n\r\n");
-        send(sock, "RTSP/1.0 461 Unsupported Transport\r\n\r\n", 38, 0);
-        return 0;
+    // Anything without a response of its own is a bad request
+    size_t index = 0;
+    for (size_t i = 0; i < sizeof(error_responses) / sizeof(error_responses[0]); i++) {
+        if (error_responses[i].code == error) {
+            index = i;
+            break;
+        }
     }
 
-    if (error == 405) {
-        static char buffer[2048];
-        size_t msgsize = snprintf(buffer, 2048,
-                                  "RTSP/1.0 405 Method Not Allowed\r\n"
-                                  "Server: ESP32 Cam Server\r\n"
-                                  "Allow: OPTIONS, DESCRIBE, SETUP, TEARDOWN, PLAY, PAUSE\r\n"
-                                  "\r\n");
-        size_t sent = send(connection->socket, buffer, msgsize, 0);
-        ESP_LOGI(TAG, "RTSP >: %s", buffer);
-        if (sent != msgsize) {
-            ESP_LOGW(TAG, "Mismatch between msgsize and sent bytes: %d vs %d", msgsize, sent);
+    ESP_LOGI(TAG, "RTSP >: %s", error_responses[index].response);
+    rtsp_output_queue(&connection->output, error_responses[index].response, error_responses[index].length);
+
+    return 0;
+}
+
+/* Handles the requests in the receive buffer one at a time. A request is
+ * only taken once the responses to the previous ones are written, a client
+ * that doesn't read its responses stops being served instead of filling up
+ * the output. Returns -1 when the connection was closed.
+ */
+static int esp_rtsp_handle_received(esp_rtsp_server_connection_t *connection) {
+    // A partial request from an earlier read is at the start, the parser picks up where it stopped
+    char *buffer = connection->receive_buffer;
+    size_t length = connection->receive_length;
+    size_t position = 0;
+    while (position < length && !rtsp_output_pending(&connection->output)) {
+        // Between requests a '$' starts an interleaved frame instead of a request
+        if (connection->interleaved_header_length > 0 || buffer[position] == '$') {
+            position += esp_rtsp_server_read_interleaved(connection, buffer + position, length - position);
+            continue;
+        }
+
+        if (buffer[position] == '\r' || buffer[position] == '\n') {
+            // Line ends left over from the previous request
+            position++;
+            continue;
+        }
+
+        int parsed = parse_request(connection->parser, buffer + position, length - position);
+        if (parsed < 0) {
+            ESP_LOGE(TAG, "Error parsing request");
+            rtsp_server_connection_close(connection);
+            return -1;
+        }
+
+        if (parsed == 0) {
+            if (position == 0 && length == RTSP_REQUEST_MAX_SIZE) {
+                ESP_LOGW(TAG, "Request larger than %d bytes", RTSP_REQUEST_MAX_SIZE);
+                esp_rtsp_handle_error(connection, 413);
+                rtsp_server_flush(connection);
+                rtsp_server_connection_close(connection);
+                return -1;
+            }
+            // Wait for the rest of the request
+            break;
+        }
+        position += parsed;
+
+        int error = parser_get_error(connection->parser);
+        if (error) {
+            esp_rtsp_handle_error(connection, error);
+            rtsp_server_flush(connection);
+            ESP_LOGD(TAG, "Closing connection after bad request error");
+            rtsp_server_connection_close(connection);
+            return -1;
+        }
+
+        // The request points into the receive buffer, it is handled before the buffer moves
+        rtsp_req_t *request = parser_get_request(connection->parser);
+        int err = esp_rtsp_handle_request(connection, request);
+        parser_reset(connection->parser);
+
+        if (err < 0) {
+            ESP_LOGW(TAG, "Failed to handle request");
+            return -1;
+        }
+
+        if (connection->output.overflow) {
+            ESP_LOGW(TAG, "Responses to %s don't fit in the output buffer", connection->client_addr_string);
+            rtsp_server_connection_close(connection);
+            return -1;
+        }
+
+        // Most responses go out right away, the rest when the socket is writable
+        if (rtsp_server_flush(connection) != ESP_OK) {
+            rtsp_server_connection_close(connection);
+            return -1;
         }
-        return 0;
     }
 
-    ESP_LOGI(TAG, "RTSP >: %s", "RTSP/1.0 400 Bad Request\r\n\r\n");
-    send(sock, "RTSP/1.0 400 Bad Request\r\n\r\n", 28, 0);
+    connection->receive_length = length - position;
+    memmove(buffer, buffer + position, connection->receive_length);
 
     return 0;
 }
@@ -351,7 +761,8 @@ static int esp_rtsp_handle_read(esp_rtsp_server_connection_t *connection) {
         return -1;
     }
 
-    ssize_t n = esp_rtsp_server_read_block(connection);
+    size_t space = RTSP_REQUEST_MAX_SIZE - connection->receive_length;
+    ssize_t n = esp_rtsp_server_read_block(connection, connection->receive_buffer + connection->receive_length, space);
     if (n < 0) {
         ESP_LOGE(TAG, "Read failed");
         rtsp_server_connection_close(connection);
@@ -363,32 +774,22 @@ static int esp_rtsp_handle_read(esp_rtsp_server_connection_t *connection) {
         return 0;
     }
 
-    int error = parser_get_error(connection->parser);
-    if (error) {
-        esp_rtsp_handle_error(connection, error);
-        ESP_LOGD(TAG, "Closing connection after bad request error");
-        rtsp_server_connection_close(connection);
-        return 0;
-    }
-
-    if (parser_is_complete(connection->parser)) {
-        rtsp_req_t *request = parser_get_request(connection->parser);
-        parser_free(connection->parser);
-        rtsp_parser_init(&connection->parser);
-
-        if (esp_rtsp_handle_request(connection, request) < 0) {
-            ESP_LOGW(TAG, "Failed to handle request %d", request->request_type);
-            return -1;
-        }
+    connection->receive_length += n;
+    return esp_rtsp_handle_received(connection);
+}
 
-        free(request);
+// The socket has room again, requests that waited for the responses are handled next
+static int esp_rtsp_handle_write(esp_rtsp_server_connection_t *connection) {
+    if (rtsp_server_flush(connection) != ESP_OK) {
+        rtsp_server_connection_close(connection);
+        return -1;
     }
 
-    return 0;
+    return esp_rtsp_handle_received(connection);
 }
 
 
-static int esp_rtsp_create_listening_socket(int port) {
+static int esp_rtsp_create_listening_socket(int port, int backlog) {
     int listen_sock = socket(AF_INET6, SOCK_STREAM, 0);
     if (listen_sock < 0) {
         ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
@@ -399,7 +800,7 @@ static int esp_rtsp_create_listening_socket(int port) {
     struct sockaddr_in6 serv_addr = {
             .sin6_family  = PF_INET6,
             .sin6_addr    = inaddr_any,
-            .sin6_port    = htons(PORT)
+            .sin6_port    = htons(port)
     };
 
     int opt = 1;
@@ -414,7 +815,7 @@ static int esp_rtsp_create_listening_socket(int port) {
         goto CLEAN_UP;
     }
 
-    err = listen(listen_sock, 1);
+    err = listen(listen_sock, backlog);
     if (err != 0) {
         ESP_LOGE(TAG, "Error occurred during listen: errno %d", errno);
         goto CLEAN_UP;
@@ -442,18 +843,7 @@ static esp_err_t rtsp_server_accept(int listen_sock) {
         return ESP_FAIL;
     }
 
-    esp_rtsp_server_connection_t *connection = NULL;
-
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (!connections[i].connection_active) {
-            // claim this connection
-            connections[i].connection_active = true;
-            connection = &connections[i];
-            break;
-        }
-    }
-
-    if (!connection) {
+    if (!free_connections) {
         ESP_LOGW(TAG, "No free connections");
         shutdown(sock, 0);
         close(sock);
@@ -466,6 +856,8 @@ static esp_err_t rtsp_server_accept(int listen_sock) {
     setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &keepInterval, sizeof(int));
     setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &keepCount, sizeof(int));
 
+    esp_rtp_socket_set_dscp(sock, CONFIG_ESP_RTSP_CONTROL_DSCP);
+
     struct timeval to;
     to.tv_sec = 3;
     to.tv_usec = 0;
@@ -477,6 +869,12 @@ static esp_err_t rtsp_server_accept(int listen_sock) {
         return ESP_FAIL;
     }
 
+    // claim this connection, its buffers and parser are ready
+    esp_rtsp_server_connection_t *connection = free_connections;
+    free_connections = connection->next_free;
+    connection->next_free = NULL;
+    connection->connection_active = true;
+
     // Convert ip address to string
     if (source_addr.ss_family == PF_INET) {
         inet_ntoa_r(((struct sockaddr_in *)&source_addr)->sin_addr, connection->client_addr_string, sizeof(connection->client_addr_string) - 1);
@@ -487,40 +885,152 @@ static esp_err_t rtsp_server_accept(int listen_sock) {
     ESP_LOGI(TAG, "Socket accepted ip address: %s", connection->client_addr_string);
 
     connection->socket = sock;
-    if (rtsp_parser_init(&connection->parser) < 0) {
-        ESP_LOGW(TAG, "Failed to create parser state for connection");
-        shutdown(sock, 0);
-        close(sock);
-        return ESP_FAIL;
+
+    return ESP_OK;
+}
+
+static void rtsp_server_free_connections() {
+    for (int i = 0; i < max_connections; i++) {
+        free(connections[i].receive_buffer);
+        rtsp_output_free(&connections[i].output);
+    }
+    rtsp_parser_pool_destroy();
+
+    free(connections);
+    connections = NULL;
+    max_connections = 0;
+    free_connections = NULL;
+}
+
+/* Sets up everything a connection needs for max_clients connections, after
+ * this accepting and serving requests doesn't allocate. Every slot starts
+ * out on the free list.
+ */
+static esp_err_t rtsp_server_create_connections(size_t max_clients) {
+    connections = calloc(max_clients, sizeof(esp_rtsp_server_connection_t));
+    if (!connections || rtsp_parser_pool_create(max_clients) != PARSER_OK) {
+        free(connections);
+        connections = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+    max_connections = max_clients;
+
+    for (int i = max_connections - 1; i >= 0; i--) {
+        esp_rtsp_server_connection_t *connection = &connections[i];
+        connection->receive_buffer = malloc(RTSP_REQUEST_MAX_SIZE);
+        if (!connection->receive_buffer || rtsp_output_init(&connection->output) != ESP_OK ||
+            rtsp_parser_init(&connection->parser) != PARSER_OK) {
+            rtsp_server_free_connections();
+            return ESP_ERR_NO_MEM;
+        }
+
+        connection->next_free = free_connections;
+        free_connections = connection;
     }
 
     return ESP_OK;
 }
 
-esp_err_t rtsp_server_main() {
-    int listen_sock = esp_rtsp_create_listening_socket(554);
+void rtsp_server_stop() {
+    stopping = true;
+}
+
+/* The server loop. One select covers the RTSP connections, the listening
+ * socket and the RTCP sockets, connections with responses waiting are
+ * watched for writing instead of reading. Its timeout comes from the timer
+ * wheel that schedules the sender reports. It returns after
+ * rtsp_server_stop, once every connection is closed and its session
+ * released.
+ */
+esp_err_t rtsp_server_main(const esp_rtsp_server_config_t *config) {
+    stopping = false;
+
+    // Every unicast session shares these, bind them before any client shows up
+    esp_err_t err = esp_rtp_start();
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start rtp");
+        return err;
+    }
+
+    // The pacer and the player outlive a stopped server, they idle without sessions
+    err = esp_rtp_pacer_start();
+    if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+        ESP_LOGE(TAG, "Failed to start rtp pacer");
+        return err;
+    }
+
+    if (esp_rtp_adapt_start() != ESP_OK) {
+        // Keep streaming with the settings from camera_config
+        ESP_LOGW(TAG, "Failed to start quality adaptation");
+    }
+
+    if (!rtp_player_task) {
+        BaseType_t result = xTaskCreate(rtp_player_task_main, "rtp_player", PLAYER_STACKSIZE, NULL, PLAYER_PRIORITY, &rtp_player_task);
+        if (result != pdPASS) {
+            ESP_LOGE(TAG, "Failed to create rtp player task: %d", result);
+            return ESP_FAIL;
+        }
+    }
+
+    int listen_sock = esp_rtsp_create_listening_socket(config->port, config->backlog);
     if (listen_sock < 0) {
         return ESP_FAIL;
     }
 
-    while (1) {
+    err = rtsp_server_create_connections(config->max_clients);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "No memory for %u connections", config->max_clients);
+        close(listen_sock);
+        return err;
+    }
+    ESP_LOGI(TAG, "%u connections, %u bytes each: receive buffer %u, output buffer %u, parser %u, connection %u",
+             config->max_clients,
+             RTSP_REQUEST_MAX_SIZE + RTSP_OUTPUT_BUFFER_SIZE + parser_get_size() + sizeof(esp_rtsp_server_connection_t),
+             RTSP_REQUEST_MAX_SIZE, RTSP_OUTPUT_BUFFER_SIZE, parser_get_size(), sizeof(esp_rtsp_server_connection_t));
+
+    rtsp_timer_wheel_init(&timers, esp_timer_get_time());
+    err = esp_rtcp_start(&timers);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start rtcp");
+        rtsp_server_free_connections();
+        close(listen_sock);
+        return err;
+    }
+
+    while (!stopping) {
+        int64_t timeout_us = rtsp_timer_wheel_run(&timers, esp_timer_get_time());
+        if (timeout_us < 0 || timeout_us > SERVER_POLL_MS * 1000LL) {
+            // Wake up now and then to notice a stop request
+            timeout_us = SERVER_POLL_MS * 1000LL;
+        }
+        struct timeval timeout = {
+                .tv_sec = timeout_us / 1000000,
+                .tv_usec = timeout_us % 1000000
+        };
+
         int sock_max = listen_sock;
 
         fd_set read_set;
         FD_ZERO(&read_set);
         FD_SET(listen_sock, &read_set);
 
-        for (int i = 0; i < MAX_CLIENTS; i++) {
+        // A connection with responses waiting is only read again once they are written
+        fd_set write_set;
+        FD_ZERO(&write_set);
+
+        for (int i = 0; i < max_connections; i++) {
             if (connections[i].connection_active) {
-                FD_SET(connections[i].socket, &read_set);
+                FD_SET(connections[i].socket, rtsp_output_pending(&connections[i].output) ? &write_set : &read_set);
                 if (connections[i].socket > sock_max) {
                     sock_max = connections[i].socket;
                 }
             }
         }
 
+        sock_max = esp_rtcp_fill_read_set(&read_set, sock_max);
+
         ESP_LOGD(TAG, "Entering select");
-        int n = select(sock_max + 1, &read_set, NULL, NULL, NULL);
+        int n = select(sock_max + 1, &read_set, &write_set, NULL, &timeout);
         if (n < 0) {
             if (errno == EINTR) {
                 ESP_LOGW(TAG, "select interrupted");
@@ -531,8 +1041,22 @@ esp_err_t rtsp_server_main() {
             break;
         }
 
-        for (int i = 0; i < MAX_CLIENTS; i++) {
-            if (FD_ISSET(connections[i].socket, &read_set)) {
+        if (n == 0) {
+            continue;
+        }
+
+        // Before the connections, a teardown there can close a socket in the set
+        esp_rtcp_handle_read_set(&read_set);
+
+        for (int i = 0; i < max_connections; i++) {
+            if (!connections[i].connection_active) {
+                continue;
+            }
+
+            if (FD_ISSET(connections[i].socket, &write_set)) {
+                ESP_LOGD(TAG, "Write on connection %d", i);
+                esp_rtsp_handle_write(&connections[i]);
+            } else if (FD_ISSET(connections[i].socket, &read_set)) {
                 ESP_LOGD(TAG, "Read on connection %d", i);
                 esp_rtsp_handle_read(&connections[i]);
             }
@@ -545,10 +1069,18 @@ esp_err_t rtsp_server_main() {
                 ESP_LOGW(TAG, "Failed to accept connection");
             }
         }
-   }
+    }
+
+    // Sessions leave the pacer and RTCP here, the frames they hold are released once the sender is done with them
+    for (int i = 0; i < max_connections; i++) {
+        if (connections[i].connection_active) {
+            rtsp_server_connection_close(&connections[i]);
+        }
+    }
+    esp_rtcp_stop();
+    rtsp_server_free_connections();
 
     ESP_LOGI(TAG, "Shutting down listening socket");
     close(listen_sock);
     return ESP_OK;
 }
-
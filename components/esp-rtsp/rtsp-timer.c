@@ -0,0 +1,127 @@
+//
+// Created on 18/10/2026.
+//
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "rtsp-timer.h"
+
+#define TICK_US (RTSP_TIMER_TICK_MS * 1000LL)
+
+static int64_t tick_of(int64_t time) {
+    return time / TICK_US;
+}
+
+void rtsp_timer_wheel_init(rtsp_timer_wheel_t *wheel, int64_t now) {
+    memset(wheel, 0, sizeof(rtsp_timer_wheel_t));
+    wheel->tick = tick_of(now) - 1;
+}
+
+void rtsp_timer_init(rtsp_timer_t *timer, rtsp_timer_callback_t callback, void *arg) {
+    memset(timer, 0, sizeof(rtsp_timer_t));
+    timer->callback = callback;
+    timer->arg = arg;
+}
+
+void rtsp_timer_arm(rtsp_timer_wheel_t *wheel, rtsp_timer_t *timer, int64_t deadline) {
+    rtsp_timer_cancel(wheel, timer);
+
+    // A deadline that already passed goes in the next slot to be run
+    int64_t tick = tick_of(deadline);
+    if (tick <= wheel->tick) {
+        tick = wheel->tick + 1;
+    }
+
+    timer->deadline = deadline;
+    timer->slot = tick % RTSP_TIMER_SLOTS;
+    timer->next = wheel->slots[timer->slot];
+    wheel->slots[timer->slot] = timer;
+    timer->armed = true;
+    wheel->armed++;
+}
+
+void rtsp_timer_cancel(rtsp_timer_wheel_t *wheel, rtsp_timer_t *timer) {
+    if (!timer->armed) {
+        return;
+    }
+
+    for (rtsp_timer_t **link = &wheel->slots[timer->slot]; *link; link = &(*link)->next) {
+        if (*link == timer) {
+            *link = timer->next;
+            break;
+        }
+    }
+
+    timer->next = NULL;
+    timer->armed = false;
+    wheel->armed--;
+}
+
+/* Time until the first timer is due, from the first slot that holds a timer
+ * for this turn of the wheel. -1 without timers.
+ */
+static int64_t next_timeout(rtsp_timer_wheel_t *wheel, int64_t now) {
+    if (!wheel->armed) {
+        return -1;
+    }
+
+    int64_t now_tick = tick_of(now);
+    for (int64_t k = 0; k < RTSP_TIMER_SLOTS; k++) {
+        int64_t tick = now_tick + k;
+        int64_t wake = INT64_MAX;
+        for (rtsp_timer_t *timer = wheel->slots[tick % RTSP_TIMER_SLOTS]; timer; timer = timer->next) {
+            if (tick_of(timer->deadline) <= tick) {
+                int64_t due = timer->deadline > tick * TICK_US ? timer->deadline : tick * TICK_US;
+                if (due < wake) {
+                    wake = due;
+                }
+            }
+        }
+
+        if (wake != INT64_MAX) {
+            return wake > now ? wake - now : 0;
+        }
+    }
+
+    // Everything is at least a turn away, look again after one
+    return RTSP_TIMER_SLOTS * TICK_US;
+}
+
+/* Runs the callbacks of the timers that are due and returns the time in
+ * microseconds until the next one is, -1 when no timer is armed. A callback
+ * may arm its own timer again, other timers are left alone while it runs.
+ */
+int64_t rtsp_timer_wheel_run(rtsp_timer_wheel_t *wheel, int64_t now) {
+    int64_t now_tick = tick_of(now);
+    int64_t tick = wheel->tick + 1;
+    if (now_tick - tick >= RTSP_TIMER_SLOTS) {
+        // Late by more than a turn, visiting every slot once is enough
+        tick = now_tick - RTSP_TIMER_SLOTS + 1;
+    }
+
+    for (; tick <= now_tick; tick++) {
+        // Timers armed by a callback for a passed deadline go to the next tick, not this slot again
+        wheel->tick = tick;
+
+        rtsp_timer_t **link = &wheel->slots[tick % RTSP_TIMER_SLOTS];
+        while (*link) {
+            rtsp_timer_t *timer = *link;
+            if (timer->deadline > now) {
+                link = &timer->next;
+                continue;
+            }
+
+            *link = timer->next;
+            timer->next = NULL;
+            timer->armed = false;
+            wheel->armed--;
+            timer->callback(timer->arg);
+        }
+    }
+
+    // The current tick isn't over yet, its slot is run again next time
+    wheel->tick = now_tick - 1;
+
+    return next_timeout(wheel, now);
+}
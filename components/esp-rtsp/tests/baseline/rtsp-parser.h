@@ -0,0 +1,33 @@
+//
+// Created on 18/10/2026.
+//
+
+#ifndef ESPCAM_BASELINE_RTSP_PARSER_H
+#define ESPCAM_BASELINE_RTSP_PARSER_H
+
+#include <stddef.h>
+
+#include "esp-rtsp-common.h"
+
+// The request as the first parser filled it in, with its own copy of the url
+#define URL_MAX_LENGTH 1024
+
+typedef struct {
+    rtsp_request_type_t request_type;
+    char url[URL_MAX_LENGTH + 1];
+    int protocol_version;
+    int cseq;
+    int dst_rtp_port;
+    int dst_rtcp_port;
+} baseline_req_t;
+
+typedef void* baseline_parser_handle_t;
+
+int baseline_parser_init(baseline_parser_handle_t *handle);
+int baseline_parse_request(baseline_parser_handle_t handle, const char *buffer, size_t len);
+int baseline_parser_is_complete(baseline_parser_handle_t handle);
+int baseline_parser_get_error(baseline_parser_handle_t handle);
+baseline_req_t *baseline_parser_get_request(baseline_parser_handle_t handle);
+int baseline_parser_free(baseline_parser_handle_t handle);
+
+#endif //ESPCAM_BASELINE_RTSP_PARSER_H
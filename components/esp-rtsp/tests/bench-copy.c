@@ -0,0 +1,173 @@
+//
+// Created on 18/10/2026.
+//
+
+/* Bytes copied per frame on the way from the camera buffer to the socket,
+ * for the packetizer the component started with and the current one. The
+ * old packetizer assembled every packet in a static buffer, the current one
+ * hands sendmsg an iovec that points into the frame buffer and only builds
+ * the RTP header per session. Both send to a socket on the loopback.
+ */
+
+#include <stdio.h>
+
+#include <esp_err.h>
+#include <lwip/sockets.h>
+
+#include "rtp-jpeg.h"
+#include "rtp-udp.h"
+#include "test-frames.h"
+
+#define RECEIVER_PORT 9100
+
+static int receiver_socket;
+
+static int open_receiver() {
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    int size = 4 * 1024 * 1024;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    struct sockaddr_in addr = {
+            .sin_family = AF_INET,
+            .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+            .sin_port = htons(RECEIVER_PORT),
+    };
+    if (sock < 0 || bind(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        return -1;
+    }
+    return sock;
+}
+
+static size_t drain_receiver() {
+    uint8_t buffer[2048];
+    size_t packets = 0;
+    while (recv(receiver_socket, buffer, sizeof(buffer), MSG_DONTWAIT) > 0) {
+        packets++;
+    }
+    return packets;
+}
+
+/* The send loop of the first version of rtp-udp.c, with the copies into the
+ * packet buffer counted. The headers are serialized into the buffer as well,
+ * so every byte on the wire passed through a memcpy or a store.
+ */
+static size_t baseline_send_frame(int sock, const esp_rtsp_jpeg_data_t *jpeg_data) {
+    static uint8_t payload[MAX_PAYLOAD_SIZE];
+    size_t copied = 0;
+    size_t fragment_offset = 0;
+
+    struct sockaddr_in client = {
+            .sin_family = AF_INET,
+            .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+            .sin_port = htons(RECEIVER_PORT),
+    };
+
+    // The tables went through an esp_rtp_quant_t before being serialized
+    uint8_t quant[128];
+    memcpy(quant, jpeg_data->quant_table_0 + 1, 64);
+    memcpy(quant + 64, jpeg_data->quant_table_1 + 1, 64);
+    copied += sizeof(quant);
+
+    while (fragment_offset < jpeg_data->jpeg_data_length) {
+        uint8_t *offset = payload;
+        size_t payload_remaining = MAX_PAYLOAD_SIZE;
+
+        memset(offset, 0, RTP_HEADER_SIZE + RTP_JPEG_HEADER_SIZE);
+        offset += RTP_HEADER_SIZE + RTP_JPEG_HEADER_SIZE;
+        payload_remaining -= RTP_HEADER_SIZE + RTP_JPEG_HEADER_SIZE;
+        copied += RTP_HEADER_SIZE + RTP_JPEG_HEADER_SIZE;
+
+        if (fragment_offset == 0) {
+            memset(offset, 0, 4);
+            memcpy(offset + 4, quant, sizeof(quant));
+            offset += 4 + sizeof(quant);
+            payload_remaining -= 4 + sizeof(quant);
+            copied += 4 + sizeof(quant);
+        }
+
+        size_t remaining_bytes = jpeg_data->jpeg_data_length - fragment_offset;
+        size_t length = remaining_bytes < payload_remaining ? remaining_bytes : payload_remaining;
+        memcpy(offset, jpeg_data->jpeg_data_start + fragment_offset, length);
+        fragment_offset += length;
+        payload_remaining -= length;
+        copied += length;
+
+        sendto(sock, payload, MAX_PAYLOAD_SIZE - payload_remaining, 0, (struct sockaddr *) &client, sizeof(client));
+    }
+
+    return copied;
+}
+
+int main() {
+    receiver_socket = open_receiver();
+    int baseline_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (receiver_socket < 0 || baseline_socket < 0) {
+        fprintf(stderr, "Unable to open the loopback sockets\n");
+        return 1;
+    }
+
+    if (esp_rtp_start() != ESP_OK) {
+        fprintf(stderr, "Unable to bind the RTP sockets\n");
+        return 1;
+    }
+
+    esp_rtp_session_handle_t session;
+    if (esp_rtp_init(&session, RECEIVER_PORT, RECEIVER_PORT + 1, false, "127.0.0.1") != ESP_OK) {
+        return 1;
+    }
+
+    // The old packetizer had no FEC, its XOR is a copy of every payload byte
+    esp_rtp_set_fec_group_size(session, 0);
+
+    printf("%-12s %8s %8s %14s %14s %16s\n", "frame", "bytes", "packets", "copied before", "copied after", "referenced after");
+
+    int failed = 0;
+    esp_rtp_session_stats_t previous = { 0 };
+    for (size_t i = 0; i < test_frame_corpus_count; i++) {
+        const test_frame_spec_t *spec = &test_frame_corpus[i];
+        esp_frame_t *frame = test_frame_create(spec);
+
+        esp_rtp_jpeg_frame_t *jpeg_frame;
+        if (!frame || esp_rtp_jpeg_packetize(frame, MAX_PAYLOAD_SIZE, &jpeg_frame) != ESP_OK) {
+            fprintf(stderr, "Failed to packetize %s\n", spec->name);
+            return 1;
+        }
+
+        size_t before = baseline_send_frame(baseline_socket, &jpeg_frame->jpeg_data);
+        drain_receiver();
+
+        for (size_t index = 0; index < jpeg_frame->packet_count; index++) {
+            if (esp_rtp_send_jpeg_packet(session, jpeg_frame, index) != ESP_OK) {
+                fprintf(stderr, "Failed to send packet %zu of %s\n", index, spec->name);
+                failed = 1;
+            }
+        }
+        size_t received = drain_receiver();
+
+        esp_rtp_session_stats_t stats;
+        esp_rtp_get_stats(session, &stats);
+        uint64_t copied = stats.bytes_copied - previous.bytes_copied;
+        uint64_t referenced = stats.bytes_referenced - previous.bytes_referenced;
+        previous = stats;
+
+        printf("%-12s %8zu %8zu %14zu %14llu %16llu\n", spec->name, frame->len, jpeg_frame->packet_count,
+               before, (unsigned long long) copied, (unsigned long long) referenced);
+
+        // Only the RTP header and the quant header are built per packet, the rest is referenced
+        if (copied > jpeg_frame->packet_count * (RTP_HEADER_SIZE + 4) || referenced < jpeg_frame->jpeg_data.jpeg_data_length) {
+            fprintf(stderr, "%s: unexpected copy accounting\n", spec->name);
+            failed = 1;
+        }
+        if (received && received != jpeg_frame->packet_count) {
+            fprintf(stderr, "%s: %zu of %zu packets arrived\n", spec->name, received, jpeg_frame->packet_count);
+        }
+
+        esp_rtp_jpeg_frame_unref(jpeg_frame);
+        esp_frame_unref(frame);
+    }
+
+    esp_rtp_teardown(session);
+    close(baseline_socket);
+    close(receiver_socket);
+    return failed;
+}
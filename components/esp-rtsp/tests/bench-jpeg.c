@@ -0,0 +1,131 @@
+//
+// Created on 18/10/2026.
+//
+
+/* Time to index a frame, for the decoder the component started with and
+ * the current one with and without a hit in the layout cache. Runs on the
+ * generated corpus, or on JPEG files given on the command line:
+ *
+ *   bench_jpeg capture-1.jpg capture-2.jpg ...
+ *
+ * Every decode is timed on its own and the median is reported, the timer
+ * overhead is in all three columns.
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#include <esp_err.h>
+
+#include "rtp-jpeg.h"
+#include "test-frames.h"
+
+#define ITERATIONS 2001
+
+esp_err_t baseline_jpeg_decode(char *buffer, size_t length, esp_rtsp_jpeg_data_t *rtsp_jpeg_data);
+
+typedef esp_err_t (*decode_t)(char *buffer, size_t length, esp_rtsp_jpeg_data_t *rtsp_jpeg_data);
+
+static uint64_t samples[ITERATIONS];
+
+static uint64_t now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int compare_samples(const void *a, const void *b) {
+    uint64_t left = *(const uint64_t *) a;
+    uint64_t right = *(const uint64_t *) b;
+    return left < right ? -1 : left > right;
+}
+
+/* Median time of decode on frame. With other set it is decoded before
+ * every timed decode, a frame with another layout empties the cache.
+ */
+static uint64_t time_decode(decode_t decode, const esp_frame_t *frame, const esp_frame_t *other, int *failed) {
+    esp_rtsp_jpeg_data_t jpeg_data;
+
+    for (int i = 0; i < ITERATIONS; i++) {
+        if (other) {
+            esp_rtsp_jpeg_decode((char *) other->buf, other->len, &jpeg_data);
+        }
+
+        uint64_t start = now_ns();
+        esp_err_t err = decode((char *) frame->buf, frame->len, &jpeg_data);
+        samples[i] = now_ns() - start;
+
+        if (err != ESP_OK) {
+            *failed = 1;
+            return 0;
+        }
+    }
+
+    qsort(samples, ITERATIONS, sizeof(samples[0]), compare_samples);
+    return samples[ITERATIONS / 2];
+}
+
+static esp_frame_t *other_plain;
+static esp_frame_t *other_restart;
+
+static int bench_frame(const char *name, const esp_frame_t *frame) {
+    esp_rtsp_jpeg_data_t jpeg_data;
+    if (esp_rtsp_jpeg_decode((char *) frame->buf, frame->len, &jpeg_data) != ESP_OK) {
+        fprintf(stderr, "%s: failed to decode\n", name);
+        return 1;
+    }
+
+    // The old decoder predates restart markers, it takes them for unknown segments
+    int failed = 0;
+    uint64_t baseline = jpeg_data.restart_interval ? 0 : time_decode(baseline_jpeg_decode, frame, NULL, &failed);
+    const esp_frame_t *other = jpeg_data.restart_interval ? other_plain : other_restart;
+    uint64_t uncached = time_decode(esp_rtsp_jpeg_decode, frame, other, &failed);
+    uint64_t cached = time_decode(esp_rtsp_jpeg_decode, frame, NULL, &failed);
+
+    if (failed) {
+        fprintf(stderr, "%s: failed to decode\n", name);
+        return 1;
+    }
+
+    char before[24] = "-";
+    if (baseline) {
+        snprintf(before, sizeof(before), "%llu", (unsigned long long) baseline);
+    }
+
+    printf("%-24s %8zu %12s %12llu %12llu\n", name, frame->len, before,
+           (unsigned long long) uncached, (unsigned long long) cached);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    // Small frames with and without restart markers, decoding one of them empties the cache for the other
+    test_frame_spec_t other_spec = { .name = "other", .width = 64, .height = 64, .quality = 20, .scan_length = 256, .seed = 9 };
+    other_plain = test_frame_create(&other_spec);
+    other_spec.restart_interval = 4;
+    other_restart = test_frame_create(&other_spec);
+
+    printf("%-24s %8s %12s %12s %12s\n", "frame", "bytes", "before ns", "uncached ns", "cached ns");
+
+    int failed = 0;
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++) {
+            esp_frame_t *frame = test_frame_load(argv[i]);
+            if (!frame) {
+                fprintf(stderr, "Unable to read %s\n", argv[i]);
+                return 1;
+            }
+            failed |= bench_frame(argv[i], frame);
+            esp_frame_unref(frame);
+        }
+    } else {
+        for (size_t i = 0; i < test_frame_corpus_count; i++) {
+            esp_frame_t *frame = test_frame_create(&test_frame_corpus[i]);
+            failed |= bench_frame(test_frame_corpus[i].name, frame);
+            esp_frame_unref(frame);
+        }
+    }
+
+    esp_frame_unref(other_plain);
+    esp_frame_unref(other_restart);
+    return failed;
+}
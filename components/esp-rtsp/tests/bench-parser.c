@@ -0,0 +1,138 @@
+//
+// Created on 18/10/2026.
+//
+
+/* Requests per second through the parser the component started with and
+ * the current one, for the requests a client sends to start and stop a
+ * stream. Both get a fresh copy of the request every time, the current
+ * parser tokenizes in place.
+ *
+ *   bench_parser [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "esp-rtsp-common.h"
+#include "baseline/rtsp-parser.h"
+
+#define ITERATIONS 100000
+
+// What VLC sends, less the headers the old parser can't take
+static const char *requests[] = {
+        "OPTIONS rtsp://192.168.1.10/stream RTSP/1.0\r\n"
+        "CSeq: 2\r\n"
+        "User-Agent: LibVLC/3.0.18 (LIVE555 Streaming Media v2016.11.28)\r\n"
+        "\r\n",
+        "DESCRIBE rtsp://192.168.1.10/stream RTSP/1.0\r\n"
+        "CSeq: 3\r\n"
+        "User-Agent: LibVLC/3.0.18 (LIVE555 Streaming Media v2016.11.28)\r\n"
+        "Accept: application/sdp\r\n"
+        "\r\n",
+        "SETUP rtsp://192.168.1.10/stream/track1 RTSP/1.0\r\n"
+        "CSeq: 4\r\n"
+        "User-Agent: LibVLC/3.0.18 (LIVE555 Streaming Media v2016.11.28)\r\n"
+        "Transport: RTP/AVP;unicast;client_port=5000-5001\r\n"
+        "\r\n",
+        "PLAY rtsp://192.168.1.10/stream RTSP/1.0\r\n"
+        "CSeq: 5\r\n"
+        "User-Agent: LibVLC/3.0.18 (LIVE555 Streaming Media v2016.11.28)\r\n"
+        "Session: 12348765\r\n"
+        "Range: npt=0.000-\r\n"
+        "\r\n",
+        "TEARDOWN rtsp://192.168.1.10/stream RTSP/1.0\r\n"
+        "CSeq: 6\r\n"
+        "User-Agent: LibVLC/3.0.18 (LIVE555 Streaming Media v2016.11.28)\r\n"
+        "Session: 12348765\r\n"
+        "\r\n",
+};
+
+#define REQUEST_COUNT (sizeof(requests) / sizeof(requests[0]))
+
+static char buffer[1024];
+static size_t lengths[REQUEST_COUNT];
+
+static double now_s() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Returns the number of requests that didn't parse
+static int run_baseline(int iterations) {
+    int failed = 0;
+    for (int i = 0; i < iterations; i++) {
+        for (size_t k = 0; k < REQUEST_COUNT; k++) {
+            memcpy(buffer, requests[k], lengths[k]);
+
+            baseline_parser_handle_t parser;
+            if (baseline_parser_init(&parser) != PARSER_OK) {
+                return iterations;
+            }
+            baseline_parse_request(parser, buffer, lengths[k]);
+            failed += !baseline_parser_is_complete(parser) || baseline_parser_get_error(parser);
+
+            // The request was the caller's to free
+            free(baseline_parser_get_request(parser));
+            baseline_parser_free(parser);
+        }
+    }
+    return failed;
+}
+
+static int run_current(int iterations) {
+    int failed = 0;
+    for (int i = 0; i < iterations; i++) {
+        for (size_t k = 0; k < REQUEST_COUNT; k++) {
+            memcpy(buffer, requests[k], lengths[k]);
+
+            rtsp_parser_handle_t parser;
+            if (rtsp_parser_init(&parser) != PARSER_OK) {
+                return iterations;
+            }
+            parse_request(parser, buffer, lengths[k]);
+            failed += !parser_is_complete(parser) || parser_get_error(parser);
+            parser_free(parser);
+        }
+    }
+    return failed;
+}
+
+static int report(const char *name, int (*run)(int), int iterations, size_t bytes) {
+    double start = now_s();
+    int failed = run(iterations);
+    double elapsed = now_s() - start;
+
+    if (failed) {
+        fprintf(stderr, "%s: %d requests failed to parse\n", name, failed);
+        return 1;
+    }
+
+    double requests_per_s = iterations * REQUEST_COUNT / elapsed;
+    printf("%-10s %12.0f %10.1f %10.0f\n", name, requests_per_s, iterations * (double) bytes / elapsed / 1e6,
+           elapsed * 1e9 / (iterations * REQUEST_COUNT));
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : ITERATIONS;
+
+    size_t bytes = 0;
+    for (size_t k = 0; k < REQUEST_COUNT; k++) {
+        lengths[k] = strlen(requests[k]);
+        bytes += lengths[k];
+    }
+
+    if (rtsp_parser_pool_create(1) != PARSER_OK) {
+        return 1;
+    }
+
+    printf("%-10s %12s %10s %10s\n", "parser", "requests/s", "MB/s", "ns/request");
+    int failed = report("before", run_baseline, iterations, bytes);
+    failed |= report("current", run_current, iterations, bytes);
+
+    rtsp_parser_pool_destroy();
+    return failed;
+}
@@ -0,0 +1,122 @@
+//
+// Created on 18/10/2026.
+//
+
+/* Replays a trace of frame sizes through the constant bitrate controller
+ * of esp-frame and prints how the bitrate settles. A trace has a line per
+ * frame with the capture time in us, fb->len and the quality the frame was
+ * taken with:
+ *
+ *   replay_cbr trace.txt
+ *
+ * The sizes are turned back into the scene complexity and the frame size
+ * at the quality the controller picks is derived from that, so a trace
+ * recorded at a fixed quality still closes the loop. Without a trace a
+ * scene is generated: steady, then motion that makes the frames 40%
+ * larger, then steady again. Every frame is taken at the quality the
+ * controller says the buffer was captured with, so a new quality shows as
+ * late as it does on the camera with CONFIG_ESP_FRAME_FB_COUNT buffers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sdkconfig.h"
+#include "esp-frame-rate.h"
+
+#define TARGET_BPS (CONFIG_ESP_FRAME_CBR_TARGET_KBPS * 1000)
+#define FRAME_INTERVAL_US 50000
+#define GENERATED_FRAMES 300
+#define PHASE_FRAMES 100
+
+// The bitrate over the last window of each phase has to be this close to the target
+#define TOLERANCE_PERCENT 10
+
+typedef struct {
+    int64_t timestamp;
+    uint32_t complexity;    // fb->len * (quality + 1)
+} trace_frame_t;
+
+static size_t generate_trace(trace_frame_t **trace) {
+    *trace = calloc(GENERATED_FRAMES, sizeof(trace_frame_t));
+
+    // 25 KB at quality 12 for the steady scene, with 10% noise
+    uint32_t state = 42;
+    for (size_t i = 0; i < GENERATED_FRAMES; i++) {
+        state = state * 1103515245 + 12345;
+        int noise = (int) ((state >> 16) % 21) - 10;
+        uint32_t complexity = 25000 * 13;
+        if (i >= PHASE_FRAMES && i < 2 * PHASE_FRAMES) {
+            complexity = complexity * 14 / 10;
+        }
+        (*trace)[i].timestamp = (int64_t) (i + 1) * FRAME_INTERVAL_US;
+        (*trace)[i].complexity = complexity * (100 + noise) / 100;
+    }
+
+    return GENERATED_FRAMES;
+}
+
+static size_t load_trace(const char *path, trace_frame_t **trace) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return 0;
+    }
+
+    size_t capacity = 256;
+    size_t count = 0;
+    *trace = malloc(capacity * sizeof(trace_frame_t));
+
+    long long timestamp;
+    unsigned long length;
+    int quality;
+    while (fscanf(file, "%lld %lu %d", &timestamp, &length, &quality) == 3) {
+        if (count == capacity) {
+            capacity *= 2;
+            *trace = realloc(*trace, capacity * sizeof(trace_frame_t));
+        }
+        (*trace)[count].timestamp = timestamp;
+        (*trace)[count].complexity = length * (quality + 1);
+        count++;
+    }
+
+    fclose(file);
+    return count;
+}
+
+int main(int argc, char **argv) {
+    trace_frame_t *trace;
+    size_t count = argc > 1 ? load_trace(argv[1], &trace) : generate_trace(&trace);
+    if (count == 0) {
+        fprintf(stderr, "No frames in the trace\n");
+        return 1;
+    }
+
+    esp_frame_rate_t rate;
+    esp_frame_rate_init(&rate, TARGET_BPS, CONFIG_ESP_FRAME_CBR_MIN_QUALITY, CONFIG_ESP_FRAME_CBR_MAX_QUALITY, 12,
+                        CONFIG_ESP_FRAME_FB_COUNT);
+
+    printf("%6s %8s %8s %8s %10s %10s\n", "frame", "quality", "bytes", "budget", "predicted", "kbit/s");
+
+    int failed = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t length = trace[i].complexity / (esp_frame_rate_capture_quality(&rate) + 1);
+        esp_frame_rate_update(&rate, length, trace[i].timestamp);
+
+        if (i % 10 == 9) {
+            printf("%6zu %8d %8zu %8u %10u %10u\n", i + 1, rate.stats.quality, length,
+                   rate.stats.budget_bytes, rate.stats.predicted_bytes, rate.stats.actual_bps / 1000);
+        }
+
+        // The generated scene must have settled at the end of every phase
+        if (argc == 1 && i % PHASE_FRAMES == PHASE_FRAMES - 1) {
+            uint32_t error = abs((int) rate.stats.actual_bps - TARGET_BPS) * 100 / TARGET_BPS;
+            printf("phase %zu: %u kbit/s, %u%% off the target\n", i / PHASE_FRAMES + 1, rate.stats.actual_bps / 1000, error);
+            if (error > TOLERANCE_PERCENT) {
+                failed = 1;
+            }
+        }
+    }
+
+    free(trace);
+    return failed;
+}
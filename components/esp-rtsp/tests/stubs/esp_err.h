@@ -0,0 +1,40 @@
+//
+// Created on 18/10/2026.
+//
+
+/* Host stand-ins for the ESP-IDF headers the component includes, only as
+ * much as the tests in this directory need.
+ */
+
+#ifndef ESPCAM_TEST_ESP_ERR_H
+#define ESPCAM_TEST_ESP_ERR_H
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdkconfig.h"
+
+typedef int esp_err_t;
+
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_NO_MEM 0x101
+#define ESP_ERR_INVALID_ARG 0x102
+#define ESP_ERR_INVALID_STATE 0x103
+#define ESP_ERR_INVALID_SIZE 0x104
+#define ESP_ERR_NOT_FOUND 0x105
+#define ESP_ERR_NOT_SUPPORTED 0x106
+#define ESP_ERR_TIMEOUT 0x107
+
+#define ESP_ERROR_CHECK(x) do { esp_err_t err_rc_ = (x); assert(err_rc_ == ESP_OK); (void) err_rc_; } while (0)
+
+const char *esp_err_to_name(esp_err_t code);
+uint32_t esp_random(void);
+void esp_rom_delay_us(uint32_t us);
+
+#endif //ESPCAM_TEST_ESP_ERR_H
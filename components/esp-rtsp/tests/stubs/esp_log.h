@@ -0,0 +1,19 @@
+//
+// Created on 18/10/2026.
+//
+
+#ifndef ESPCAM_TEST_ESP_LOG_H
+#define ESPCAM_TEST_ESP_LOG_H
+
+#include <stdio.h>
+
+#include "esp_err.h"
+
+// Warnings and errors go to stderr, the rest would drown the test output
+#define ESP_LOGE(tag, format, ...) fprintf(stderr, "E %s: " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) fprintf(stderr, "W %s: " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) do { if (0) fprintf(stderr, format, ##__VA_ARGS__); } while (0)
+#define ESP_LOGD(tag, format, ...) do { if (0) fprintf(stderr, format, ##__VA_ARGS__); } while (0)
+#define ESP_LOGV(tag, format, ...) do { if (0) fprintf(stderr, format, ##__VA_ARGS__); } while (0)
+
+#endif //ESPCAM_TEST_ESP_LOG_H
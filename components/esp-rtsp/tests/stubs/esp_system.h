@@ -0,0 +1,10 @@
+//
+// Created on 18/10/2026.
+//
+
+#ifndef ESPCAM_TEST_ESP_SYSTEM_H
+#define ESPCAM_TEST_ESP_SYSTEM_H
+
+#include "esp_err.h"
+
+#endif //ESPCAM_TEST_ESP_SYSTEM_H
@@ -0,0 +1,14 @@
+//
+// Created on 18/10/2026.
+//
+
+#ifndef ESPCAM_TEST_ESP_TIMER_H
+#define ESPCAM_TEST_ESP_TIMER_H
+
+#include "esp_err.h"
+
+// Monotonic time in us, the tests can move it with test_timer_advance
+int64_t esp_timer_get_time(void);
+void test_timer_advance(int64_t us);
+
+#endif //ESPCAM_TEST_ESP_TIMER_H
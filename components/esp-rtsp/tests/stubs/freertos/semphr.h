@@ -0,0 +1,17 @@
+//
+// Created on 18/10/2026.
+//
+
+#ifndef ESPCAM_TEST_SEMPHR_H
+#define ESPCAM_TEST_SEMPHR_H
+
+#include "queue.h"
+
+typedef void *SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore);
+void vSemaphoreDelete(SemaphoreHandle_t semaphore);
+
+#endif //ESPCAM_TEST_SEMPHR_H
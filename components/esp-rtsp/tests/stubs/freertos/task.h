@@ -0,0 +1,18 @@
+//
+// Created on 18/10/2026.
+//
+
+#ifndef ESPCAM_TEST_TASK_H
+#define ESPCAM_TEST_TASK_H
+
+#include "FreeRTOS.h"
+
+typedef void *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+BaseType_t xTaskCreate(TaskFunction_t task, const char *name, uint32_t stack_size, void *arg, UBaseType_t priority, TaskHandle_t *handle);
+void vTaskDelete(TaskHandle_t handle);
+void vTaskDelay(TickType_t ticks);
+TickType_t xTaskGetTickCount(void);
+
+#endif //ESPCAM_TEST_TASK_H
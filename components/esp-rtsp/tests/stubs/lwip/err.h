@@ -0,0 +1,8 @@
+//
+// Created on 18/10/2026.
+//
+
+#ifndef ESPCAM_TEST_LWIP_ERR_H
+#define ESPCAM_TEST_LWIP_ERR_H
+
+#endif //ESPCAM_TEST_LWIP_ERR_H
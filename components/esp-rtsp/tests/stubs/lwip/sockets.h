@@ -0,0 +1,25 @@
+//
+// Created on 18/10/2026.
+//
+
+#ifndef ESPCAM_TEST_LWIP_SOCKETS_H
+#define ESPCAM_TEST_LWIP_SOCKETS_H
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define PP_HTONS(x) htons(x)
+#define PP_HTONL(x) htonl(x)
+#define PP_NTOHS(x) ntohs(x)
+#define PP_NTOHL(x) ntohl(x)
+
+char *inet_ntoa_r(struct in_addr addr, char *buffer, int length);
+
+#endif //ESPCAM_TEST_LWIP_SOCKETS_H
@@ -0,0 +1,47 @@
+//
+// Created on 18/10/2026.
+//
+
+/* The Kconfig defaults, with the optional parts switched on so the tests
+ * build all of the code.
+ */
+
+#ifndef ESPCAM_TEST_SDKCONFIG_H
+#define ESPCAM_TEST_SDKCONFIG_H
+
+#define CONFIG_ESP_RTSP_PACER_RATE_KBPS 4000
+#define CONFIG_ESP_RTSP_PACER_BURST_BYTES 6000
+#define CONFIG_ESP_RTSP_SEND_QUEUE_LENGTH 32
+#define CONFIG_ESP_RTSP_RTP_PORT 9000
+#define CONFIG_ESP_RTSP_RTP_DSCP 34
+// test_dscp sets its own code points to tell the sockets apart
+#ifndef CONFIG_ESP_RTSP_RTCP_DSCP
+#define CONFIG_ESP_RTSP_RTCP_DSCP 34
+#endif
+#ifndef CONFIG_ESP_RTSP_CONTROL_DSCP
+#define CONFIG_ESP_RTSP_CONTROL_DSCP 0
+#endif
+#define CONFIG_ESP_RTSP_MAX_PAYLOAD_SIZE 1472
+#define CONFIG_ESP_RTSP_RTCP_INTERVAL_MS 5000
+#define CONFIG_ESP_RTSP_JPEG_RESTART 1
+#define CONFIG_ESP_RTSP_MULTICAST 1
+#define CONFIG_ESP_RTSP_MULTICAST_GROUP "239.255.42.42"
+#define CONFIG_ESP_RTSP_MULTICAST_PORT 5004
+#define CONFIG_ESP_RTSP_MULTICAST_TTL 1
+#define CONFIG_ESP_RTSP_NACK 1
+#define CONFIG_ESP_RTSP_NACK_HISTORY_PACKETS 128
+#define CONFIG_ESP_RTSP_NACK_HISTORY_FRAMES 1
+#define CONFIG_ESP_RTSP_NACK_HISTORY_KB 128
+#define CONFIG_ESP_RTSP_FEC 1
+#define CONFIG_ESP_RTSP_FEC_GROUP_SIZE 8
+#define CONFIG_ESP_RTSP_FEC_PAYLOAD_TYPE 127
+#define CONFIG_ESP_RTSP_ADAPT 1
+#define CONFIG_ESP_RTSP_ADAPT_POLICY_WORST 1
+
+#define CONFIG_ESP_FRAME_FB_COUNT 2
+#define CONFIG_ESP_FRAME_CBR 1
+#define CONFIG_ESP_FRAME_CBR_TARGET_KBPS 2000
+#define CONFIG_ESP_FRAME_CBR_MIN_QUALITY 8
+#define CONFIG_ESP_FRAME_CBR_MAX_QUALITY 40
+
+#endif //ESPCAM_TEST_SDKCONFIG_H
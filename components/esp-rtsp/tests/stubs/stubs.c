@@ -0,0 +1,110 @@
+//
+// Created on 18/10/2026.
+//
+
+/* Host implementations of the few ESP-IDF and FreeRTOS calls the component
+ * makes. Tasks are threads and every lock is a mutex, that is enough for
+ * the tests, not for measuring anything about the ESP32.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <esp_err.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <lwip/sockets.h>
+
+static pthread_mutex_t critical_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+static int64_t timer_offset;
+
+const char *esp_err_to_name(esp_err_t code) {
+    switch (code) {
+        case ESP_OK:
+            return "ESP_OK";
+        case ESP_ERR_NO_MEM:
+            return "ESP_ERR_NO_MEM";
+        case ESP_ERR_INVALID_ARG:
+            return "ESP_ERR_INVALID_ARG";
+        case ESP_ERR_INVALID_STATE:
+            return "ESP_ERR_INVALID_STATE";
+        default:
+            return "ESP_FAIL";
+    }
+}
+
+uint32_t esp_random(void) {
+    return (uint32_t) random();
+}
+
+void esp_rom_delay_us(uint32_t us) {
+    usleep(us);
+}
+
+int64_t esp_timer_get_time(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000 + timer_offset;
+}
+
+void test_timer_advance(int64_t us) {
+    timer_offset += us;
+}
+
+void portENTER_CRITICAL(portMUX_TYPE *mux) {
+    (void) mux;
+    pthread_mutex_lock(&critical_lock);
+}
+
+void portEXIT_CRITICAL(portMUX_TYPE *mux) {
+    (void) mux;
+    pthread_mutex_unlock(&critical_lock);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+    pthread_mutex_t *mutex = malloc(sizeof(pthread_mutex_t));
+    if (mutex) {
+        pthread_mutex_init(mutex, NULL);
+    }
+    return mutex;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks) {
+    if (ticks == portMAX_DELAY) {
+        return pthread_mutex_lock(semaphore) == 0 ? pdTRUE : pdFALSE;
+    }
+
+    for (TickType_t tick = 0;; tick++) {
+        if (pthread_mutex_trylock(semaphore) == 0) {
+            return pdTRUE;
+        }
+        if (tick >= ticks) {
+            return pdFALSE;
+        }
+        usleep(portTICK_PERIOD_MS * 1000);
+    }
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+    return pthread_mutex_unlock(semaphore) == 0 ? pdTRUE : pdFALSE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore) {
+    pthread_mutex_destroy(semaphore);
+    free(semaphore);
+}
+
+void vTaskDelay(TickType_t ticks) {
+    usleep(ticks * portTICK_PERIOD_MS * 1000);
+}
+
+TickType_t xTaskGetTickCount(void) {
+    return (TickType_t) (esp_timer_get_time() / (portTICK_PERIOD_MS * 1000));
+}
+
+char *inet_ntoa_r(struct in_addr addr, char *buffer, int length) {
+    return (char *) inet_ntop(AF_INET, &addr, buffer, length);
+}
@@ -0,0 +1,107 @@
+//
+// Created on 18/10/2026.
+//
+
+/* Reads the TOS byte back from every socket the server marks: the shared
+ * RTP and RTCP sockets, the multicast sockets and an RTSP connection while
+ * it carries interleaved RTP and after it is handed back to RTSP.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include <esp_err.h>
+#include <lwip/sockets.h>
+
+#include "rtp-udp.h"
+#include "test.h"
+
+#define RECEIVER_PORT 9104
+
+static int get_dscp(int sockfd) {
+    int tos = 0;
+    socklen_t length = sizeof(tos);
+    if (getsockopt(sockfd, IPPROTO_IP, IP_TOS, &tos, &length) < 0) {
+        return -1;
+    }
+
+    return (tos & 0xFF) >> 2;
+}
+
+static void test_unicast_sockets() {
+    esp_rtp_session_handle_t handle;
+    TEST_ASSERT(esp_rtp_init(&handle, RECEIVER_PORT, RECEIVER_PORT + 1, false, "127.0.0.1") == ESP_OK);
+    esp_rtp_session_t *session = handle;
+
+    int rtp_dscp = get_dscp(session->rtp_socket);
+    int rtcp_dscp = get_dscp(session->rtcp_socket);
+    esp_rtp_teardown(handle);
+
+    TEST_ASSERT(rtp_dscp == CONFIG_ESP_RTSP_RTP_DSCP);
+    TEST_ASSERT(rtcp_dscp == CONFIG_ESP_RTSP_RTCP_DSCP);
+}
+
+static void test_rtcp_mux_sends_as_rtp() {
+    esp_rtp_session_handle_t handle;
+    TEST_ASSERT(esp_rtp_init(&handle, RECEIVER_PORT, RECEIVER_PORT, true, "127.0.0.1") == ESP_OK);
+    esp_rtp_session_t *session = handle;
+
+    int rtcp_dscp = get_dscp(session->rtcp_socket);
+    esp_rtp_teardown(handle);
+
+    TEST_ASSERT(rtcp_dscp == CONFIG_ESP_RTSP_RTP_DSCP);
+}
+
+static void test_multicast_sockets() {
+    esp_rtp_session_handle_t handle;
+    TEST_ASSERT(esp_rtp_init_multicast(&handle, CONFIG_ESP_RTSP_MULTICAST_GROUP, CONFIG_ESP_RTSP_MULTICAST_PORT,
+                                       CONFIG_ESP_RTSP_MULTICAST_TTL) == ESP_OK);
+    esp_rtp_session_t *session = handle;
+
+    int rtp_dscp = get_dscp(session->rtp_socket);
+    int rtcp_dscp = get_dscp(session->rtcp_socket);
+    esp_rtp_teardown(handle);
+
+    TEST_ASSERT(rtp_dscp == CONFIG_ESP_RTSP_RTP_DSCP);
+    TEST_ASSERT(rtcp_dscp == CONFIG_ESP_RTSP_RTCP_DSCP);
+}
+
+static void test_interleaved_connection() {
+    int sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    TEST_ASSERT(sockfd >= 0);
+
+    // As the server does when it accepts a connection
+    esp_rtp_socket_set_dscp(sockfd, CONFIG_ESP_RTSP_CONTROL_DSCP);
+    int control_dscp = get_dscp(sockfd);
+
+    esp_rtp_session_handle_t handle;
+    if (esp_rtp_init_interleaved(&handle, sockfd, 0, 1) != ESP_OK) {
+        close(sockfd);
+        TEST_ASSERT(false);
+    }
+    int interleaved_dscp = get_dscp(sockfd);
+
+    // As the server does on teardown
+    esp_rtp_teardown(handle);
+    esp_rtp_socket_set_dscp(sockfd, CONFIG_ESP_RTSP_CONTROL_DSCP);
+    int restored_dscp = get_dscp(sockfd);
+    close(sockfd);
+
+    TEST_ASSERT(control_dscp == CONFIG_ESP_RTSP_CONTROL_DSCP);
+    TEST_ASSERT(interleaved_dscp == CONFIG_ESP_RTSP_RTP_DSCP);
+    TEST_ASSERT(restored_dscp == CONFIG_ESP_RTSP_CONTROL_DSCP);
+}
+
+int main() {
+    if (esp_rtp_start() != ESP_OK) {
+        fprintf(stderr, "Unable to open the sockets\n");
+        return 1;
+    }
+
+    TEST_RUN(test_unicast_sockets);
+    TEST_RUN(test_rtcp_mux_sends_as_rtp);
+    TEST_RUN(test_multicast_sockets);
+    TEST_RUN(test_interleaved_connection);
+
+    return TEST_RESULT();
+}
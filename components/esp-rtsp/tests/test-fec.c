@@ -0,0 +1,278 @@
+//
+// Created on 18/10/2026.
+//
+
+/* Sends frames through a session with FEC and recovers every media packet
+ * from its FEC packet and the rest of its group, the way a RFC 5109
+ * receiver would, then compares the result with the packet that arrived.
+ */
+
+#include <stdio.h>
+
+#include <esp_err.h>
+#include <lwip/sockets.h>
+
+#include "rtp-jpeg.h"
+#include "rtp-udp.h"
+#include "test.h"
+#include "test-frames.h"
+
+#define RECEIVER_PORT 9102
+#define MAX_PACKETS 256
+
+typedef struct {
+    uint8_t data[MAX_PAYLOAD_SIZE];
+    size_t length;
+} packet_t;
+
+static int receiver_socket;
+static packet_t packets[MAX_PACKETS];
+static size_t packet_count;
+
+static int open_receiver() {
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    int size = 4 * 1024 * 1024;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    struct sockaddr_in addr = {
+            .sin_family = AF_INET,
+            .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+            .sin_port = htons(RECEIVER_PORT),
+    };
+    if (sock < 0 || bind(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        return -1;
+    }
+    return sock;
+}
+
+static void receive_packets() {
+    packet_count = 0;
+    while (packet_count < MAX_PACKETS) {
+        ssize_t length = recv(receiver_socket, packets[packet_count].data, MAX_PAYLOAD_SIZE, MSG_DONTWAIT);
+        if (length <= 0) {
+            break;
+        }
+        packets[packet_count++].length = length;
+    }
+}
+
+static uint16_t sequence_of(const packet_t *packet) {
+    return packet->data[2] << 8 | packet->data[3];
+}
+
+static int is_fec(const packet_t *packet) {
+    return (packet->data[1] & 0x7F) == CONFIG_ESP_RTSP_FEC_PAYLOAD_TYPE;
+}
+
+static const packet_t *find_media(uint16_t sequence_number) {
+    for (size_t i = 0; i < packet_count; i++) {
+        if (!is_fec(&packets[i]) && sequence_of(&packets[i]) == sequence_number) {
+            return &packets[i];
+        }
+    }
+    return NULL;
+}
+
+/* Rebuilds the media packet with the given sequence number from the FEC
+ * packet and the other packets in its mask, RFC 5109 section 10.
+ */
+static int recover(const packet_t *fec, uint16_t missing, packet_t *recovered) {
+    const uint8_t *fec_header = fec->data + RTP_HEADER_SIZE;
+    const uint8_t *level_header = fec_header + RTP_FEC_HEADER_SIZE;
+    const uint8_t *fec_payload = level_header + RTP_FEC_LEVEL_HEADER_SIZE;
+
+    uint16_t sn_base = fec_header[2] << 8 | fec_header[3];
+    uint16_t protection_length = level_header[0] << 8 | level_header[1];
+    uint16_t mask = level_header[2] << 8 | level_header[3];
+
+    uint8_t bits[10];
+    memcpy(bits, fec_header, 2);
+    memcpy(bits + 2, fec_header + 4, 6);    // Timestamp and length recovery
+    uint8_t payload[MAX_PAYLOAD_SIZE] = { 0 };
+    memcpy(payload, fec_payload, protection_length);
+
+    for (int bit = 0; bit < 16; bit++) {
+        if (!(mask & (0x8000 >> bit))) {
+            continue;
+        }
+        uint16_t sequence_number = sn_base + bit;
+        if (sequence_number == missing) {
+            continue;
+        }
+
+        const packet_t *packet = find_media(sequence_number);
+        if (!packet) {
+            return false;
+        }
+
+        uint16_t length = packet->length - RTP_HEADER_SIZE;
+        bits[0] ^= packet->data[0];
+        bits[1] ^= packet->data[1];
+        for (int i = 0; i < 4; i++) {
+            bits[2 + i] ^= packet->data[4 + i];
+        }
+        bits[6] ^= length >> 8;
+        bits[7] ^= length & 0xFF;
+        for (size_t i = 0; i < length; i++) {
+            payload[i] ^= packet->data[RTP_HEADER_SIZE + i];
+        }
+    }
+
+    uint16_t length = bits[6] << 8 | bits[7];
+    recovered->data[0] = 0x80 | (bits[0] & 0x3F);
+    recovered->data[1] = bits[1];
+    recovered->data[2] = missing >> 8;
+    recovered->data[3] = missing & 0xFF;
+    memcpy(recovered->data + 4, bits + 2, 4);
+    memcpy(recovered->data + 8, fec->data + 8, 4);  // SSRC of the FEC packet
+    memcpy(recovered->data + RTP_HEADER_SIZE, payload, length);
+    recovered->length = RTP_HEADER_SIZE + length;
+    return true;
+}
+
+/* Recovers every media packet of every group. Returns the number of FEC
+ * packets, group_sizes gets the number of media packets they protect.
+ */
+static size_t check_recovery(uint8_t *group_sizes, size_t max_groups) {
+    size_t groups = 0;
+    for (size_t i = 0; i < packet_count; i++) {
+        const packet_t *fec = &packets[i];
+        if (!is_fec(fec)) {
+            continue;
+        }
+
+        const uint8_t *fec_header = fec->data + RTP_HEADER_SIZE;
+        uint16_t sn_base = fec_header[2] << 8 | fec_header[3];
+        uint16_t mask = fec_header[RTP_FEC_HEADER_SIZE + 2] << 8 | fec_header[RTP_FEC_HEADER_SIZE + 3];
+
+        uint8_t size = 0;
+        for (int bit = 0; bit < 16; bit++) {
+            if (!(mask & (0x8000 >> bit))) {
+                continue;
+            }
+            size++;
+
+            uint16_t missing = sn_base + bit;
+            const packet_t *original = find_media(missing);
+            packet_t recovered;
+            if (!original || !recover(fec, missing, &recovered) ||
+                recovered.length != original->length || memcmp(recovered.data, original->data, original->length) != 0) {
+                fprintf(stderr, "Packet %u not recovered from the group at %u\n", missing, sn_base);
+                return 0;
+            }
+        }
+
+        if (groups < max_groups) {
+            group_sizes[groups] = size;
+        }
+        groups++;
+    }
+    return groups;
+}
+
+static esp_rtp_session_t *session;
+
+// Sized for the session like the pacer does, which leaves room for the FEC headers
+static esp_rtp_jpeg_frame_t *packetize(const test_frame_spec_t *spec) {
+    esp_frame_t *frame = test_frame_create(spec);
+    esp_rtp_jpeg_frame_t *jpeg_frame = NULL;
+    if (frame) {
+        esp_rtp_jpeg_packetize(frame, esp_rtp_get_max_payload_size(session), &jpeg_frame);
+        esp_frame_unref(frame);
+    }
+    return jpeg_frame;
+}
+
+static void test_sequence_wrap() {
+    esp_rtp_set_fec_group_size(session, 8);
+    // The second group runs from 0xFFFD over the wrap to 0x0004
+    session->sequence_number = 0xFFF4;
+
+    esp_rtp_jpeg_frame_t *jpeg_frame = packetize(&test_frame_corpus[1]);
+    TEST_ASSERT(jpeg_frame != NULL);
+    for (size_t index = 0; index < jpeg_frame->packet_count; index++) {
+        TEST_ASSERT(esp_rtp_send_jpeg_packet(session, jpeg_frame, index) == ESP_OK);
+    }
+    receive_packets();
+
+    uint8_t group_sizes[16];
+    size_t groups = check_recovery(group_sizes, 16);
+    TEST_ASSERT(packet_count == jpeg_frame->packet_count + groups);
+    TEST_ASSERT(groups == (jpeg_frame->packet_count + 7) / 8);
+    TEST_ASSERT(group_sizes[0] == 8 && group_sizes[1] == 8);
+
+    // The FEC packet of the first group takes 0xFFFC, the second group starts after it and wraps
+    const uint8_t *fec_header = packets[17].data + RTP_HEADER_SIZE;
+    TEST_ASSERT(is_fec(&packets[8]) && is_fec(&packets[17]));
+    TEST_ASSERT((fec_header[2] << 8 | fec_header[3]) == 0xFFFD);
+    TEST_ASSERT(sequence_of(&packets[11]) == 0xFFFF && sequence_of(&packets[12]) == 0x0000);
+
+    esp_rtp_jpeg_frame_unref(jpeg_frame);
+}
+
+static void test_group_size_change() {
+    esp_rtp_set_fec_group_size(session, 8);
+    esp_rtp_jpeg_frame_t *jpeg_frame = packetize(&test_frame_corpus[2]);
+    TEST_ASSERT(jpeg_frame != NULL && jpeg_frame->packet_count > 20);
+
+    for (size_t index = 0; index < jpeg_frame->packet_count; index++) {
+        // In the middle of the second group, it has to finish with the old size
+        if (index == 10) {
+            esp_rtp_set_fec_group_size(session, 4);
+        }
+        TEST_ASSERT(esp_rtp_send_jpeg_packet(session, jpeg_frame, index) == ESP_OK);
+    }
+    receive_packets();
+
+    uint8_t group_sizes[16];
+    size_t groups = check_recovery(group_sizes, 16);
+    TEST_ASSERT(groups > 3 && groups <= 16);
+    TEST_ASSERT(packet_count == jpeg_frame->packet_count + groups);
+    TEST_ASSERT(group_sizes[0] == 8 && group_sizes[1] == 8);
+    for (size_t i = 2; i < groups; i++) {
+        // The last group ends with the frame and may be short
+        TEST_ASSERT(group_sizes[i] == 4 || (i == groups - 1 && group_sizes[i] < 4));
+    }
+
+    esp_rtp_jpeg_frame_unref(jpeg_frame);
+}
+
+static void test_group_ends_with_frame() {
+    esp_rtp_set_fec_group_size(session, 16);
+    esp_rtp_jpeg_frame_t *jpeg_frame = packetize(&test_frame_corpus[0]);
+    TEST_ASSERT(jpeg_frame != NULL && jpeg_frame->packet_count < 16);
+
+    for (size_t index = 0; index < jpeg_frame->packet_count; index++) {
+        TEST_ASSERT(esp_rtp_send_jpeg_packet(session, jpeg_frame, index) == ESP_OK);
+    }
+    receive_packets();
+
+    uint8_t group_sizes[1];
+    TEST_ASSERT(check_recovery(group_sizes, 1) == 1);
+    TEST_ASSERT(group_sizes[0] == jpeg_frame->packet_count);
+    TEST_ASSERT(is_fec(&packets[packet_count - 1]));
+
+    esp_rtp_jpeg_frame_unref(jpeg_frame);
+}
+
+int main() {
+    receiver_socket = open_receiver();
+    if (receiver_socket < 0 || esp_rtp_start() != ESP_OK) {
+        fprintf(stderr, "Unable to open the sockets\n");
+        return 1;
+    }
+
+    esp_rtp_session_handle_t handle;
+    if (esp_rtp_init(&handle, RECEIVER_PORT, RECEIVER_PORT + 1, false, "127.0.0.1") != ESP_OK) {
+        return 1;
+    }
+    session = handle;
+
+    TEST_RUN(test_sequence_wrap);
+    TEST_RUN(test_group_size_change);
+    TEST_RUN(test_group_ends_with_frame);
+
+    esp_rtp_teardown(handle);
+    close(receiver_socket);
+    return TEST_RESULT();
+}
@@ -0,0 +1,223 @@
+//
+// Created on 18/10/2026.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test-frames.h"
+
+/* Sizes as the OV2640 delivers them at the usual quality settings, one
+ * frame with restart markers for the RFC 2435 types 64-127.
+ */
+const test_frame_spec_t test_frame_corpus[] = {
+        { .name = "qvga-q12", .width = 320, .height = 240, .quality = 12, .scan_length = 9 * 1024, .seed = 1 },
+        { .name = "vga-q12", .width = 640, .height = 480, .quality = 12, .scan_length = 28 * 1024, .seed = 2 },
+        { .name = "svga-q10", .width = 800, .height = 600, .quality = 10, .scan_length = 46 * 1024, .seed = 3 },
+        { .name = "uxga-q12", .width = 1600, .height = 1200, .quality = 12, .scan_length = 118 * 1024, .seed = 4 },
+        { .name = "vga-q12-dri", .width = 640, .height = 480, .quality = 12, .scan_length = 28 * 1024, .restart_interval = 40, .seed = 5 },
+};
+
+const size_t test_frame_corpus_count = sizeof(test_frame_corpus) / sizeof(test_frame_corpus[0]);
+
+static const uint8_t luma_quantizer[64] = {
+        16, 11, 12, 14, 12, 10, 16, 14,
+        13, 14, 18, 17, 16, 19, 24, 40,
+        26, 24, 22, 22, 24, 49, 35, 37,
+        29, 40, 58, 51, 61, 60, 57, 51,
+        56, 55, 64, 72, 92, 78, 64, 68,
+        87, 69, 55, 56, 80, 109, 81, 87,
+        95, 98, 103, 104, 103, 62, 77, 113,
+        121, 112, 100, 120, 92, 101, 103, 99
+};
+
+static const uint8_t chroma_quantizer[64] = {
+        17, 18, 18, 24, 21, 24, 47, 26,
+        26, 47, 99, 66, 56, 66, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99
+};
+
+// Code lengths of the four standard Huffman tables, JPEG spec K.3
+static const uint8_t huffman_bits[4][16] = {
+        { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 },
+        { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7D },
+        { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 },
+        { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 },
+};
+
+static const uint8_t huffman_class[4] = { 0x00, 0x10, 0x01, 0x11 };
+
+static uint32_t next_random(uint32_t *state) {
+    *state = *state * 1103515245 + 12345;
+    return *state >> 16;
+}
+
+static uint8_t *put_u16(uint8_t *position, uint16_t value) {
+    position[0] = value >> 8;
+    position[1] = value & 0xFF;
+    return position + 2;
+}
+
+static uint8_t *put_dqt(uint8_t *position, uint8_t table_id, const uint8_t *base, int quality) {
+    // The sensor quality runs the other way from libjpeg's, 0 is best
+    int scale = quality < 1 ? 1 : quality * 8;
+
+    *position++ = 0xFF;
+    *position++ = 0xDB;
+    position = put_u16(position, 2 + 65);
+    *position++ = table_id;
+    for (int i = 0; i < 64; i++) {
+        int value = base[i] * scale / 100;
+        *position++ = value < 1 ? 1 : value > 255 ? 255 : value;
+    }
+    return position;
+}
+
+static uint8_t *put_dht(uint8_t *position) {
+    *position++ = 0xFF;
+    *position++ = 0xC4;
+    uint8_t *length = position;
+    position += 2;
+
+    for (int table = 0; table < 4; table++) {
+        *position++ = huffman_class[table];
+        int symbols = 0;
+        for (int i = 0; i < 16; i++) {
+            *position++ = huffman_bits[table][i];
+            symbols += huffman_bits[table][i];
+        }
+        // The symbols are placeholders, nothing decodes the scan
+        for (int i = 0; i < symbols; i++) {
+            *position++ = i;
+        }
+    }
+
+    put_u16(length, position - length);
+    return position;
+}
+
+esp_frame_t *test_frame_create(const test_frame_spec_t *spec) {
+    // Headers are about 620 bytes, stuffing adds at most one byte per scan byte
+    size_t capacity = 1024 + spec->scan_length * 2;
+    uint8_t *buffer = malloc(capacity);
+    esp_frame_t *frame = calloc(1, sizeof(esp_frame_t));
+    if (!buffer || !frame) {
+        free(buffer);
+        free(frame);
+        return NULL;
+    }
+
+    uint8_t *position = buffer;
+    static const uint8_t jfif[] = {
+            0xFF, 0xD8,
+            0xFF, 0xE0, 0x00, 0x10, 'J', 'F', 'I', 'F', 0x00, 0x01, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+    };
+    memcpy(position, jfif, sizeof(jfif));
+    position += sizeof(jfif);
+
+    position = put_dqt(position, 0, luma_quantizer, spec->quality);
+    position = put_dqt(position, 1, chroma_quantizer, spec->quality);
+
+    static const uint8_t components[] = { 0x03, 0x01, 0x21, 0x00, 0x02, 0x11, 0x01, 0x03, 0x11, 0x01 };
+    *position++ = 0xFF;
+    *position++ = 0xC0;
+    position = put_u16(position, 2 + 1 + 4 + sizeof(components));
+    *position++ = 8;
+    position = put_u16(position, spec->height);
+    position = put_u16(position, spec->width);
+    memcpy(position, components, sizeof(components));
+    position += sizeof(components);
+
+    if (spec->restart_interval) {
+        *position++ = 0xFF;
+        *position++ = 0xDD;
+        position = put_u16(position, 4);
+        position = put_u16(position, spec->restart_interval);
+    }
+
+    position = put_dht(position);
+
+    static const uint8_t sos[] = { 0xFF, 0xDA, 0x00, 0x0C, 0x03, 0x01, 0x00, 0x02, 0x11, 0x03, 0x11, 0x00, 0x3F, 0x00 };
+    memcpy(position, sos, sizeof(sos));
+    position += sizeof(sos);
+
+    // 4:2:2 MCUs are 16x8 pixels
+    size_t mcus = ((spec->width + 15) / 16) * ((spec->height + 7) / 8);
+    size_t intervals = spec->restart_interval ? (mcus + spec->restart_interval - 1) / spec->restart_interval : 1;
+    size_t interval_length = spec->scan_length / intervals;
+
+    uint32_t state = spec->seed;
+    for (size_t interval = 0; interval < intervals; interval++) {
+        if (interval > 0) {
+            *position++ = 0xFF;
+            *position++ = 0xD0 + (interval - 1) % 8;
+        }
+        for (size_t i = 0; i < interval_length; i++) {
+            uint8_t value = next_random(&state);
+            *position++ = value;
+            if (value == 0xFF) {
+                *position++ = 0x00;
+            }
+        }
+    }
+
+    *position++ = 0xFF;
+    *position++ = 0xD9;
+    while ((position - buffer) & 3) {
+        *position++ = 0x00;
+    }
+
+    frame->buf = buffer;
+    frame->len = position - buffer;
+    frame->width = spec->width;
+    frame->height = spec->height;
+    frame->refcount = 1;
+    return frame;
+}
+
+esp_frame_t *test_frame_load(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    uint8_t *buffer = malloc(length > 0 ? length : 1);
+    esp_frame_t *frame = calloc(1, sizeof(esp_frame_t));
+    if (!buffer || !frame || length <= 0 || fread(buffer, 1, length, file) != (size_t) length) {
+        fclose(file);
+        free(buffer);
+        free(frame);
+        return NULL;
+    }
+    fclose(file);
+
+    frame->buf = buffer;
+    frame->len = length;
+    frame->refcount = 1;
+    return frame;
+}
+
+/* The component only needs the reference counting of esp-frame, the test
+ * frames own their buffer instead of a camera frame buffer.
+ */
+esp_frame_t *esp_frame_ref(esp_frame_t *frame) {
+    __atomic_add_fetch(&frame->refcount, 1, __ATOMIC_SEQ_CST);
+    return frame;
+}
+
+void esp_frame_unref(esp_frame_t *frame) {
+    if (frame && __atomic_sub_fetch(&frame->refcount, 1, __ATOMIC_SEQ_CST) == 0) {
+        free(frame->buf);
+        free(frame);
+    }
+}
@@ -0,0 +1,42 @@
+//
+// Created on 18/10/2026.
+//
+
+#ifndef ESPCAM_TEST_FRAMES_H
+#define ESPCAM_TEST_FRAMES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp-frame.h"
+
+/* A generated frame with the segment layout the OV2640 produces: SOI,
+ * JFIF APP0, one DQT segment per table, SOF0 with 4:2:2 sampling, a single
+ * DHT segment with all four tables, SOS, the scan and EOI followed by zero
+ * padding up to a 4 byte boundary. The scan is random data with stuffed
+ * 0xFF bytes, nothing in the component decodes it. The tables are scaled
+ * with the truncating rounding of the sensor, so like on the camera they
+ * don't match the RFC 2435 tables and are sent in-band.
+ */
+typedef struct {
+    const char *name;
+    uint16_t width;
+    uint16_t height;
+    int quality;                // Sensor quality 0-63, lower means larger frames
+    size_t scan_length;
+    uint16_t restart_interval;  // MCUs per interval, 0 leaves out DRI and the RST markers
+    uint32_t seed;
+} test_frame_spec_t;
+
+extern const test_frame_spec_t test_frame_corpus[];
+extern const size_t test_frame_corpus_count;
+
+/* Builds the frame in a new buffer, the frame is released with
+ * esp_frame_unref like a camera frame.
+ */
+esp_frame_t *test_frame_create(const test_frame_spec_t *spec);
+
+/* Wraps a JPEG file, for running the benchmarks on real captures. */
+esp_frame_t *test_frame_load(const char *path);
+
+#endif //ESPCAM_TEST_FRAMES_H
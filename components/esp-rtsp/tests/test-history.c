@@ -0,0 +1,142 @@
+//
+// Created on 18/10/2026.
+//
+
+/* The frames kept by the packet histories are bounded over all sessions,
+ * CONFIG_ESP_RTSP_NACK_HISTORY_FRAMES is 1 in the test sdkconfig.
+ */
+
+#include <stdio.h>
+
+#include <esp_err.h>
+
+#include "rtp-history.h"
+#include "test.h"
+
+#define PACKETS_PER_FRAME 4
+
+static uint32_t next_sequence;
+
+// A packetized frame around a camera frame without data, the history only looks at the references
+static esp_rtp_jpeg_frame_t *create_frame(esp_frame_t **camera_frame) {
+    esp_frame_t *frame = calloc(1, sizeof(esp_frame_t));
+    frame->buf = malloc(1);
+    frame->len = 10000;
+    frame->sequence = next_sequence++;
+    frame->refcount = 1;
+
+    esp_rtp_jpeg_frame_t *jpeg_frame = calloc(1, sizeof(esp_rtp_jpeg_frame_t));
+    jpeg_frame->refcount = 1;
+    jpeg_frame->frame = esp_frame_ref(frame);
+    jpeg_frame->packet_count = PACKETS_PER_FRAME;
+
+    *camera_frame = frame;
+    return jpeg_frame;
+}
+
+static void add_frame(esp_rtp_history_t *history, uint16_t *sequence_number, esp_rtp_jpeg_frame_t *jpeg_frame) {
+    for (size_t index = 0; index < PACKETS_PER_FRAME; index++) {
+        esp_rtp_history_add(history, (*sequence_number)++, jpeg_frame, index);
+    }
+}
+
+static void test_newer_frame_releases_everywhere() {
+    esp_rtp_history_t first, second;
+    TEST_ASSERT(esp_rtp_history_init(&first, 64, 128 * 1024) == ESP_OK);
+    TEST_ASSERT(esp_rtp_history_init(&second, 64, 128 * 1024) == ESP_OK);
+    uint16_t first_sequence = 100, second_sequence = 5000;
+
+    esp_frame_t *old_frame, *new_frame;
+    esp_rtp_jpeg_frame_t *old_jpeg = create_frame(&old_frame);
+    esp_rtp_jpeg_frame_t *new_jpeg = create_frame(&new_frame);
+
+    add_frame(&first, &first_sequence, old_jpeg);
+    add_frame(&second, &second_sequence, old_jpeg);
+    esp_rtp_jpeg_frame_unref(old_jpeg);
+    TEST_ASSERT(first.stats.frames == 1 && second.stats.frames == 1);
+
+    // Only the first session sends the new frame, the second one stalls
+    add_frame(&first, &first_sequence, new_jpeg);
+    TEST_ASSERT(first.stats.frames == 1 && first.stats.packets == PACKETS_PER_FRAME);
+    TEST_ASSERT(second.stats.frames == 0 && second.stats.packets == 0);
+    TEST_ASSERT(old_frame->refcount == 1);   // Only the reference of the test is left
+
+    size_t index;
+    TEST_ASSERT(esp_rtp_history_find(&second, 5000, &index) == NULL);
+    esp_rtp_jpeg_frame_t *found = esp_rtp_history_find(&first, 104, &index);
+    TEST_ASSERT(found == new_jpeg && index == 0);
+    esp_rtp_jpeg_frame_unref(found);
+
+    esp_frame_unref(old_frame);
+    esp_rtp_jpeg_frame_unref(new_jpeg);
+    esp_rtp_history_free(&first);
+    esp_rtp_history_free(&second);
+}
+
+static void test_lagging_session_is_refused() {
+    esp_rtp_history_t first, second;
+    TEST_ASSERT(esp_rtp_history_init(&first, 64, 128 * 1024) == ESP_OK);
+    TEST_ASSERT(esp_rtp_history_init(&second, 64, 128 * 1024) == ESP_OK);
+    uint16_t first_sequence = 0, second_sequence = 0;
+
+    esp_frame_t *old_frame, *new_frame;
+    esp_rtp_jpeg_frame_t *old_jpeg = create_frame(&old_frame);
+    esp_rtp_jpeg_frame_t *new_jpeg = create_frame(&new_frame);
+
+    add_frame(&first, &first_sequence, new_jpeg);
+    // The second session is still sending the older frame, it must not push out the newer one
+    add_frame(&second, &second_sequence, old_jpeg);
+    TEST_ASSERT(first.stats.frames == 1);
+    TEST_ASSERT(second.stats.frames == 0);
+    TEST_ASSERT(old_jpeg->refcount == 1);
+
+    add_frame(&second, &second_sequence, new_jpeg);
+    TEST_ASSERT(first.stats.frames == 1 && second.stats.frames == 1);
+
+    esp_rtp_jpeg_frame_unref(old_jpeg);
+    esp_rtp_jpeg_frame_unref(new_jpeg);
+    esp_rtp_history_free(&first);
+    esp_rtp_history_free(&second);
+}
+
+static void test_pinned_frames_bounded() {
+    esp_rtp_history_t histories[3];
+    uint16_t sequence_numbers[3] = { 0 };
+    for (int i = 0; i < 3; i++) {
+        TEST_ASSERT(esp_rtp_history_init(&histories[i], 128, 1024 * 1024) == ESP_OK);
+    }
+
+    esp_frame_t *frames[20];
+    for (int n = 0; n < 20; n++) {
+        esp_rtp_jpeg_frame_t *jpeg_frame = create_frame(&frames[n]);
+        // Sessions skip frames now and then, like a session with a full send queue
+        for (int i = 0; i < 3; i++) {
+            if ((n + i) % 4 != 0) {
+                add_frame(&histories[i], &sequence_numbers[i], jpeg_frame);
+            }
+        }
+        esp_rtp_jpeg_frame_unref(jpeg_frame);
+
+        // Our own reference is the only one left on every frame but the kept one
+        int pinned = 0;
+        for (int k = 0; k <= n; k++) {
+            pinned += frames[k]->refcount > 1;
+        }
+        TEST_ASSERT(pinned <= CONFIG_ESP_RTSP_NACK_HISTORY_FRAMES);
+    }
+
+    for (int i = 0; i < 3; i++) {
+        esp_rtp_history_free(&histories[i]);
+    }
+    for (int n = 0; n < 20; n++) {
+        TEST_ASSERT(frames[n]->refcount == 1);
+        esp_frame_unref(frames[n]);
+    }
+}
+
+int main() {
+    TEST_RUN(test_newer_frame_releases_everywhere);
+    TEST_RUN(test_lagging_session_is_refused);
+    TEST_RUN(test_pinned_frames_bounded);
+    return TEST_RESULT();
+}
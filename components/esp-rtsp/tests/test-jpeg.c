@@ -0,0 +1,129 @@
+//
+// Created on 18/10/2026.
+//
+
+#include <stdio.h>
+
+#include <esp_err.h>
+
+#include "rtp-jpeg.h"
+#include "test.h"
+#include "test-frames.h"
+
+/* A small baseline JPEG, the segment after SOF0 is passed in so frames
+ * with the same offsets but a different segment can be built.
+ */
+static size_t build_jpeg(uint8_t *buffer, const uint8_t *extra, size_t extra_length) {
+    static const uint8_t head[] = {
+            0xFF, 0xD8,
+            0xFF, 0xDB, 0x00, 0x43, 0x00,
+    };
+    static const uint8_t sof[] = {
+            0xFF, 0xC0, 0x00, 0x11, 0x08, 0x00, 0xF0, 0x01, 0x40, 0x03, 0x01, 0x21, 0x00, 0x02, 0x11, 0x01, 0x03, 0x11, 0x01,
+    };
+    static const uint8_t tail[] = {
+            0xFF, 0xDA, 0x00, 0x0C, 0x03, 0x01, 0x00, 0x02, 0x11, 0x03, 0x11, 0x00, 0x3F, 0x00,
+            0x12, 0x34, 0xFF, 0x00, 0x56, 0xFF, 0xD0, 0x78, 0x9A,
+            0xFF, 0xD9,
+    };
+
+    uint8_t *position = buffer;
+    memcpy(position, head, sizeof(head));
+    position += sizeof(head);
+    memset(position, 8, 64);
+    position += 64;
+    memcpy(position, sof, sizeof(sof));
+    position += sizeof(sof);
+    memcpy(position, extra, extra_length);
+    position += extra_length;
+    memcpy(position, tail, sizeof(tail));
+    position += sizeof(tail);
+
+    return position - buffer;
+}
+
+static const uint8_t dri[] = { 0xFF, 0xDD, 0x00, 0x04, 0x00, 0x28 };
+static const uint8_t com[] = { 0xFF, 0xFE, 0x00, 0x04, 'o', 'v' };
+
+static void test_corpus() {
+    for (size_t i = 0; i < test_frame_corpus_count; i++) {
+        const test_frame_spec_t *spec = &test_frame_corpus[i];
+        esp_frame_t *frame = test_frame_create(spec);
+
+        // Twice, the second decode comes from the layout cache
+        for (int pass = 0; pass < 2; pass++) {
+            esp_rtsp_jpeg_data_t jpeg_data;
+            TEST_ASSERT(esp_rtsp_jpeg_decode((char *) frame->buf, frame->len, &jpeg_data) == ESP_OK);
+            TEST_ASSERT(jpeg_data.width == spec->width && jpeg_data.height == spec->height);
+            TEST_ASSERT(jpeg_data.restart_interval == spec->restart_interval);
+            TEST_ASSERT(jpeg_data.quant_table_0 && jpeg_data.quant_table_1 && jpeg_data.huffman_tables);
+            TEST_ASSERT(jpeg_data.subsampling == JPEG_SUBSAMPLING_422);
+
+            // The scan ends at EOI, the padding after it is not sent
+            const uint8_t *end = (const uint8_t *) jpeg_data.jpeg_data_start + jpeg_data.jpeg_data_length;
+            TEST_ASSERT(end[0] == 0xFF && end[1] == 0xD9);
+        }
+
+        esp_frame_unref(frame);
+    }
+}
+
+static void test_dri_appears_at_cached_offsets() {
+    uint8_t buffer[256];
+    esp_rtsp_jpeg_data_t jpeg_data;
+
+    // A COM segment where the next frame has DRI, every other offset is the same
+    size_t length = build_jpeg(buffer, com, sizeof(com));
+    TEST_ASSERT(esp_rtsp_jpeg_decode((char *) buffer, length, &jpeg_data) == ESP_OK);
+    TEST_ASSERT(jpeg_data.restart_interval == 0);
+
+    length = build_jpeg(buffer, dri, sizeof(dri));
+    TEST_ASSERT(esp_rtsp_jpeg_decode((char *) buffer, length, &jpeg_data) == ESP_OK);
+    TEST_ASSERT(jpeg_data.restart_interval == 40);
+
+    length = build_jpeg(buffer, com, sizeof(com));
+    TEST_ASSERT(esp_rtsp_jpeg_decode((char *) buffer, length, &jpeg_data) == ESP_OK);
+    TEST_ASSERT(jpeg_data.restart_interval == 0);
+}
+
+static void test_dri_length() {
+    uint8_t buffer[256];
+    esp_rtsp_jpeg_data_t jpeg_data;
+
+    static const uint8_t short_dri[] = { 0xFF, 0xDD, 0x00, 0x02 };
+    size_t length = build_jpeg(buffer, short_dri, sizeof(short_dri));
+    TEST_ASSERT(esp_rtsp_jpeg_decode((char *) buffer, length, &jpeg_data) != ESP_OK);
+
+    static const uint8_t long_dri[] = { 0xFF, 0xDD, 0x00, 0x06, 0x00, 0x28, 0x00, 0x00 };
+    length = build_jpeg(buffer, long_dri, sizeof(long_dri));
+    TEST_ASSERT(esp_rtsp_jpeg_decode((char *) buffer, length, &jpeg_data) != ESP_OK);
+
+    // A good frame fills the cache, the same layout with a broken DRI must not be taken from it
+    length = build_jpeg(buffer, dri, sizeof(dri));
+    TEST_ASSERT(esp_rtsp_jpeg_decode((char *) buffer, length, &jpeg_data) == ESP_OK);
+    buffer[2 + 5 + 64 + 19 + 3] = 0x06;
+    TEST_ASSERT(esp_rtsp_jpeg_decode((char *) buffer, length, &jpeg_data) != ESP_OK);
+}
+
+static void test_restart_markers() {
+    uint8_t buffer[256];
+    esp_rtsp_jpeg_data_t jpeg_data;
+
+    size_t length = build_jpeg(buffer, dri, sizeof(dri));
+    TEST_ASSERT(esp_rtsp_jpeg_decode((char *) buffer, length, &jpeg_data) == ESP_OK);
+
+    // The stuffed 0xFF 0x00 is no marker, the first restart marker follows it
+    const char *start = jpeg_data.jpeg_data_start;
+    const char *end = start + jpeg_data.jpeg_data_length;
+    const char *next = esp_rtsp_jpeg_next_restart(start, end);
+    TEST_ASSERT(next == start + 7);
+    TEST_ASSERT(esp_rtsp_jpeg_next_restart(next, end) == NULL);
+}
+
+int main() {
+    TEST_RUN(test_corpus);
+    TEST_RUN(test_dri_appears_at_cached_offsets);
+    TEST_RUN(test_dri_length);
+    TEST_RUN(test_restart_markers);
+    return TEST_RESULT();
+}
@@ -0,0 +1,250 @@
+//
+// Created on 18/10/2026.
+//
+
+/* Requests as they arrive on a connection: split over several reads,
+ * several in one read, with a body, with bare LF line ends and with headers
+ * longer than the 1 KB the first parser could hold.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp-rtsp-common.h"
+#include "test.h"
+
+static const char SETUP_REQUEST[] =
+        "SETUP rtsp://192.168.1.10/stream/track1 RTSP/1.0\r\n"
+        "CSeq: 5\r\n"
+        "User-Agent: LibVLC/3.0.18 (LIVE555 Streaming Media v2016.11.28)\r\n"
+        "Transport: RTP/AVP;unicast;client_port=5000-5001\r\n"
+        "Blocksize: 1400\r\n"
+        "\r\n";
+
+static const char OPTIONS_REQUEST[] =
+        "OPTIONS rtsp://192.168.1.10/stream RTSP/1.0\r\n"
+        "CSeq: 6\r\n"
+        "\r\n";
+
+static char buffer[4096];
+
+static void check_setup(rtsp_req_t *request) {
+    TEST_ASSERT(request->request_type == SETUP);
+    TEST_ASSERT(request->cseq == 5);
+    TEST_ASSERT(request->url_length == strlen("rtsp://192.168.1.10/stream/track1"));
+    TEST_ASSERT(strncmp(request->url, "rtsp://192.168.1.10/stream/track1", request->url_length) == 0);
+    TEST_ASSERT(request->dst_rtp_port == 5000);
+    TEST_ASSERT(request->dst_rtcp_port == 5001);
+    TEST_ASSERT(!request->rtcp_mux);
+    TEST_ASSERT(request->blocksize == 1400);
+}
+
+static void test_partial_reads() {
+    rtsp_parser_handle_t parser;
+    TEST_ASSERT(rtsp_parser_init(&parser) == PARSER_OK);
+
+    // One more byte per read, the parser resumes the search where it stopped
+    size_t length = strlen(SETUP_REQUEST);
+    memcpy(buffer, SETUP_REQUEST, length);
+    int consumed = 0;
+    size_t received;
+    for (received = 1; received <= length && consumed == 0; received++) {
+        consumed = parse_request(parser, buffer, received);
+    }
+
+    int complete = parser_is_complete(parser);
+    int error = parser_get_error(parser);
+    rtsp_req_t request = *parser_get_request(parser);
+    parser_free(parser);
+
+    TEST_ASSERT(consumed == length);
+    TEST_ASSERT(received - 1 == length);
+    TEST_ASSERT(complete && error == 0);
+    check_setup(&request);
+}
+
+static void test_pipelined_requests() {
+    rtsp_parser_handle_t parser;
+    TEST_ASSERT(rtsp_parser_init(&parser) == PARSER_OK);
+
+    size_t setup_length = strlen(SETUP_REQUEST);
+    size_t length = snprintf(buffer, sizeof(buffer), "%s%s", SETUP_REQUEST, OPTIONS_REQUEST);
+
+    // Only the first request is taken, the rest is left for the next call
+    int first = parse_request(parser, buffer, length);
+    rtsp_req_t setup = *parser_get_request(parser);
+
+    parser_reset(parser);
+    int second = parse_request(parser, buffer + first, length - first);
+    int complete = parser_is_complete(parser);
+    rtsp_req_t options = *parser_get_request(parser);
+    parser_free(parser);
+
+    TEST_ASSERT(first == setup_length);
+    check_setup(&setup);
+    TEST_ASSERT(second == length - setup_length);
+    TEST_ASSERT(complete);
+    TEST_ASSERT(options.request_type == OPTIONS);
+    TEST_ASSERT(options.cseq == 6);
+}
+
+static void test_bare_lf() {
+    rtsp_parser_handle_t parser;
+    TEST_ASSERT(rtsp_parser_init(&parser) == PARSER_OK);
+
+    // Mixed line ends, the request still ends at the first empty line
+    const char *request_text =
+            "SETUP rtsp://192.168.1.10/stream/track1 RTSP/1.0\n"
+            "CSeq: 5\r\n"
+            "Transport: RTP/AVP;unicast;client_port=5000-5001\n"
+            "Blocksize: 1400\n"
+            "\n"
+            "OPTIONS";
+    size_t length = strlen(request_text);
+    memcpy(buffer, request_text, length);
+
+    int consumed = parse_request(parser, buffer, length);
+    int complete = parser_is_complete(parser);
+    int error = parser_get_error(parser);
+    rtsp_req_t request = *parser_get_request(parser);
+    parser_free(parser);
+
+    TEST_ASSERT(consumed == length - strlen("OPTIONS"));
+    TEST_ASSERT(complete && error == 0);
+    check_setup(&request);
+}
+
+static void test_pipelined_body() {
+    rtsp_parser_handle_t parser;
+    TEST_ASSERT(rtsp_parser_init(&parser) == PARSER_OK);
+
+    // The body ends in a blank line and looks like a request, only Content-Length tells it apart
+    const char *body = "\r\nOPTIONS x RTSP/1.0\r\n\r\n";
+    size_t length = snprintf(buffer, sizeof(buffer),
+                             "SET_PARAMETER rtsp://192.168.1.10/stream RTSP/1.0\r\n"
+                             "CSeq: 7\r\n"
+                             "Content-Type: text/parameters\r\n"
+                             "Content-length:  %d \r\n"
+                             "\r\n"
+                             "%s%s", (int) strlen(body), body, OPTIONS_REQUEST);
+    size_t request_length = length - strlen(OPTIONS_REQUEST);
+
+    // Nothing is taken until the whole body is there
+    int partial = parse_request(parser, buffer, request_length - 1);
+    int first = parse_request(parser, buffer, length);
+    rtsp_req_t set_parameter = *parser_get_request(parser);
+    int error = parser_get_error(parser);
+
+    parser_reset(parser);
+    int second = parse_request(parser, buffer + first, length - first);
+    int complete = parser_is_complete(parser);
+    rtsp_req_t options = *parser_get_request(parser);
+    parser_free(parser);
+
+    TEST_ASSERT(partial == 0);
+    TEST_ASSERT(first == request_length);
+    TEST_ASSERT(error == 0);
+    TEST_ASSERT(set_parameter.request_type == UNSUPPORTED);
+    TEST_ASSERT(set_parameter.cseq == 7);
+    TEST_ASSERT(second == strlen(OPTIONS_REQUEST));
+    TEST_ASSERT(complete);
+    TEST_ASSERT(options.request_type == OPTIONS);
+    TEST_ASSERT(options.cseq == 6);
+}
+
+static void test_invalid_content_length() {
+    rtsp_parser_handle_t parser;
+    TEST_ASSERT(rtsp_parser_init(&parser) == PARSER_OK);
+
+    size_t length = snprintf(buffer, sizeof(buffer), "SET_PARAMETER rtsp://x RTSP/1.0\r\nCSeq: 8\r\nContent-Length: 12a\r\n\r\n");
+    int consumed = parse_request(parser, buffer, length);
+    int error = parser_get_error(parser);
+    parser_free(parser);
+
+    TEST_ASSERT(consumed == length);
+    TEST_ASSERT(error == 400);
+}
+
+static void test_long_headers() {
+    rtsp_parser_handle_t parser;
+    TEST_ASSERT(rtsp_parser_init(&parser) == PARSER_OK);
+
+    // Headers of 2 KB in front of the ones we need
+    size_t length = snprintf(buffer, sizeof(buffer), "SETUP rtsp://192.168.1.10/stream/track1 RTSP/1.0\r\nX-Padding: ");
+    memset(buffer + length, 'a', 2000);
+    length += 2000;
+    length += snprintf(buffer + length, sizeof(buffer) - length, "\r\n%s", SETUP_REQUEST + strlen("SETUP rtsp://192.168.1.10/stream/track1 RTSP/1.0\r\n"));
+
+    // Arriving in reads of 100 bytes, a read ends in the middle of the long header
+    int consumed = 0;
+    for (size_t received = 100; consumed == 0; received += 100) {
+        consumed = parse_request(parser, buffer, received < length ? received : length);
+    }
+
+    int complete = parser_is_complete(parser);
+    int error = parser_get_error(parser);
+    rtsp_req_t request = *parser_get_request(parser);
+    parser_free(parser);
+
+    TEST_ASSERT(length > 2048);
+    TEST_ASSERT(consumed == length);
+    TEST_ASSERT(complete && error == 0);
+    check_setup(&request);
+}
+
+static void test_transport_ports() {
+    const char *transports[] = {
+            "RTP/AVP;unicast;client_port=5000",
+            "RTP/AVP;unicast;client_port=5000;RTCP-mux",
+    };
+
+    rtsp_req_t requests[2];
+    for (int i = 0; i < 2; i++) {
+        rtsp_parser_handle_t parser;
+        TEST_ASSERT(rtsp_parser_init(&parser) == PARSER_OK);
+
+        size_t length = snprintf(buffer, sizeof(buffer), "SETUP rtsp://x/track1 RTSP/1.0\r\nCSeq: 3\r\nTransport: %s\r\n\r\n", transports[i]);
+        parse_request(parser, buffer, length);
+        requests[i] = *parser_get_request(parser);
+        parser_free(parser);
+    }
+
+    // A single port is RTP with RTCP on the next port, only RTCP-mux puts both on one port
+    TEST_ASSERT(requests[0].dst_rtp_port == 5000 && requests[0].dst_rtcp_port == 5001 && !requests[0].rtcp_mux);
+    TEST_ASSERT(requests[1].dst_rtp_port == 5000 && requests[1].rtcp_mux);
+}
+
+static void test_interleaved_channels() {
+    rtsp_parser_handle_t parser;
+    TEST_ASSERT(rtsp_parser_init(&parser) == PARSER_OK);
+
+    size_t length = snprintf(buffer, sizeof(buffer), "SETUP rtsp://x/track1 RTSP/1.0\r\nCSeq: 3\r\n"
+                                                     "Transport: RTP/AVP/TCP;unicast;interleaved=2-3;mode=play\r\n\r\n");
+    parse_request(parser, buffer, length);
+    int error = parser_get_error(parser);
+    rtsp_req_t request = *parser_get_request(parser);
+    parser_free(parser);
+
+    TEST_ASSERT(error == 0);
+    TEST_ASSERT(request.interleaved);
+    TEST_ASSERT(request.rtp_channel == 2 && request.rtcp_channel == 3);
+}
+
+int main() {
+    if (rtsp_parser_pool_create(1) != PARSER_OK) {
+        return 1;
+    }
+
+    TEST_RUN(test_partial_reads);
+    TEST_RUN(test_pipelined_requests);
+    TEST_RUN(test_pipelined_body);
+    TEST_RUN(test_invalid_content_length);
+    TEST_RUN(test_bare_lf);
+    TEST_RUN(test_long_headers);
+    TEST_RUN(test_transport_ports);
+    TEST_RUN(test_interleaved_channels);
+
+    rtsp_parser_pool_destroy();
+    return TEST_RESULT();
+}
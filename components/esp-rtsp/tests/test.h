@@ -0,0 +1,31 @@
+//
+// Created on 18/10/2026.
+//
+
+#ifndef ESPCAM_TEST_H
+#define ESPCAM_TEST_H
+
+#include <stdio.h>
+
+/* Just enough of a test framework, a failed assertion is reported and the
+ * test function returns, the other tests still run.
+ */
+static int test_failures;
+
+#define TEST_ASSERT(condition) do {                                             \
+        if (!(condition)) {                                                     \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #condition); \
+            test_failures++;                                                    \
+            return;                                                             \
+        }                                                                       \
+    } while (0)
+
+#define TEST_RUN(test) do {                                                     \
+        int failures_before = test_failures;                                    \
+        test();                                                                 \
+        printf("%s %s\n", failures_before == test_failures ? "PASS" : "FAIL", #test); \
+    } while (0)
+
+#define TEST_RESULT() (test_failures ? 1 : 0)
+
+#endif //ESPCAM_TEST_H
@@ -8,6 +8,8 @@
 #include "driver/gpio.h"
 #include "esp_log.h"
 #include "esp_camera.h"
+#include "sdkconfig.h"
+#include "esp-frame.h"
 
 #include "common.h"
 
@@ -38,10 +40,11 @@ static camera_config_t camera_config = {
         .ledc_channel = LEDC_CHANNEL_0,
 
         .pixel_format = PIXFORMAT_JPEG,//YUV422,GRAYSCALE,RGB565,JPEG
+        // With CONFIG_ESP_RTSP_ADAPT these are the highest settings, the stream steps down from here
         .frame_size = FRAMESIZE_SVGA,//QQVGA-QXGA Do not use sizes above QVGA when not JPEG
 
         .jpeg_quality = 12, //0-63 lower number means higher quality
-        .fb_count = 1 //if more than one, i2s runs in continuous mode. Use only with JPEG
+        .fb_count = CONFIG_ESP_FRAME_FB_COUNT //if more than one, i2s runs in continuous mode. Use only with JPEG
 };
 
 
@@ -67,21 +70,12 @@ esp_err_t esp32cam_camera_init() {
         return err;
     }
 
-    return ESP_OK;
-}
-
-esp_err_t esp32cam_camera_capture(esp_err_t(*handler)(uint8_t *buffer, size_t len)) {
-    //acquire a frame
-    camera_fb_t * fb = esp_camera_fb_get();
-    if (!fb) {
-        ESP_LOGE(TAG, "Camera Capture Failed");
-        return ESP_FAIL;
+    // From here on only the frame source task talks to the camera
+    err = esp_frame_source_start();
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start frame source");
+        return err;
     }
 
-    esp_err_t err = handler(fb->buf, fb->len);
-
-    //return the frame buffer back to the driver for reuse
-    esp_camera_fb_return(fb);
-
-    return err;
-}
\ No newline at end of file
+    return ESP_OK;
+}
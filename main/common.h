@@ -45,7 +45,6 @@ typedef struct {
 esp_err_t esp32cam_wifi_init(espcam_wifi_config_t *wifi_config);
 
 esp_err_t esp32cam_camera_init();
-esp_err_t esp32cam_camera_capture(esp_err_t(*handler)(uint8_t *fb, size_t fb_len));
 
 esp_err_t esp32cam_mqtt_init();
 esp_err_t esp32cam_mqtt_connect(espcam_aws_iot_config_t *aws_iot_config, espcam_tls_config_t *tls_config);
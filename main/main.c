@@ -26,6 +26,7 @@
 #include "sdkconfig.h"
 
 #include "esp-rtsp.h"
+#include "esp-frame.h"
 #include "common.h"
 
 #define TAG "main"
@@ -126,6 +127,8 @@ esp_err_t load_app_config() {
 char image_buffer[65536];
 size_t image_size;
 
+#define MQTT_PUBLISH_INTERVAL_MS (5 * 1000)
+
 #define MQTT_CONNECTED BIT0
 #define MQTT_DISCONNECTED BIT1
 EventGroupHandle_t s_mqtt_event_group;
@@ -196,20 +199,33 @@ void app_main()
     ESP_ERROR_CHECK(result);
     ESP_LOGI(TAG, "MQTT connected OK");
 
+    esp_rtsp_server_config_t rtsp_server_config = ESP_RTSP_SERVER_DEFAULT_CONFIG();
     esp_rtsp_server_handle_t rtsp_server_handle;
-    ESP_ERROR_CHECK(esp_rtsp_server_start(&rtsp_server_handle));
-    ESP_LOGI(TAG, "RTSP server started on port 554");
+    ESP_ERROR_CHECK(esp_rtsp_server_start(&rtsp_server_handle, &rtsp_server_config));
+    ESP_LOGI(TAG, "RTSP server started on port %d", rtsp_server_config.port);
+
+    esp_frame_mailbox_handle_t mqtt_mailbox;
+    ESP_ERROR_CHECK(esp_frame_mailbox_create(&mqtt_mailbox));
+
+    esp_frame_subscription_handle_t mqtt_subscription;
+    ESP_ERROR_CHECK(esp_frame_subscribe(MQTT_PUBLISH_INTERVAL_MS, esp_frame_mailbox_handler, mqtt_mailbox, &mqtt_subscription));
 
     for(;;) {
-        err = esp32cam_camera_capture(&esp32cam_mqtt_publish);
+        esp_frame_t *frame = esp_frame_mailbox_take(mqtt_mailbox, portMAX_DELAY);
+        if (!frame) {
+            continue;
+        }
+
+        err = esp32cam_mqtt_publish(frame->buf, frame->len);
         if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Failed to capture image: %d", err);
+            ESP_LOGE(TAG, "Failed to publish image: %d", err);
         }
+        esp_frame_unref(frame);
 
         ESP_LOGD(TAG, "Free heap: %d, internal %d", esp_get_free_heap_size(), esp_get_free_internal_heap_size());
-        vTaskDelay(pdMS_TO_TICKS(5 * 1000));
     }
 
+    ESP_ERROR_CHECK(esp_frame_unsubscribe(mqtt_subscription));
     ESP_ERROR_CHECK(esp_rtsp_server_stop(rtsp_server_handle));
     ESP_ERROR_CHECK(esp32cam_mqtt_disconnect());
 }
\ No newline at end of file